@@ -3,6 +3,7 @@
  */
 
 #include <fcntl.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -10,15 +11,18 @@
 #include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <ROOT/RDataFrame.hxx>
 #include <ROOT/RNTupleReader.hxx>
 #include <ROOT/RNTupleReadOptions.hxx>
+#include <ROOT/RNTupleView.hxx>
 #include <Compression.h>
 #include <TApplication.h>
 #include <TBranch.h>
@@ -41,24 +45,60 @@
 
 #include <Math/Vector4D.h>
 
+#include "cutflow.h"
+#include "io_engine.h"
+#include "kinematics.h"
+#include "ntuple_pages.h"
+#include "tree_bulk.h"
+#include "timeline.h"
 #include "util.h"
 
 bool g_perf_stats = false;
 bool g_show = false;
 int g_cluster_bunch_size = 1;
-
-static ROOT::Experimental::RNTupleReadOptions GetRNTupleOptions() {
+unsigned g_n_threads = 1;
+/// Negative: follow -m, zero: decompress on the reading thread, positive: size of the unzip thread pool
+int g_unzip_threads = -1;
+/// Set if implicit multi-threading is only turned on for the unzip threads, i.e. -u without -m
+bool g_unzip_threads_only_mt = false;
+unsigned g_memory_budget_mb = 0;
+IoEngines g_io_engine = IoEngines::kPread;
+bool g_bulk = false;
+bool g_rdf_optimized = false;
+bool g_spans = false;
+bool g_json = false;
+bool g_hw_counters = false;
+bool g_cutflow = false;
+std::string g_timeline_path;
+AnalysisResults g_results;
+
+static ROOT::Experimental::RNTupleReadOptions GetRNTupleOptions(const std::string &ntupleName,
+                                                                const std::string &path)
+{
    using RNTupleReadOptions = ROOT::Experimental::RNTupleReadOptions;
 
+   int clusterBunchSize = g_cluster_bunch_size;
+   if (g_memory_budget_mb > 0) {
+      clusterBunchSize =
+         CapClusterBunchSize(clusterBunchSize, GetAverageClusterSize(ntupleName, path), g_memory_budget_mb);
+   }
+
    RNTupleReadOptions options;
-   if (g_cluster_bunch_size < 1) {
+   if (clusterBunchSize < 1) {
       options.SetClusterCache(RNTupleReadOptions::EClusterCache::kOff);
    } else {
-      options.SetClusterBunchSize(g_cluster_bunch_size);
+      options.SetClusterBunchSize(clusterBunchSize);
    }
+   if (g_unzip_threads == 0)
+      options.SetUseImplicitMT(RNTupleReadOptions::EImplicitMT::kOff);
+   PrintPrefetchSettings(clusterBunchSize, g_unzip_threads != 0, g_memory_budget_mb, g_unzip_threads_only_mt);
    return options;
 }
 
+/// Stages of the cut flow profile (-f)
+enum ECutFlowStages { kStageTrigger, kStagePhotonId, kStageIsolation, kStageKinematics };
+static const std::vector<std::string> kCutFlowStages{"trigP", "photonID", "isolation", "kinematics"};
+
 
 static void Show(TH1D *data, TH1D *ggH, TH1D *VBF, TH1F *hCut = nullptr) {
    auto app = TApplication("", nullptr, nullptr);
@@ -213,75 +253,117 @@ static void Show(TH1D *data, TH1D *ggH, TH1D *VBF, TH1F *hCut = nullptr) {
 static float ComputeInvariantMass(
    float pt0, float pt1, float eta0, float eta1, float phi0, float phi1, float e0, float e1)
 {
-    ROOT::Math::PtEtaPhiEVector p1(pt0, eta0, phi0, e0);
-    ROOT::Math::PtEtaPhiEVector p2(pt1, eta1, phi1, e1);
-    return (p1 + p2).mass() / 1000.0;
+    return kinematics::PtEtaPhiEMass(pt0, eta0, phi0, e0, pt1, eta1, phi1, e1) / 1000.0;
 }
 
 
-static TH1F * ProcessNTuple(ROOT::Experimental::RNTupleReader *ntuple, TH1D *hMass, bool isMC,
-                            unsigned *runtime_init, unsigned *runtime_analyze)
+/// If source is given, the fixed-size trigger and photon count fields are mapped page-wise from it and provide a
+/// pre-selection window; the photon vectors are still read through views of the reader for the surviving entries.
+static void ProcessNTupleRange(ROOT::Experimental::RNTupleReader &ntuple, const EntryRange &range,
+                               TH1D *hMass, TH1F *hCut, bool isMC,
+                               ROOT::Experimental::Internal::RPageSource *source, CutFlow *cutFlow)
 {
-   auto ts_init = std::chrono::steady_clock::now();
-   auto hCut = new TH1F("", "Selected", 10000, 0, 8000000);
-   hCut->SetDirectory(0);
-
-   auto viewTrigP           = ntuple->GetView<bool>("trigP");
-   auto viewPhotonN         = ntuple->GetView<std::uint32_t>("photon_n");
-   auto viewPhotonIsTightId = ntuple->GetView<std::vector<bool>>("photon_isTightID");
-   auto viewPhotonPt        = ntuple->GetView<std::vector<float>>("photon_pt");
-   auto viewPhotonEta       = ntuple->GetView<std::vector<float>>("photon_eta");
-   auto viewPhotonPhi       = ntuple->GetView<std::vector<float>>("photon_phi");
-   auto viewPhotonE         = ntuple->GetView<std::vector<float>>("photon_E");
-   auto viewPhotonPtCone30  = ntuple->GetView<std::vector<float>>("photon_ptcone30");
-   auto viewPhotonEtCone20  = ntuple->GetView<std::vector<float>>("photon_etcone20");
-
-   auto viewScaleFactorPhoton        = ntuple->GetView<float>("scaleFactor_PHOTON");
-   auto viewScaleFactorPhotonTrigger = ntuple->GetView<float>("scaleFactor_PhotonTRIGGER");
-   auto viewScaleFactorPileUp        = ntuple->GetView<float>("scaleFactor_PILEUP");
-   auto viewMcWeight                 = ntuple->GetView<float>("mcWeight");
+   using ViewTrigP = decltype(ntuple.GetView<bool>("trigP"));
+   using ViewPhotonN = decltype(ntuple.GetView<std::uint32_t>("photon_n"));
+   // Views connect their columns to the reader's page source, so they are only created if they are read
+   std::unique_ptr<ViewTrigP> viewTrigP;
+   std::unique_ptr<ViewPhotonN> viewPhotonN;
+   std::unique_ptr<NTuplePageSpans<bool>> pagesTrigP;
+   std::unique_ptr<NTuplePageSpans<std::uint32_t>> pagesPhotonN;
+   std::vector<unsigned char> prePass;
+   std::uint64_t windowFirst = range.first;
+   std::uint64_t windowEnd = range.first;
+   if (source) {
+      pagesTrigP = std::make_unique<NTuplePageSpans<bool>>(*source, "trigP");
+      pagesPhotonN = std::make_unique<NTuplePageSpans<std::uint32_t>>(*source, "photon_n");
+      // trigP is a bool column, which is always bit-packed on disk and unpacked into the page buffer
+      pagesPhotonN->WarnIfNotPlainCopy();
+   } else {
+      viewTrigP = std::make_unique<ViewTrigP>(ntuple.GetView<bool>("trigP"));
+      viewPhotonN = std::make_unique<ViewPhotonN>(ntuple.GetView<std::uint32_t>("photon_n"));
+   }
+   auto viewPhotonIsTightId = ntuple.GetView<std::vector<bool>>("photon_isTightID");
+   auto viewPhotonPt        = ntuple.GetView<std::vector<float>>("photon_pt");
+   auto viewPhotonEta       = ntuple.GetView<std::vector<float>>("photon_eta");
+   auto viewPhotonPhi       = ntuple.GetView<std::vector<float>>("photon_phi");
+   auto viewPhotonE         = ntuple.GetView<std::vector<float>>("photon_E");
+   auto viewPhotonPtCone30  = ntuple.GetView<std::vector<float>>("photon_ptcone30");
+   auto viewPhotonEtCone20  = ntuple.GetView<std::vector<float>>("photon_etcone20");
+
+   auto viewScaleFactorPhoton        = ntuple.GetView<float>("scaleFactor_PHOTON");
+   auto viewScaleFactorPhotonTrigger = ntuple.GetView<float>("scaleFactor_PhotonTRIGGER");
+   auto viewScaleFactorPileUp        = ntuple.GetView<float>("scaleFactor_PILEUP");
+   auto viewMcWeight                 = ntuple.GetView<float>("mcWeight");
 
    unsigned nevents = 0;
-   std::chrono::steady_clock::time_point ts_first;
-   for (auto e : ntuple->GetEntryRange()) {
+   TimelineLoop loop(range.first, range.second, [&] { return GetClusterStarts(ntuple.GetDescriptor()); });
+   for (auto e : ROOT::Experimental::RNTupleGlobalRange(range.first, range.second)) {
+      loop.Next(e);
       nevents++;
       if ((nevents % 100000) == 0) {
          printf("processed %u k events\n", nevents / 1000);
          //printf("dummy is %lf\n", dummy); abort();
       }
-      if (nevents == 1) {
-         ts_first = std::chrono::steady_clock::now();
-      }
 
-      if (!viewTrigP(e)) continue;
+      std::uint32_t photonN;
+      if (source) {
+         if (e == windowEnd) {
+            auto trigP = pagesTrigP->Get(e);
+            auto nPhotons = pagesPhotonN->Get(e);
+            windowFirst = e;
+            windowEnd = std::min({std::uint64_t(range.second), e + trigP.size(), e + nPhotons.size()});
+            prePass.resize(windowEnd - windowFirst);
+            // Two good photons are required below
+            for (std::size_t j = 0; j < prePass.size(); ++j)
+               prePass[j] = trigP[j] & (nPhotons[j] >= 2);
+         }
+         if (!prePass[e - windowFirst]) continue;
+         photonN = pagesPhotonN->Get(e)[0];
+      } else {
+         {
+            CutFlowRAII stage(cutFlow, kStageTrigger);
+            if (!stage.Pass((*viewTrigP)(e))) continue;
+         }
+         photonN = (*viewPhotonN)(e);
+      }
 
       std::vector<size_t> idxGood;
-      auto isTightId = viewPhotonIsTightId(e);
-      auto pt = viewPhotonPt(e);
-      auto eta = viewPhotonEta(e);
-
-      for (size_t i = 0; i < viewPhotonN(e); ++i) {
-         if (!isTightId[i]) continue;
-         if (pt[i] <= 25000.) continue;
-         if (abs(eta[i]) >= 2.37) continue;
-         if (abs(eta[i]) >= 1.37 && abs(eta[i]) <= 1.52) continue;
-         idxGood.push_back(i);
+      std::vector<float> pt;
+      std::vector<float> eta;
+      {
+         CutFlowRAII stage(cutFlow, kStagePhotonId);
+         auto isTightId = viewPhotonIsTightId(e);
+         pt = viewPhotonPt(e);
+         eta = viewPhotonEta(e);
+
+         for (size_t i = 0; i < photonN; ++i) {
+            if (!isTightId[i]) continue;
+            if (pt[i] <= 25000.) continue;
+            if (abs(eta[i]) >= 2.37) continue;
+            if (abs(eta[i]) >= 1.37 && abs(eta[i]) <= 1.52) continue;
+            idxGood.push_back(i);
+         }
+         if (!stage.Pass(idxGood.size() == 2)) continue;
       }
-      if (idxGood.size() != 2) continue;
-
-      auto ptCone30 = viewPhotonPtCone30(e);
-      auto etCone20 = viewPhotonEtCone20(e);
 
-      bool isIsolatedPhotons = true;
-      for (int i = 0; i < 2; ++i) {
-         if ((ptCone30[idxGood[i]] / pt[idxGood[i]] >= 0.065) ||
-             (etCone20[idxGood[i]] / pt[idxGood[i]] >= 0.065))
-         {
-           isIsolatedPhotons = false;
-           break;
+      {
+         CutFlowRAII stage(cutFlow, kStageIsolation);
+         auto ptCone30 = viewPhotonPtCone30(e);
+         auto etCone20 = viewPhotonEtCone20(e);
+
+         bool isIsolatedPhotons = true;
+         for (int i = 0; i < 2; ++i) {
+            if ((ptCone30[idxGood[i]] / pt[idxGood[i]] >= 0.065) ||
+                (etCone20[idxGood[i]] / pt[idxGood[i]] >= 0.065))
+            {
+              isIsolatedPhotons = false;
+              break;
+            }
          }
+         if (!stage.Pass(isIsolatedPhotons)) continue;
       }
-      if (!isIsolatedPhotons) continue;
+
+      CutFlowRAII stage(cutFlow, kStageKinematics);
 
       auto phi = viewPhotonPhi(e);
       auto E = viewPhotonE(e);
@@ -296,6 +378,7 @@ static TH1F * ProcessNTuple(ROOT::Experimental::RNTupleReader *ntuple, TH1D *hMa
       if (pt[idxGood[1]] / 1000. / myy <= 0.25) continue;
       if (myy <= 105) continue;
       if (myy >= 160) continue;
+      stage.Pass(true);
 
       hCut->Fill(e);
 
@@ -308,10 +391,81 @@ static TH1F * ProcessNTuple(ROOT::Experimental::RNTupleReader *ntuple, TH1D *hMa
       }
 
    }
+}
+
+
+/// Runs the selection on the cluster-aligned entry ranges of the ntuple, one thread per range, and merges the
+/// partial histograms into hMass.  Returns the histogram of selected entry numbers.  The path and options are
+/// used to open the page sources in span mode.
+static TH1F * ProcessNTuple(ROOT::Experimental::RNTupleReader &ntuple, const std::string &path,
+                            const ROOT::Experimental::RNTupleReadOptions &options, TH1D *hMass, bool isMC,
+                            unsigned *runtime_init, unsigned *runtime_analyze)
+{
+   using RNTupleReader = ROOT::Experimental::RNTupleReader;
+
+   auto ts_init = std::chrono::steady_clock::now();
+   auto hCut = new TH1F("", "Selected", 10000, 0, 8000000);
+   hCut->SetDirectory(0);
+
+   // The first worker uses the given reader and histograms
+   auto ranges = PartitionEntries(GetClusterStarts(ntuple.GetDescriptor()), ntuple.GetNEntries(), g_n_threads);
+   std::vector<std::unique_ptr<RNTupleReader>> clones;
+   std::vector<RNTupleReader *> readers{&ntuple};
+   std::vector<TH1D *> partials_mass{hMass};
+   std::vector<TH1F *> partials_cut{hCut};
+   for (unsigned i = 1; i < ranges.size(); ++i) {
+      clones.emplace_back(CloneNTupleReader(ntuple, "mini", path, options, g_io_engine));
+      if (g_perf_stats || g_hw_counters || g_cutflow)
+         clones.back()->EnableMetrics();
+      readers.emplace_back(clones.back().get());
+      partials_mass.emplace_back(static_cast<TH1D *>(hMass->Clone()));
+      partials_mass.back()->SetDirectory(nullptr);
+      partials_cut.emplace_back(static_cast<TH1F *>(hCut->Clone()));
+      partials_cut.back()->SetDirectory(nullptr);
+   }
+   std::vector<std::unique_ptr<ROOT::Experimental::Internal::RPageSource>> sources;
+   for (unsigned i = 0; g_spans && i < ranges.size(); ++i) {
+      sources.emplace_back(OpenNTuplePageSource("mini", path, options, g_io_engine));
+      sources.back()->Attach();
+      if (g_perf_stats || g_hw_counters)
+         sources.back()->GetMetrics().Enable();
+   }
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < ranges.size(); ++i) {
+      cutFlows.emplace_back(kCutFlowStages);
+      cutFlows.back().SetBytesCounter(GetNTupleBytesCounter(readers[i]->GetMetrics()));
+   }
+
+   auto ts_first = std::chrono::steady_clock::now();
+   MarkPerfPhase("init");
+   RunInThreads(ranges.size(), [&](unsigned i) {
+      ProcessNTupleRange(*readers[i], ranges[i], partials_mass[i], partials_cut[i], isMC,
+                         g_spans ? sources[i].get() : nullptr, g_cutflow ? &cutFlows[i] : nullptr);
+   });
+   for (unsigned i = 1; i < ranges.size(); ++i) {
+      hMass->Add(partials_mass[i]);
+      hCut->Add(partials_cut[i]);
+      delete partials_mass[i];
+      delete partials_cut[i];
+   }
 
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
    *runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
    *runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
+   if (g_perf_stats) {
+      for (auto r : readers)
+         r->PrintInfo(ROOT::Experimental::ENTupleInfo::kMetrics);
+      for (const auto &s : sources)
+         s->GetMetrics().Print(std::cout);
+   }
+   if (g_perf_stats || g_hw_counters) {
+      for (auto r : readers)
+         AddNTupleMetrics(*r, &g_results);
+      for (const auto &s : sources)
+         AddNTupleMetrics(s->GetMetrics(), &g_results);
+   }
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
    return hCut;
 }
 
@@ -325,26 +479,26 @@ static void NTupleDirect(const std::string &pathData, const std::string &path_gg
 
    unsigned int runtime_init;
    unsigned int runtime_analyze;
-   auto options = GetRNTupleOptions();
+   auto options = GetRNTupleOptions("mini", pathData);
 
    auto hData = new TH1D("", "Diphoton invariant mass; m_{#gamma#gamma} [GeV];Events", 30, 105, 160);
    auto hggH = new TH1D("", "Diphoton invariant mass; m_{#gamma#gamma} [GeV];Events", 30, 105, 160);
    auto hVBF = new TH1D("", "Diphoton invariant mass; m_{#gamma#gamma} [GeV];Events", 30, 105, 160);
 
-   auto ntuple = RNTupleReader::Open("mini", pathData, options);
-   if (g_perf_stats)
+   auto ntuple = OpenNTupleReader(nullptr, "mini", pathData, options, g_io_engine);
+   // The cut flow takes the bytes read from the metrics
+   if (g_perf_stats || g_hw_counters || g_cutflow)
       ntuple->EnableMetrics();
-   auto hCut = ProcessNTuple(ntuple.get(), hData, false /* isMC */, &runtime_init, &runtime_analyze);
-   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
-   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
-   if (g_perf_stats)
-      ntuple->PrintInfo(ROOT::Experimental::ENTupleInfo::kMetrics);
+   auto hCut = ProcessNTuple(*ntuple, pathData, options, hData, false /* isMC */, &runtime_init, &runtime_analyze);
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   g_results.events_read = ntuple->GetNEntries();
+   g_results.events_selected = hData->GetEntries();
 
 
 //   ntuple = RNTupleReader::Open("mini", path_ggH, options);
 //   if (g_perf_stats)
 //      ntuple->EnableMetrics();
-//   ProcessNTuple(ntuple.get(), hggH, true /* isMC */, &runtime_init, &runtime_analyze);
+//   ProcessNTuple(*ntuple, hggH, true /* isMC */, &runtime_init, &runtime_analyze);
 //   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
 //   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
 //   if (g_perf_stats)
@@ -353,7 +507,7 @@ static void NTupleDirect(const std::string &pathData, const std::string &path_gg
 //   ntuple = RNTupleReader::Open("mini", pathVBF, options);
 //   if (g_perf_stats)
 //      ntuple->EnableMetrics();
-//   ProcessNTuple(ntuple.get(), hVBF, true /* isMC */, &runtime_init, &runtime_analyze);
+//   ProcessNTuple(*ntuple, hVBF, true /* isMC */, &runtime_init, &runtime_analyze);
 //   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
 //   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
 //   if (g_perf_stats)
@@ -369,14 +523,9 @@ static void NTupleDirect(const std::string &pathData, const std::string &path_gg
 }
 
 
-static TH1F * ProcessTree(TTree *tree, TH1D *hMass, bool isMC,
-                        unsigned *runtime_init, unsigned *runtime_analyze)
+static void ProcessTreeRange(TTree *tree, const EntryRange &range, TH1D *hMass, TH1F *hCut, bool isMC,
+                             CutFlow *cutFlow)
 {
-   auto ts_init = std::chrono::steady_clock::now();
-
-   auto hCut = new TH1F("", "Selected", 10000, 0, 8000000);
-   hCut->SetDirectory(0);
-
    TBranch *brTrigP                    = nullptr;
    TBranch *brPhotonN                  = nullptr;
    TBranch *brPhotonIsTightId          = nullptr;
@@ -419,50 +568,87 @@ static TH1F * ProcessTree(TTree *tree, TH1D *hMass, bool isMC,
    tree->SetBranchAddress("scaleFactor_PILEUP", &scaleFactor_PILEUP, &brScaleFactorPileUp);
    tree->SetBranchAddress("mcWeight", &mcWeight, &brMcWeight);
 
-   auto nEntries = tree->GetEntries();
-   std::chrono::steady_clock::time_point ts_first;
-   for (decltype(nEntries) entryId = 0; entryId < nEntries; ++entryId) {
+   // In bulk mode, the fixed-size trigger and photon count branches are read basket-wise and provide a
+   // pre-selection window; the photon vectors are still read entry by entry for the surviving entries
+   std::unique_ptr<TreeBulkBranch<bool>> bulkTrigP;
+   std::unique_ptr<TreeBulkBranch<unsigned int>> bulkPhotonN;
+   std::vector<unsigned char> prePass;
+   Long64_t windowFirst = range.first;
+   Long64_t windowEnd = range.first;
+   if (g_bulk) {
+      bulkTrigP = std::make_unique<TreeBulkBranch<bool>>(tree, "trigP");
+      bulkPhotonN = std::make_unique<TreeBulkBranch<unsigned int>>(tree, "photon_n");
+   }
+
+   tree->SetCacheEntryRange(range.first, range.second);
+   TimelineLoop loop(range.first, range.second, [&] { return GetClusterStarts(tree); });
+   for (Long64_t entryId = range.first; entryId < Long64_t(range.second); ++entryId) {
+      loop.Next(entryId);
       if ((entryId % 100000) == 0) {
          printf("processed %llu k events\n", entryId / 1000);
          //printf("dummy is %lf\n", dummy); abort();
       }
-      if (entryId == 1) {
-         ts_first = std::chrono::steady_clock::now();
-      }
 
-      tree->LoadTree(entryId);
+      if (g_bulk) {
+         if (entryId == windowEnd) {
+            windowFirst = entryId;
+            windowEnd = std::min({Long64_t(range.second), bulkTrigP->Load(entryId), bulkPhotonN->Load(entryId)});
+            const bool *vTrigP = bulkTrigP->Get(entryId);
+            const unsigned int *vPhotonN = bulkPhotonN->Get(entryId);
+            prePass.resize(windowEnd - windowFirst);
+            // Two good photons are required below
+            for (std::size_t j = 0; j < prePass.size(); ++j)
+               prePass[j] = vTrigP[j] & (vPhotonN[j] >= 2);
+         }
+         if (!prePass[entryId - windowFirst]) continue;
+         photon_n = *bulkPhotonN->Get(entryId);
+         tree->LoadTree(entryId);
+      } else {
+         tree->LoadTree(entryId);
 
-      brTrigP->GetEntry(entryId);
-      if (!brTrigP) continue;
+         {
+            CutFlowRAII stage(cutFlow, kStageTrigger);
+            brTrigP->GetEntry(entryId);
+            if (!stage.Pass(trigP)) continue;
+         }
+         brPhotonN->GetEntry(entryId);
+      }
 
       std::vector<size_t> idxGood;
-      brPhotonN->GetEntry(entryId);
-      brPhotonIsTightId->GetEntry(entryId);
-      brPhotonPt->GetEntry(entryId);
-      brPhotonEta->GetEntry(entryId);
-      for (size_t i = 0; i < photon_n; ++i) {
+      {
+         CutFlowRAII stage(cutFlow, kStagePhotonId);
          brPhotonIsTightId->GetEntry(entryId);
-         if (!(*photon_isTightID)[i]) continue;
-         if ((*photon_pt)[i] <= 25000.) continue;
-         if (abs((*photon_eta)[i]) >= 2.37) continue;
-         if (abs((*photon_eta)[i]) >= 1.37 && abs((*photon_eta)[i]) <= 1.52) continue;
-         idxGood.push_back(i);
+         brPhotonPt->GetEntry(entryId);
+         brPhotonEta->GetEntry(entryId);
+         for (size_t i = 0; i < photon_n; ++i) {
+            brPhotonIsTightId->GetEntry(entryId);
+            if (!(*photon_isTightID)[i]) continue;
+            if ((*photon_pt)[i] <= 25000.) continue;
+            if (abs((*photon_eta)[i]) >= 2.37) continue;
+            if (abs((*photon_eta)[i]) >= 1.37 && abs((*photon_eta)[i]) <= 1.52) continue;
+            idxGood.push_back(i);
+         }
+         if (!stage.Pass(idxGood.size() == 2)) continue;
       }
-      if (idxGood.size() != 2) continue;
-
-      brPhotonPtCone30->GetEntry(entryId);
-      brPhotonEtCone20->GetEntry(entryId);
 
-      bool isIsolatedPhotons = true;
-      for (int i = 0; i < 2; ++i) {
-         if (((*photon_ptcone30)[idxGood[i]] / (*photon_pt)[idxGood[i]] >= 0.065) ||
-             ((*photon_etcone20)[idxGood[i]] / (*photon_pt)[idxGood[i]] >= 0.065))
-         {
-           isIsolatedPhotons = false;
-           break;
+      {
+         CutFlowRAII stage(cutFlow, kStageIsolation);
+         brPhotonPtCone30->GetEntry(entryId);
+         brPhotonEtCone20->GetEntry(entryId);
+
+         bool isIsolatedPhotons = true;
+         for (int i = 0; i < 2; ++i) {
+            if (((*photon_ptcone30)[idxGood[i]] / (*photon_pt)[idxGood[i]] >= 0.065) ||
+                ((*photon_etcone20)[idxGood[i]] / (*photon_pt)[idxGood[i]] >= 0.065))
+            {
+              isIsolatedPhotons = false;
+              break;
+            }
          }
+         if (!stage.Pass(isIsolatedPhotons)) continue;
       }
-      if (!isIsolatedPhotons) continue;
+
+      CutFlowRAII stage(cutFlow, kStageKinematics);
 
       brPhotonPhi->GetEntry(entryId);
       brPhotonE->GetEntry(entryId);
@@ -477,6 +663,7 @@ static TH1F * ProcessTree(TTree *tree, TH1D *hMass, bool isMC,
       if ((*photon_pt)[idxGood[1]] / 1000. / myy <= 0.25) continue;
       if (myy <= 105) continue;
       if (myy >= 160) continue;
+      stage.Pass(true);
 
       hCut->Fill(entryId);
 
@@ -493,10 +680,72 @@ static TH1F * ProcessTree(TTree *tree, TH1D *hMass, bool isMC,
       }
 
    }
+}
+
+
+/// Opens one tree per thread, runs the selection on the cluster-aligned entry ranges and merges the partial
+/// histograms into hMass.  Returns the histogram of selected entry numbers.
+static TH1F * ProcessTree(const std::string &path, TH1D *hMass, bool isMC,
+                        unsigned *runtime_init, unsigned *runtime_analyze)
+{
+   auto ts_init = std::chrono::steady_clock::now();
+
+   auto hCut = new TH1F("", "Selected", 10000, 0, 8000000);
+   hCut->SetDirectory(0);
+
+   auto file = OpenOrDownload(path);
+   auto tree = file->Get<TTree>("mini");
+
+   // The first worker uses the main tree and the given histograms
+   auto ranges = PartitionEntries(GetClusterStarts(tree), tree->GetEntries(), g_n_threads);
+   std::vector<TFile *> files{file};
+   std::vector<TTree *> trees{tree};
+   std::vector<TTreePerfStats *> perfStats;
+   std::vector<TH1D *> partials_mass{hMass};
+   std::vector<TH1F *> partials_cut{hCut};
+   for (unsigned i = 1; i < ranges.size(); ++i) {
+      files.emplace_back(OpenOrDownload(path));
+      trees.emplace_back(files.back()->Get<TTree>("mini"));
+      partials_mass.emplace_back(static_cast<TH1D *>(hMass->Clone()));
+      partials_mass.back()->SetDirectory(nullptr);
+      partials_cut.emplace_back(static_cast<TH1F *>(hCut->Clone()));
+      partials_cut.back()->SetDirectory(nullptr);
+   }
+   if (g_perf_stats || g_hw_counters) {
+      for (auto t : trees)
+         perfStats.emplace_back(new TTreePerfStats("ioperf", t));
+   }
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < ranges.size(); ++i) {
+      cutFlows.emplace_back(kCutFlowStages);
+      cutFlows.back().SetBytesCounter(GetTreeBytesCounter(files[i]));
+   }
+
+   auto ts_first = std::chrono::steady_clock::now();
+   MarkPerfPhase("init");
+   RunInThreads(ranges.size(), [&](unsigned i) {
+      ProcessTreeRange(trees[i], ranges[i], partials_mass[i], partials_cut[i], isMC,
+                       g_cutflow ? &cutFlows[i] : nullptr);
+   });
+   for (unsigned i = 1; i < ranges.size(); ++i) {
+      hMass->Add(partials_mass[i]);
+      hCut->Add(partials_cut[i]);
+      delete partials_mass[i];
+      delete partials_cut[i];
+   }
 
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
    *runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
    *runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
+   for (auto p : perfStats) {
+      if (g_perf_stats)
+         p->Print();
+      if (g_perf_stats || g_hw_counters)
+         AddTreePerfStats(p, &g_results);
+   }
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
+   g_results.events_read = tree->GetEntries();
    return hCut;
 }
 
@@ -510,37 +759,18 @@ static void TreeDirect(const std::string &pathData, const std::string &path_ggH,
    auto hggH = new TH1D("", "Diphoton invariant mass; m_{#gamma#gamma} [GeV];Events", 30, 105, 160);
    auto hVBF = new TH1D("", "Diphoton invariant mass; m_{#gamma#gamma} [GeV];Events", 30, 105, 160);
 
-   auto file = OpenOrDownload(pathData);
-   auto tree = file->Get<TTree>("mini");
-   TTreePerfStats *ps = nullptr;
-   if (g_perf_stats)
-      ps = new TTreePerfStats("ioperf", tree);
-   auto hCut = ProcessTree(tree, hData, false /* isMC */, &runtime_init, &runtime_analyze);
-   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
-   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
-   if (g_perf_stats)
-      ps->Print();
-
-
-//   file = TFile::Open(path_ggH.c_str());
-//   tree = file->Get<TTree>("mini");
-//   if (g_perf_stats)
-//      ps = new TTreePerfStats("ioperf", tree);
-//   ProcessTree(tree, hggH, true /* isMC */, &runtime_init, &runtime_analyze);
+   auto hCut = ProcessTree(pathData, hData, false /* isMC */, &runtime_init, &runtime_analyze);
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   g_results.events_selected = hData->GetEntries();
+
+
+//   ProcessTree(path_ggH, hggH, true /* isMC */, &runtime_init, &runtime_analyze);
 //   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
 //   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
-//   if (g_perf_stats)
-//      ps->Print();
 //
-//   file = TFile::Open(pathVBF.c_str());
-//   tree = file->Get<TTree>("mini");
-//   if (g_perf_stats)
-//      ps = new TTreePerfStats("ioperf", tree);
-//   ProcessTree(tree, hVBF, true /* isMC */, &runtime_init, &runtime_analyze);
+//   ProcessTree(pathVBF, hVBF, true /* isMC */, &runtime_init, &runtime_analyze);
 //   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
 //   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
-//   if (g_perf_stats)
-//      ps->Print();
 
    if (g_show)
       Show(hData, hggH, hVBF, hCut);
@@ -556,66 +786,94 @@ static float ComputeInvariantMassRVec(const ROOT::RVecF &pt,
                                        const ROOT::RVecF &phi,
                                        const ROOT::RVecF &e)
 {
-    ROOT::Math::PtEtaPhiEVector p1(pt[0], eta[0], phi[0], e[0]);
-    ROOT::Math::PtEtaPhiEVector p2(pt[1], eta[1], phi[1], e[1]);
-    return (p1 + p2).mass() / 1000.0;
+    return kinematics::PtEtaPhiEMass(pt[0], eta[0], phi[0], e[0], pt[1], eta[1], phi[1], e[1]) / 1000.0;
 }
 
 static void DataFrame(ROOT::RDataFrame &df) {
    auto ts_init = std::chrono::steady_clock::now();
    std::chrono::steady_clock::time_point ts_first;
-   bool ts_first_set = false;
+   std::once_flag ts_first_flag;
 
-   auto df_timing = df.Define("TIMING", [&ts_first, &ts_first_set]() {
-      if (!ts_first_set)
+   auto df_timing = df.Define("TIMING", [&ts_first, &ts_first_flag]() {
+      // With implicit multi-threading, the Define runs concurrently in several slots
+      std::call_once(ts_first_flag, [&ts_first]() {
          ts_first = std::chrono::steady_clock::now();
-      ts_first_set = true;
-      return ts_first_set;}).Filter([](bool b){ return b; }, {"TIMING"});
-   auto df_P = df_timing.Filter([](bool trigP) { return trigP; }, {"trigP"});
-   auto df_goodPhotons = df_P.Define("goodphotons",
+         MarkPerfPhase("init");
+      });
+      return true;}).Filter([](bool b){ return b; }, {"TIMING"});
+   // One cut flow per processing slot.  RDF reads the columns before it calls the lambdas, so the stages only
+   // measure the lambdas themselves.  Without -f, the adapters only forward the calls.
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < df.GetNSlots(); ++i)
+      cutFlows.emplace_back(kCutFlowStages);
+
+   auto df_P = df_timing.Filter(CutFlowFilter(cutFlows, kStageTrigger, [](bool trigP) { return trigP; }),
+                                {"rdfslot_", "trigP"});
+   // The Filter on the number of good photons evaluates their Define first
+   auto df_goodPhotons = df_P.Define("goodphotons", CutFlowDefine(cutFlows, kStagePhotonId,
                                      [](const ROOT::RVec<bool> &isTightID,
                                         const ROOT::RVec<float> &photonPt,
                                         const ROOT::RVec<float> &photonEta)
                                         {
                                            return isTightID && (photonPt > 25000) && (abs(photonEta) < 2.37) && ((abs(photonEta) < 1.37) || (abs(photonEta) > 1.52));
-                                        },
-                                     {"photon_isTightID", "photon_pt", "photon_eta"})
-                             .Filter([](const ROOT::RVec<int> &goodphotons) { return ROOT::VecOps::Sum(goodphotons) == 2; }, {"goodphotons"});
-   auto df_iso = df_goodPhotons.Filter([](const ROOT::RVec<float> &ptcone30,
+                                        }, ECutFlowNode::kStageBegin),
+                                     {"rdfslot_", "photon_isTightID", "photon_pt", "photon_eta"})
+                             .Filter(CutFlowFilter(cutFlows, kStagePhotonId,
+                                        [](const ROOT::RVec<int> &goodphotons)
+                                        {
+                                           return ROOT::VecOps::Sum(goodphotons) == 2;
+                                        }, ECutFlowNode::kStageEnd),
+                                     {"rdfslot_", "goodphotons"});
+   auto df_iso = df_goodPhotons.Filter(CutFlowFilter(cutFlows, kStageIsolation,
+                                       [](const ROOT::RVec<float> &ptcone30,
                                           const ROOT::RVec<float> &pt,
                                           const ROOT::RVec<int> &goodphotons)
                                        {
                                           return Sum(ptcone30[goodphotons] / pt[goodphotons] < 0.065) == 2;
-                                       }, {"photon_ptcone30", "photon_pt", "goodphotons"})
-                               .Filter([](const ROOT::RVec<float> &etcone20,
+                                       }, ECutFlowNode::kStageBegin),
+                                       {"rdfslot_", "photon_ptcone30", "photon_pt", "goodphotons"})
+                               .Filter(CutFlowFilter(cutFlows, kStageIsolation,
+                                       [](const ROOT::RVec<float> &etcone20,
                                           const ROOT::RVec<float> &pt,
                                           const ROOT::RVec<int> &goodphotons)
                                        {
                                           return Sum(etcone20[goodphotons] / pt[goodphotons] < 0.065) == 2;
-                                       }, {"photon_etcone20", "photon_pt", "goodphotons"});
-   auto df_yy = df_iso.Define("m_yy", [](const ROOT::RVec<float> &pt,
+                                       }, ECutFlowNode::kStageEnd),
+                                       {"rdfslot_", "photon_etcone20", "photon_pt", "goodphotons"});
+   // Likewise, the window Filter evaluates the Define of the mass first
+   auto df_yy = df_iso.Define("m_yy", CutFlowDefine(cutFlows, kStageKinematics,
+                                      [](const ROOT::RVec<float> &pt,
                                          const ROOT::RVec<float> &eta,
                                          const ROOT::RVec<float> &phi,
                                          const ROOT::RVec<float> &E,
                                          const ROOT::RVec<int> &good)
                                        {
                                           return ComputeInvariantMassRVec(pt[good], eta[good], phi[good], E[good]);
-                                       },
-                              {"photon_pt", "photon_eta", "photon_phi", "photon_E", "goodphotons"});
-   auto df_window = df_yy.Filter([](const ROOT::RVec<float> &pt, const ROOT::RVec<int> &good, float m_yy)
+                                       }, ECutFlowNode::kStageBegin),
+                              {"rdfslot_", "photon_pt", "photon_eta", "photon_phi", "photon_E", "goodphotons"});
+   auto df_window = df_yy.Filter(CutFlowFilter(cutFlows, kStageKinematics,
+                                 [](const ROOT::RVec<float> &pt, const ROOT::RVec<int> &good, float m_yy)
                                  {
                                     return (pt[good][0] / 1000.0 / m_yy > 0.35) &&
                                            (pt[good][1] / 1000.0 / m_yy > 0.25) &&
                                            ((m_yy > 105) && (m_yy < 160));
-                                 }, {"photon_pt", "goodphotons", "m_yy"});
+                                 }, ECutFlowNode::kStageEnd), {"rdfslot_", "photon_pt", "goodphotons", "m_yy"});
    auto hData = df_window.Histo1D<float>({"", "Diphoton invariant mass; m_{#gamma#gamma} [GeV];Events", 30, 105, 160}, "m_yy");
+   // Only booked for the JSON summary
+   ROOT::RDF::RResultPtr<ULong64_t> nEvents;
+   if (g_json)
+      nEvents = df.Count();
    *hData;
 
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
    auto runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
    auto runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
-   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
-   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   if (nEvents)
+      g_results.events_read = *nEvents;
+   g_results.events_selected = hData->GetEntries();
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
 
    if (g_show) {
       //auto hData = new TH1D("", "Diphoton invariant mass; m_{#gamma#gamma} [GeV];Events", 30, 105, 160);
@@ -625,8 +883,115 @@ static void DataFrame(ROOT::RDataFrame &df) {
    }
 }
 
+static ROOT::RVec<int> GetGoodPhotons(const ROOT::RVec<bool> &isTightID,
+                                      const ROOT::RVec<float> &pt,
+                                      const ROOT::RVec<float> &eta)
+{
+   return isTightID && (pt > 25000) && (abs(eta) < 2.37) && ((abs(eta) < 1.37) || (abs(eta) > 1.52));
+}
+
+/// Optimized flavour of DataFrame: the timer, the trigger, photon ID, isolation, and kinematic window cuts are fused
+/// into a single Filter that works on the photon collections with RVec operations.  The diphoton mass is computed
+/// again for the histogram, which only costs for the few selected events.  RDF reads all the columns of the Filter
+/// for every entry, whereas DataFrame reads the photon columns only for the triggered entries.
+static void DataFrameOptimized(ROOT::RDataFrame &df) {
+   auto ts_init = std::chrono::steady_clock::now();
+   std::chrono::steady_clock::time_point ts_first;
+   std::once_flag ts_first_flag;
+
+   // One cut flow per processing slot.  The fused Filter measures its cuts as separate stages, which do nothing
+   // without -f.  The Define of the mass for the histogram only runs for the selected entries and is not measured.
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < df.GetNSlots(); ++i)
+      cutFlows.emplace_back(kCutFlowStages);
+
+   auto df_window = df.Filter([&ts_first, &ts_first_flag, &cutFlows](unsigned int slot,
+                                                                     bool trigP,
+                                                                     const ROOT::RVec<bool> &isTightID,
+                                                                     const ROOT::RVec<float> &pt,
+                                                                     const ROOT::RVec<float> &eta,
+                                                                     const ROOT::RVec<float> &phi,
+                                                                     const ROOT::RVec<float> &E,
+                                                                     const ROOT::RVec<float> &ptcone30,
+                                                                     const ROOT::RVec<float> &etcone20)
+                              {
+                                 // With implicit multi-threading, the Filter runs concurrently in several slots
+                                 std::call_once(ts_first_flag, [&ts_first]() {
+                                    ts_first = std::chrono::steady_clock::now();
+                                    MarkPerfPhase("init");
+                                 });
+                                 CutFlow *cutFlow = cutFlows.empty() ? nullptr : &cutFlows[slot];
+                                 {
+                                    CutFlowRAII stage(cutFlow, kStageTrigger);
+                                    if (!stage.Pass(trigP))
+                                       return false;
+                                 }
+                                 ROOT::RVec<int> good;
+                                 {
+                                    CutFlowRAII stage(cutFlow, kStagePhotonId);
+                                    good = GetGoodPhotons(isTightID, pt, eta);
+                                    if (!stage.Pass(ROOT::VecOps::Sum(good) == 2))
+                                       return false;
+                                 }
+                                 ROOT::RVec<float> goodPt;
+                                 {
+                                    CutFlowRAII stage(cutFlow, kStageIsolation);
+                                    goodPt = pt[good];
+                                    if (!stage.Pass((Sum(ptcone30[good] / goodPt < 0.065) == 2) &&
+                                                    (Sum(etcone20[good] / goodPt < 0.065) == 2)))
+                                    {
+                                       return false;
+                                    }
+                                 }
+                                 CutFlowRAII stage(cutFlow, kStageKinematics);
+                                 float m_yy = ComputeInvariantMassRVec(goodPt, eta[good], phi[good], E[good]);
+                                 return stage.Pass((goodPt[0] / 1000.0 / m_yy > 0.35) &&
+                                                   (goodPt[1] / 1000.0 / m_yy > 0.25) &&
+                                                   ((m_yy > 105) && (m_yy < 160)));
+                              },
+                              {"rdfslot_", "trigP", "photon_isTightID", "photon_pt", "photon_eta", "photon_phi",
+                               "photon_E", "photon_ptcone30", "photon_etcone20"});
+   auto df_yy = df_window.Define("m_yy", [](const ROOT::RVec<bool> &isTightID,
+                                            const ROOT::RVec<float> &pt,
+                                            const ROOT::RVec<float> &eta,
+                                            const ROOT::RVec<float> &phi,
+                                            const ROOT::RVec<float> &E)
+                                          {
+                                             auto good = GetGoodPhotons(isTightID, pt, eta);
+                                             return ComputeInvariantMassRVec(pt[good], eta[good], phi[good], E[good]);
+                                          },
+                                 {"photon_isTightID", "photon_pt", "photon_eta", "photon_phi", "photon_E"});
+   auto hData = df_yy.Histo1D<float>({"", "Diphoton invariant mass; m_{#gamma#gamma} [GeV];Events", 30, 105, 160},
+                                     "m_yy");
+   // Only booked for the JSON summary
+   ROOT::RDF::RResultPtr<ULong64_t> nEvents;
+   if (g_json)
+      nEvents = df.Count();
+   *hData;
+
+   auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
+   auto runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
+   auto runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   if (nEvents)
+      g_results.events_read = *nEvents;
+   g_results.events_selected = hData->GetEntries();
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
+
+   if (g_show) {
+      auto hggH = new TH1D("", "Diphoton invariant mass; m_{#gamma#gamma} [GeV];Events", 30, 105, 160);
+      auto hVBF = new TH1D("", "Diphoton invariant mass; m_{#gamma#gamma} [GeV];Events", 30, 105, 160);
+      Show(hData.GetPtr(), hggH, hVBF);
+   }
+}
+
 static void Usage(const char *progname) {
-  printf("%s [-i gg_data.root] [-r(df)] [-m(t)] [-p(erformance stats)] [-s(show)] [-x cluster bunch size]\n", progname);
+  printf("%s [-i gg_data.root] [-r(df)] [-O (optimized RDF, implies -r)] [-m(t)] [-p(erformance stats)] [-s(show)]\n"
+         "   [-x cluster bunch size] [-j threads for the direct event loop] [-b(ulk reads, tree only)]\n"
+         "   [-z (page spans, for uncompressed ntuples)] [-u unzip threads] [-M cluster cache memory budget in MB]\n"
+         "   [-e I/O engine: pread (default), uring, uring-direct, mmap] [-H(ardware counters)]\n"
+         "   [-f (cut flow profile)] [-T timeline.json] [--json]\n", progname);
 }
 
 
@@ -636,8 +1001,10 @@ int main(int argc, char **argv) {
    std::string input_path;
    std::string input_suffix;
    bool use_rdf = false;
+   bool use_mt = false;
+   static const struct option long_options[] = {{"json", no_argument, nullptr, 'J'}, {nullptr, 0, nullptr, 0}};
    int c;
-   while ((c = getopt(argc, argv, "hvi:rpsmx:")) != -1) {
+   while ((c = getopt_long(argc, argv, "hvHi:rOpsmfx:j:bzu:M:e:T:", long_options, nullptr)) != -1) {
       switch (c) {
       case 'h':
       case 'v':
@@ -653,14 +1020,55 @@ int main(int argc, char **argv) {
          g_show = true;
          break;
       case 'm':
-         ROOT::EnableImplicitMT();
+         use_mt = true;
          break;
       case 'r':
          use_rdf = true;
          break;
+      case 'O':
+         use_rdf = true;
+         g_rdf_optimized = true;
+         break;
       case 'x':
          g_cluster_bunch_size = atoi(optarg);
          break;
+      case 'u':
+         g_unzip_threads = atoi(optarg);
+         break;
+      case 'M':
+         g_memory_budget_mb = atoi(optarg);
+         break;
+      case 'e':
+         g_io_engine = GetIoEngine(optarg);
+         break;
+      case 'j': {
+         char *end;
+         long n = strtol(optarg, &end, 10);
+         if (*end != '\0' || n < 1) {
+            fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+            return 1;
+         }
+         g_n_threads = n;
+         break;
+      }
+      case 'b':
+         g_bulk = true;
+         break;
+      case 'z':
+         g_spans = true;
+         break;
+      case 'f':
+         g_cutflow = true;
+         break;
+      case 'J':
+         g_json = true;
+         break;
+      case 'H':
+         g_hw_counters = true;
+         break;
+      case 'T':
+         g_timeline_path = optarg;
+         break;
       default:
          fprintf(stderr, "Unknown option: -%c\n", c);
          Usage(argv[0]);
@@ -671,17 +1079,47 @@ int main(int argc, char **argv) {
       Usage(argv[0]);
       return 1;
    }
+   if (g_hw_counters)
+      StartPerfCounters();
+   if (!g_timeline_path.empty())
+      StartTimeline();
+   if (g_n_threads > 1)
+      ROOT::EnableThreadSafety();
+   // Without -m, the unzip threads turn on implicit multi-threading only for the direct RNTuple event loop: it would
+   // also run the RDF event loop in parallel and read the tree branches in parallel
+   if (g_unzip_threads > 0 && !use_mt && (use_rdf || GetFileFormat(GetSuffix(input_path)) != FileFormats::kNtuple)) {
+      fprintf(stderr, "Without -m, the unzip threads (-u) only apply to the direct RNTuple event loop\n");
+      return 1;
+   }
+   if (g_unzip_threads > 0)
+      ROOT::EnableImplicitMT(g_unzip_threads);
+   else if (use_mt)
+      ROOT::EnableImplicitMT();
+   g_unzip_threads_only_mt = (g_unzip_threads > 0) && !use_mt;
+   if (g_cutflow && !use_rdf && (g_bulk || g_spans)) {
+      fprintf(stderr, "The cut flow profile (-f) does not cover the bulk reads (-b) and page spans (-z)\n");
+      return 1;
+   }
 
    std::string suffix = GetSuffix(input_path);
    std::string compression = SplitString(StripSuffix(input_path), '~')[1];
    std::string ggH_path = GetParentPath(input_path) + "/gg_mc_ggH125~" + compression + "." + suffix;
    std::string vbf_path = GetParentPath(input_path) + "/gg_mc_VBFH125~" + compression + "." + suffix;
 
+   g_results.analysis = "atlas";
+   g_results.input = input_path;
+   if (use_rdf)
+      g_results.method = suffix + (g_rdf_optimized ? "+rdfopt" : "+rdf");
+   else
+      g_results.method = suffix + (g_spans ? "+spans" : (g_bulk ? "+bulk" : ""));
    switch (GetFileFormat(suffix)) {
    case FileFormats::kRoot:
       if (use_rdf) {
          ROOT::RDataFrame df("mini", input_path);
-         DataFrame(df);
+         if (g_rdf_optimized)
+            DataFrameOptimized(df);
+         else
+            DataFrame(df);
       } else {
          TreeDirect(input_path, ggH_path, vbf_path);
       }
@@ -689,7 +1127,10 @@ int main(int argc, char **argv) {
    case FileFormats::kNtuple:
       if (use_rdf) {
          ROOT::RDataFrame df("mini", input_path);
-         DataFrame(df);
+         if (g_rdf_optimized)
+            DataFrameOptimized(df);
+         else
+            DataFrame(df);
       } else {
          NTupleDirect(input_path, ggH_path, vbf_path);
       }
@@ -700,8 +1141,19 @@ int main(int argc, char **argv) {
    }
 
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("finish");
    auto runtime_main = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_init).count();
    std::cout << "Runtime-Main: " << runtime_main << "us" << std::endl;
+   PrintPerfCounters(g_results);
+   if (!g_timeline_path.empty())
+      WriteTimeline(g_timeline_path);
+   if (g_json) {
+      if (GetFileFormat(suffix) == FileFormats::kRoot)
+         g_results.bytes_read = TFile::GetFileBytesRead();
+      g_results.runtime_main_us = runtime_main;
+      AddPerfCounters(&g_results);
+      std::cout << GetResultsJson(g_results) << std::endl;
+   }
 
    return 0;
 }
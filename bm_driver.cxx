@@ -0,0 +1,442 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+// Runs a benchmark command for a number of iterations and collects, per
+// iteration, the wall clock time, the resource usage of the command, and the
+// hardware counters (cycles, instructions, last-level cache misses, major page
+// faults) where perf events are available.  The result file has the format
+// written formerly by bm_timing.sh with /bin/time, one "<field>: <value>..."
+// line per field with one value per iteration.  A summary with mean, standard
+// deviation, and percentiles of every field is printed at the end.
+//
+// For cold cache runs, only the input files of the benchmark are evicted from
+// the page cache (POSIX_FADV_DONTNEED) instead of dropping the caches of the
+// whole system.  A prepare command, e.g. page_cache to pre-warm parts of the
+// input, can run after the eviction and before every iteration.
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct Counter {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+static const Counter kCounters[] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"llcmiss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {"pfmajor", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ},
+};
+static const unsigned kNumCounters = sizeof(kCounters) / sizeof(kCounters[0]);
+
+/// One measured run of the benchmark command
+struct Iteration {
+  int exit_code = 0;
+  double realtime = 0.0;
+  struct rusage usage;
+  /// Negative if the counter is not available
+  double counters[kNumCounters];
+};
+
+static double GetMonotonicSecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double TimevalToSecs(const struct timeval &tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Counts the given event in the process pid and all the threads and children
+// it creates, starting with the exec() of pid
+static int OpenCounter(const Counter &counter, pid_t pid) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = counter.type;
+  attr.config = counter.config;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  // Allows for counting with the default perf_event_paranoid setting
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(__NR_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Returns the counter value, scaled up if the counter was multiplexed, or -1
+static double ReadCounter(int fd) {
+  uint64_t values[3];
+  if (read(fd, values, sizeof(values)) != sizeof(values))
+    return -1.0;
+  if (values[2] == 0)
+    return (values[1] == 0) ? 0.0 : -1.0;
+  return double(values[0]) * values[1] / values[2];
+}
+
+static void EvictFiles(const vector<string> &paths) {
+  for (const auto &p : paths) {
+    int fd = open(p.c_str(), O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Warning: cannot open %s for page cache eviction\n", p.c_str());
+      continue;
+    }
+    int retval = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    if (retval != 0)
+      fprintf(stderr, "Warning: cannot evict %s (%s)\n", p.c_str(), strerror(retval));
+    close(fd);
+  }
+}
+
+// Runs the command and copies its standard output to our standard output and
+// to *output
+static Iteration Run(char **cmd, string *output) {
+  Iteration result;
+  output->clear();
+  int pipe_sync[2];
+  int pipe_output[2];
+  if ((pipe(pipe_sync) != 0) || (pipe(pipe_output) != 0)) {
+    perror("pipe");
+    exit(1);
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(pipe_sync[1]);
+    close(pipe_output[0]);
+    dup2(pipe_output[1], 1);
+    close(pipe_output[1]);
+    // Wait until the parent attached the counters
+    char c;
+    if (read(pipe_sync[0], &c, 1) != 1)
+      _exit(127);
+    close(pipe_sync[0]);
+    execvp(cmd[0], cmd);
+    fprintf(stderr, "cannot execute %s (%s)\n", cmd[0], strerror(errno));
+    _exit(127);
+  }
+  close(pipe_sync[0]);
+  close(pipe_output[1]);
+
+  int counter_fds[kNumCounters];
+  for (unsigned i = 0; i < kNumCounters; ++i)
+    counter_fds[i] = OpenCounter(kCounters[i], pid);
+
+  double start = GetMonotonicSecs();
+  char c = 'x';
+  if (write(pipe_sync[1], &c, 1) != 1) {
+    perror("write");
+    exit(1);
+  }
+  close(pipe_sync[1]);
+
+  char buf[4096];
+  ssize_t nbytes;
+  while ((nbytes = read(pipe_output[0], buf, sizeof(buf))) != 0) {
+    if (nbytes < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    fwrite(buf, 1, nbytes, stdout);
+    fflush(stdout);
+    output->append(buf, nbytes);
+  }
+  close(pipe_output[0]);
+
+  int status;
+  while (wait4(pid, &status, 0, &result.usage) < 0) {
+    if (errno != EINTR) {
+      perror("wait4");
+      exit(1);
+    }
+  }
+  result.realtime = GetMonotonicSecs() - start;
+  result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+  for (unsigned i = 0; i < kNumCounters; ++i) {
+    result.counters[i] = (counter_fds[i] < 0) ? -1.0 : ReadCounter(counter_fds[i]);
+    if (counter_fds[i] >= 0)
+      close(counter_fds[i]);
+  }
+  return result;
+}
+
+// Returns the second field of the first output line that contains key, as in
+// "Runtime-Analysis: 1234us", converted from microseconds to seconds
+static bool GrepRealtime(const string &output, const string &key, double *secs) {
+  istringstream lines(output);
+  string line;
+  while (getline(lines, line)) {
+    if (line.find(key) == string::npos)
+      continue;
+    istringstream fields(line);
+    string first;
+    string second;
+    if (!(fields >> first >> second))
+      return false;
+    *secs = atof(second.c_str()) / 1e6;
+    return true;
+  }
+  return false;
+}
+
+static double GetPercentile(const vector<double> &sorted, double p) {
+  if (sorted.size() == 1)
+    return sorted[0];
+  double pos = p * (sorted.size() - 1);
+  size_t lower = size_t(pos);
+  if (lower + 1 >= sorted.size())
+    return sorted.back();
+  return sorted[lower] + (pos - lower) * (sorted[lower + 1] - sorted[lower]);
+}
+
+struct Field {
+  string name;
+  const char *format;
+  vector<double> values;
+};
+
+static void PrintSummary(const vector<Field> &fields) {
+  printf("%-14s %14s %12s %14s %14s %14s %14s %14s %14s\n", "# field", "mean", "stddev",
+         "min", "p25", "median", "p75", "p90", "max");
+  for (const auto &f : fields) {
+    const size_t n = f.values.size();
+    double mean = 0.0;
+    for (auto v : f.values)
+      mean += v;
+    mean /= n;
+    double s2 = 0.0;
+    for (auto v : f.values)
+      s2 += (v - mean) * (v - mean);
+    double stddev = (n > 1) ? sqrt(s2 / (n - 1)) : 0.0;
+    vector<double> sorted = f.values;
+    sort(sorted.begin(), sorted.end());
+    printf("%-14s %14.4g %12.4g %14.4g %14.4g %14.4g %14.4g %14.4g %14.4g\n",
+           (f.name + ":").c_str(), mean, stddev, sorted[0],
+           GetPercentile(sorted, 0.25), GetPercentile(sorted, 0.5),
+           GetPercentile(sorted, 0.75), GetPercentile(sorted, 0.9), sorted.back());
+  }
+}
+
+static void Usage(const char *progname) {
+  printf("%s -o <output> [-n <iterations>] [-w(arm-up run)] [-c(old cache)] [-f <file to evict>]...\n"
+         "  [-p <prepare command>] [-g <realtime key>] [-s <sleep seconds>] [-j <json output>] -- <command>\n"
+         "Without -f, cold cache runs evict the existing local files given as -i arguments to the command\n",
+         progname);
+}
+
+int main(int argc, char **argv) {
+  string output_path;
+  unsigned n_iterations = 6;
+  bool warm_up = false;
+  bool cold = false;
+  vector<string> evict_paths;
+  string prepare_cmd;
+  string grep_key;
+  unsigned sleep_secs = 0;
+  string json_path;
+  int c;
+  while ((c = getopt(argc, argv, "+hvo:n:wcf:p:g:s:j:")) != -1) {
+    switch (c) {
+      case 'h':
+      case 'v':
+        Usage(argv[0]);
+        return 0;
+      case 'o':
+        output_path = optarg;
+        break;
+      case 'n':
+        n_iterations = atoi(optarg);
+        break;
+      case 'w':
+        warm_up = true;
+        break;
+      case 'c':
+        cold = true;
+        break;
+      case 'f':
+        evict_paths.push_back(optarg);
+        break;
+      case 'p':
+        prepare_cmd = optarg;
+        break;
+      case 'g':
+        grep_key = optarg;
+        break;
+      case 's':
+        sleep_secs = atoi(optarg);
+        break;
+      case 'j':
+        json_path = optarg;
+        break;
+      default:
+        fprintf(stderr, "Unknown option: -%c\n", c);
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+  if (output_path.empty() || (optind >= argc) || (n_iterations == 0)) {
+    Usage(argv[0]);
+    return 1;
+  }
+  char **cmd = argv + optind;
+
+  string cmd_line;
+  for (char **arg = cmd; *arg; ++arg) {
+    if (arg != cmd)
+      cmd_line += " ";
+    cmd_line += *arg;
+  }
+
+  if (cold && evict_paths.empty()) {
+    for (char **arg = cmd; *arg; ++arg) {
+      struct stat info;
+      if ((strcmp(*arg, "-i") == 0) && arg[1] && (stat(arg[1], &info) == 0) &&
+          S_ISREG(info.st_mode))
+      {
+        evict_paths.push_back(arg[1]);
+      }
+    }
+    if (evict_paths.empty())
+      fprintf(stderr, "Warning: no local input files to evict from the page cache\n");
+  }
+
+  printf("Benchmarking %s\n", cmd_line.c_str());
+  string output;
+  if (warm_up)
+    Run(cmd, &output);
+
+  FILE *json_file = NULL;
+  if (!json_path.empty()) {
+    json_file = fopen(json_path.c_str(), "w");
+    if (json_file == NULL) {
+      fprintf(stderr, "cannot open %s\n", json_path.c_str());
+      return 1;
+    }
+  }
+
+  vector<Iteration> iterations;
+  for (unsigned i = 0; i < n_iterations; ++i) {
+    if (cold)
+      EvictFiles(evict_paths);
+    if (!prepare_cmd.empty() && (system(prepare_cmd.c_str()) != 0)) {
+      fprintf(stderr, "prepare command failed: %s\n", prepare_cmd.c_str());
+      return 1;
+    }
+    Iteration it = Run(cmd, &output);
+    if (!grep_key.empty() && !GrepRealtime(output, grep_key, &it.realtime))
+      fprintf(stderr, "Warning: %s not found in the output, using the wall clock time\n", grep_key.c_str());
+    if (json_file) {
+      istringstream lines(output);
+      string line;
+      while (getline(lines, line)) {
+        if (line.compare(0, 12, "{\"analysis\":") == 0)
+          fprintf(json_file, "%s\n", line.c_str());
+      }
+    }
+    iterations.push_back(it);
+    if (sleep_secs > 0)
+      sleep(sleep_secs);
+  }
+  if (json_file)
+    fclose(json_file);
+
+  vector<Field> fields = {
+    {"realtime", "%.3f", {}}, {"usertime", "%.2f", {}}, {"kerneltime", "%.2f", {}},
+    {"rssmax", "%.0f", {}}, {"memavg", "%.0f", {}}, {"nswitch", "%.0f", {}},
+    {"nwait", "%.0f", {}}, {"nread", "%.0f", {}}, {"nwrite", "%.0f", {}},
+    {"minflt", "%.0f", {}}, {"majflt", "%.0f", {}}};
+  bool has_counter[kNumCounters];
+  for (unsigned i = 0; i < kNumCounters; ++i) {
+    has_counter[i] = true;
+    for (const auto &it : iterations)
+      has_counter[i] = has_counter[i] && (it.counters[i] >= 0.0);
+    if (!has_counter[i])
+      fprintf(stderr, "Warning: perf counter %s not available\n", kCounters[i].name);
+  }
+  for (const auto &it : iterations) {
+    // memavg is not provided by Linux, it was always 0 with /bin/time
+    const double values[] = {it.realtime, TimevalToSecs(it.usage.ru_utime),
+                             TimevalToSecs(it.usage.ru_stime), double(it.usage.ru_maxrss), 0.0,
+                             double(it.usage.ru_nivcsw), double(it.usage.ru_nvcsw),
+                             double(it.usage.ru_inblock), double(it.usage.ru_oublock),
+                             double(it.usage.ru_minflt), double(it.usage.ru_majflt)};
+    for (unsigned i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+      fields[i].values.push_back(values[i]);
+  }
+  for (unsigned i = 0; i < kNumCounters; ++i) {
+    if (!has_counter[i])
+      continue;
+    Field f{kCounters[i].name, "%.0f", {}};
+    for (const auto &it : iterations)
+      f.values.push_back(it.counters[i]);
+    fields.push_back(f);
+  }
+
+  string working_path = output_path + ".working";
+  FILE *f = fopen(working_path.c_str(), "w");
+  if (f == NULL) {
+    fprintf(stderr, "cannot open %s\n", working_path.c_str());
+    return 1;
+  }
+  bool has_failures = false;
+  for (unsigned i = 0; i < iterations.size(); ++i) {
+    if (i == 0)
+      fprintf(f, "%s ", cmd_line.c_str());
+    else
+      fprintf(f, "\t");
+    fprintf(f, "(%d)", iterations[i].exit_code);
+    has_failures = has_failures || (iterations[i].exit_code != 0);
+  }
+  fprintf(f, "\n");
+  for (const auto &field : fields) {
+    fprintf(f, "%s: ", field.name.c_str());
+    for (unsigned i = 0; i < field.values.size(); ++i) {
+      if (i > 0)
+        fprintf(f, "\t");
+      fprintf(f, field.format, field.values[i]);
+    }
+    fprintf(f, "\n");
+  }
+  fclose(f);
+  if (rename(working_path.c_str(), output_path.c_str()) != 0) {
+    fprintf(stderr, "cannot write %s\n", output_path.c_str());
+    return 1;
+  }
+
+  PrintSummary(fields);
+  if (has_failures)
+    fprintf(stderr, "Warning: some iterations of %s failed\n", cmd_line.c_str());
+  return has_failures ? 1 : 0;
+}
@@ -0,0 +1,67 @@
+#!/bin/sh
+
+die() {
+  echo "$1"
+  exit 1
+}
+
+usage() {
+  echo "$0 -p <data directory> [-l <latency ms>] [-j <uniform|normal|exp>:<ms>] [-b <MB/s>] -- <command>"
+}
+
+DATA_DIR=
+LATENCY=
+JITTER=
+BANDWIDTH=
+
+while getopts "hvp:l:j:b:" option; do
+  case $option in
+    h)
+      usage
+      exit 0
+    ;;
+    v)
+      usage
+      exit 0
+    ;;
+    p)
+      DATA_DIR=$OPTARG
+    ;;
+    l)
+      LATENCY=$OPTARG
+    ;;
+    j)
+      JITTER=$OPTARG
+    ;;
+    b)
+      BANDWIDTH=$OPTARG
+    ;;
+    ?)
+      usage
+      exit 1
+    ;;
+  esac
+done
+shift $(($OPTIND - 1))
+
+[ "x$DATA_DIR" = "x" ] && die "data directory missing"
+DATA_DIR=$(realpath $DATA_DIR)
+
+MOUNT_DIR=$(mktemp -d)
+LOG_DIR=$(mktemp -d)
+
+[ "x$LATENCY" != "x" ] && export FF_LATENCY_MS=$LATENCY
+[ "x$JITTER" != "x" ] && export FF_JITTER=$JITTER
+[ "x$BANDWIDTH" != "x" ] && export FF_BANDWIDTH_MBS=$BANDWIDTH
+FF_PHYS_PATH=$DATA_DIR FF_LOG_PATH=$LOG_DIR ./fuse_forward $MOUNT_DIR || die "cannot mount $MOUNT_DIR"
+
+CMD=$(echo "$@" | sed s,@MOUNT_DIR@,$MOUNT_DIR,g)
+echo "Running $CMD"
+$CMD
+RETVAL=$?
+
+fusermount -u $MOUNT_DIR
+while pgrep -f "fuse_forward $MOUNT_DIR" > /dev/null; do sleep 0.1; done
+rmdir $MOUNT_DIR
+rm -rf $LOG_DIR
+exit $RETVAL
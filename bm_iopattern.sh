@@ -51,6 +51,8 @@ echo "Running $CMD"
 $CMD
 
 fusermount -u $MOUNT_DIR
+# fuse_forward flushes the trace when it exits after the unmount
+while pgrep -f "fuse_forward $MOUNT_DIR" > /dev/null; do sleep 0.1; done
 rmdir $MOUNT_DIR
-mv $LOG_DIR/$(echo $WATCH_FILENAME | sed s,/,-,g) $OUTPUT_FILE
+./ff_decode -f $WATCH_FILENAME $LOG_DIR > $OUTPUT_FILE
 rm -rf $LOG_DIR
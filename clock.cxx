@@ -18,11 +18,16 @@
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <filesystem>
+#include <fstream>
 #include <limits>
 #include <string>
+#include <vector>
 
 #include <unistd.h>
 
+#include "util.h"
+
 using RNTupleAtomicCounter = ROOT::Experimental::Detail::RNTupleAtomicCounter;
 using RNTupleAtomicTimer = ROOT::Experimental::Detail::RNTupleAtomicTimer;
 using RNTupleCompressor = ROOT::Experimental::Detail::RNTupleCompressor;
@@ -35,6 +40,8 @@ class ClockHist {
   std::string fName;
   TH1D *fHWall;
   TH1D *fHCpu;
+  /// If non-zero, the histograms show the throughput in MB/s for processing fBytes per measurement
+  std::uint64_t fBytes = 0;
   std::int64_t fMinWall = std::numeric_limits<std::int64_t>::max();
   std::int64_t fMaxWall = std::numeric_limits<std::int64_t>::min();
   std::int64_t fSumWall = 0;
@@ -51,6 +58,18 @@ public:
     fHCpu = new TH1D((fName + " CPU").c_str(), "", 250, min, max);
   }
 
+  /// Throughput histograms with logarithmic bins from 1 MB/s to 100 GB/s
+  ClockHist(const std::string &name, std::uint64_t nbytes)
+    : fName(name), fBytes(nbytes)
+  {
+    constexpr int kNumBins = 250;
+    double edges[kNumBins + 1];
+    for (int i = 0; i <= kNumBins; ++i)
+      edges[i] = std::pow(10., 5. * i / kNumBins);
+    fHWall = new TH1D((fName + " Wall").c_str(), "", kNumBins, edges);
+    fHCpu = new TH1D((fName + " CPU").c_str(), "", kNumBins, edges);
+  }
+
   void Fill(std::int64_t wall_ns, double cpu_ns) {
     fMinWall = std::min(fMinWall, wall_ns);
     fMaxWall = std::max(fMaxWall, wall_ns);
@@ -58,11 +77,22 @@ public:
     fMaxCpu = std::max(fMaxCpu, cpu_ns);
     fSumWall += wall_ns;
     fSumCpu += cpu_ns;
-    fHWall->Fill(wall_ns);
-    fHCpu->Fill(cpu_ns);
+    if (fBytes) {
+      // bytes per ns equals GB/s
+      fHWall->Fill(1000. * fBytes / std::max(wall_ns, std::int64_t(1)));
+      fHCpu->Fill(1000. * fBytes / std::max(cpu_ns, 1.));
+    } else {
+      fHWall->Fill(wall_ns);
+      fHCpu->Fill(cpu_ns);
+    }
     fTotal++;
   }
 
+  /// Average wall-clock throughput in MB/s over all measurements
+  double GetThroughput() const {
+    return fSumWall ? (1000. * fBytes * fTotal / fSumWall) : 0.;
+  }
+
   void Draw() {
     fHWall->SetMaximum(fTotal * 2);
 
@@ -70,7 +100,7 @@ public:
     fHWall->SetLineColor(kBlue);
     fHWall->SetFillColor(kBlue);
     fHWall->SetFillStyle(3001);
-    fHWall->GetXaxis()->SetTitle("Duration (ns)");
+    fHWall->GetXaxis()->SetTitle(fBytes ? "Throughput (MB/s)" : "Duration (ns)");
     fHWall->Draw();
 
     fHCpu->SetLineColor(kRed);
@@ -145,6 +175,166 @@ static void ClobberMemory() {
   asm volatile("" : : : "memory");
 }
 
+/// Compression settings of the codec matrix: the algorithms known to GetCompressionSettings() and, for zstd,
+/// a range of levels
+static std::vector<int> GetMatrixSettings() {
+  std::vector<int> settings;
+  for (const char *algorithm : {"zlib", "lz4", "lzma"})
+    settings.emplace_back(GetCompressionSettings(algorithm));
+  const int zstd = GetCompressionSettings("zstd");
+  for (int level : {1, 3, 5, 7, 9})
+    settings.emplace_back(zstd - zstd % 100 + level);
+  return settings;
+}
+
+static std::string GetSettingsName(int settings) {
+  std::string algorithm;
+  switch (settings / 100) {
+  case 1: algorithm = "zlib"; break;
+  case 2: algorithm = "lzma"; break;
+  case 4: algorithm = "lz4"; break;
+  case 5: algorithm = "zstd"; break;
+  default: algorithm = "algo" + std::to_string(settings / 100);
+  }
+  return algorithm + "-" + std::to_string(settings % 100);
+}
+
+static std::string GetBlockSizeName(std::size_t blockSize) {
+  if (blockSize >= 1024 * 1024)
+    return std::to_string(blockSize / (1024 * 1024)) + "MB";
+  return std::to_string(blockSize / 1024) + "kB";
+}
+
+/// Returns the uncompressed size of a sealed page dumped by ntuple_dump, or 0 if the page is stored
+/// uncompressed.  Compressed pages are a sequence of ROOT compression blocks, each with a 9 byte header that
+/// encodes the algorithm, the compressed size, and the uncompressed size.
+static std::size_t GetUnzipSize(const unsigned char *buf, std::size_t size) {
+  static const char *kTags[] = {"ZL", "CS", "XZ", "L4", "ZS"};
+  std::size_t pos = 0;
+  std::size_t unzipSize = 0;
+  while (pos + 9 <= size) {
+    bool knownTag = false;
+    for (const char *tag : kTags)
+      knownTag = knownTag || (buf[pos] == tag[0] && buf[pos + 1] == tag[1]);
+    if (!knownTag)
+      return 0;
+    std::size_t szIn = buf[pos + 3] | (buf[pos + 4] << 8) | (buf[pos + 5] << 16);
+    std::size_t szOut = buf[pos + 6] | (buf[pos + 7] << 8) | (buf[pos + 8] << 16);
+    pos += 9 + szIn;
+    unzipSize += szOut;
+  }
+  return (pos == size) ? unzipSize : 0;
+}
+
+/// Concatenates the decompressed contents of all the *.page files in a directory written by `ntuple_dump -p`
+static std::vector<unsigned char> LoadPageDumps(const std::string &dir) {
+  std::vector<std::string> paths;
+  for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+    if (entry.path().extension() == ".page")
+      paths.emplace_back(entry.path().string());
+  }
+  std::sort(paths.begin(), paths.end());
+
+  std::vector<unsigned char> data;
+  RNTupleDecompressor decompressor;
+  for (const auto &path : paths) {
+    std::ifstream f(path, std::ios::binary);
+    std::vector<unsigned char> sealed((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    if (sealed.empty())
+      continue;
+    auto unzipSize = GetUnzipSize(sealed.data(), sealed.size());
+    if (unzipSize == 0) {
+      data.insert(data.end(), sealed.begin(), sealed.end());
+      continue;
+    }
+    auto offset = data.size();
+    data.resize(offset + unzipSize);
+    decompressor(sealed.data(), sealed.size(), unzipSize, data.data() + offset);
+  }
+  printf("Loaded %lu pages (%lu bytes uncompressed) from %s\n", paths.size(), data.size(), dir.c_str());
+  return data;
+}
+
+/// Times compression and decompression for all combinations of data shape, block size, and codec.  Every
+/// data shape is a pool of poolSize bytes that is cut into blocks.
+static void RunMatrix(const std::string &pageDir, std::size_t poolSize, RNTupleAtomicCounter &ctrWall,
+                      RNTupleTickCounter<RNTupleAtomicCounter> &ctrCpu, std::vector<ClockHist *> &hists)
+{
+  const std::size_t kNumFloats = poolSize / sizeof(float);
+  std::vector<std::pair<std::string, std::vector<unsigned char>>> shapes;
+
+  std::vector<float> values(kNumFloats);
+  for (auto &v : values)
+    v = gRandom->Gaus();
+  const auto *begin = reinterpret_cast<const unsigned char *>(values.data());
+  shapes.emplace_back("random", std::vector<unsigned char>(begin, begin + kNumFloats * sizeof(float)));
+  std::sort(values.begin(), values.end());
+  shapes.emplace_back("sorted", std::vector<unsigned char>(begin, begin + kNumFloats * sizeof(float)));
+
+  if (!pageDir.empty()) {
+    auto pages = LoadPageDumps(pageDir);
+    if (pages.empty()) {
+      fprintf(stderr, "No page dumps found in %s\n", pageDir.c_str());
+      exit(1);
+    }
+    // Repeat the page contents until the pool is full
+    std::vector<unsigned char> pool(poolSize);
+    for (std::size_t i = 0; i < poolSize; i += pages.size())
+      memcpy(pool.data() + i, pages.data(), std::min(pages.size(), poolSize - i));
+    shapes.emplace_back("pages", std::move(pool));
+  }
+
+  RNTupleCompressor compressor;
+  RNTupleDecompressor decompressor;
+  const auto settings = GetMatrixSettings();
+  printf("%-8s %-6s %-8s %8s %16s %16s\n", "shape", "block", "codec", "ratio", "compress MB/s", "decompress MB/s");
+  for (const auto &[shapeName, pool] : shapes) {
+    for (std::size_t blockSize = 4 * 1024; blockSize <= 1024 * 1024; blockSize *= 4) {
+      const std::size_t nBlocks = pool.size() / blockSize;
+      std::vector<unsigned char> zipped(pool.size());
+      std::vector<std::size_t> zipSizes(nBlocks);
+      std::vector<unsigned char> dest(blockSize);
+
+      for (int setting : settings) {
+        const std::string name = shapeName + " " + GetBlockSizeName(blockSize) + " " + GetSettingsName(setting);
+        auto *hZip = new ClockHist(name + " zip", blockSize);
+        auto *hUnzip = new ClockHist(name + " unzip", blockSize);
+        hists.emplace_back(hZip);
+        hists.emplace_back(hUnzip);
+
+        std::size_t sumZipped = 0;
+        for (std::size_t i = 0; i < nBlocks; ++i) {
+          {
+            ClockHistRAII t(*hZip, ctrWall, ctrCpu);
+            {
+              RNTupleAtomicTimer timer(ctrWall, ctrCpu);
+              zipSizes[i] = compressor(pool.data() + i * blockSize, blockSize, setting);
+            }
+          }
+          memcpy(zipped.data() + i * blockSize, compressor.GetZipBuffer(), zipSizes[i]);
+          sumZipped += zipSizes[i];
+          ClobberMemory();
+        }
+
+        for (std::size_t i = 0; i < nBlocks; ++i) {
+          {
+            ClockHistRAII t(*hUnzip, ctrWall, ctrCpu);
+            {
+              RNTupleAtomicTimer timer(ctrWall, ctrCpu);
+              decompressor(zipped.data() + i * blockSize, zipSizes[i], blockSize, dest.data());
+            }
+          }
+          ClobberMemory();
+        }
+
+        printf("%-8s %-6s %-8s %8.2f %16.1f %16.1f\n", shapeName.c_str(), GetBlockSizeName(blockSize).c_str(),
+               GetSettingsName(setting).c_str(), double(nBlocks * blockSize) / sumZipped, hZip->GetThroughput(),
+               hUnzip->GetThroughput());
+      }
+    }
+  }
+}
+
 static void Show() {
   auto app = TApplication("", nullptr, nullptr);
   gStyle->SetTextFont(42);
@@ -181,18 +371,23 @@ static void Show() {
 
 static void Usage(const char *progname) {
   printf("%s [-s random seed] [-o output file] [-b <block size in kB, defaults to 10kB>] "
-         "[-i(identical block for decompression)] [-s(how)]\n",
+         "[-i(identical block for decompression)] [-s(how)]\n"
+         "   [-m(atrix of codecs, block sizes, and data shapes)] [-d <ntuple_dump page directory for -m>]\n"
+         "   [-n <MB of data per shape for -m, defaults to 16>]\n",
          progname);
 }
 
 int main(int argc, char **argv) {
   bool show = false;
   bool use_identical_block = false;
+  bool matrix = false;
+  std::string pageDir;
+  std::size_t poolSize = 16 * 1024 * 1024;
   std::string output = "clock.root";
   double seed = 42.0;
   int blockSize = 10000;
   int c;
-  while ((c = getopt(argc, argv, "hvr:o:b:is")) != -1) {
+  while ((c = getopt(argc, argv, "hvr:o:b:ismd:n:")) != -1) {
     switch (c) {
     case 'h':
     case 'v':
@@ -213,6 +408,15 @@ int main(int argc, char **argv) {
     case 's':
       show = true;
       break;
+    case 'm':
+      matrix = true;
+      break;
+    case 'd':
+      pageDir = optarg;
+      break;
+    case 'n':
+      poolSize = std::max(1, atoi(optarg)) * 1024 * 1024;
+      break;
     default:
       fprintf(stderr, "Unknown option: -%c\n", c);
       Usage(argv[0]);
@@ -222,6 +426,25 @@ int main(int argc, char **argv) {
 
   printf("Clock information: clock() = %ld    CLOCKS_PER_SEC = %ld\n", clock(), CLOCKS_PER_SEC);
 
+  if (matrix) {
+    gRandom->SetSeed(seed);
+    RNTupleMetrics metrics("metrics");
+    auto ctrWall = metrics.MakeCounter<RNTupleAtomicCounter*>("timeWall", "ns", "Wall time counter");
+    auto ctrCpu = metrics.MakeCounter<ROOT::Experimental::Detail::RNTupleTickCounter<RNTupleAtomicCounter>*>(
+      "timeCpu", "ns", "CPU time counter");
+    metrics.Enable();
+
+    std::vector<ClockHist *> hists;
+    RunMatrix(pageDir, poolSize, *ctrWall, *ctrCpu, hists);
+
+    auto f = TFile::Open(output.c_str(), "RECREATE");
+    f->cd();
+    for (auto h : hists)
+      h->Write();
+    f->Close();
+    return 0;
+  }
+
   std::string blockSizeStr = std::to_string(blockSize / 1000) + "kB";
 
   gHistNop = new ClockHist("no-op", 0, 1200);                                             // [0 - 1.2us]
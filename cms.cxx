@@ -18,30 +18,64 @@
 #include <TSystem.h>
 #include <TTreePerfStats.h>
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cmath>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <utility>
 
+#include <getopt.h>
+
+#include "cutflow.h"
+#include "io_engine.h"
+#include "kinematics.h"
+#include "ntuple_pages.h"
+#include "timeline.h"
 #include "util.h"
 
 bool g_perf_stats = false;
 bool g_show = false;
 unsigned int g_cluster_bunch_size = 1;
-
-static ROOT::Experimental::RNTupleReadOptions GetRNTupleOptions() {
+unsigned g_n_threads = 1;
+/// Negative: follow -m, zero: decompress on the reading thread, positive: size of the unzip thread pool
+int g_unzip_threads = -1;
+/// Set if implicit multi-threading is only turned on for the unzip threads, i.e. -u without -m
+bool g_unzip_threads_only_mt = false;
+bool g_lazy = false;
+bool g_rdf_optimized = false;
+bool g_cutflow = false;
+unsigned g_memory_budget_mb = 0;
+IoEngines g_io_engine = IoEngines::kPread;
+bool g_json = false;
+bool g_hw_counters = false;
+std::string g_timeline_path;
+AnalysisResults g_results;
+
+static ROOT::Experimental::RNTupleReadOptions GetRNTupleOptions(const std::string &ntupleName,
+                                                                const std::string &path)
+{
    using RNTupleReadOptions = ROOT::Experimental::RNTupleReadOptions;
 
+   int clusterBunchSize = g_cluster_bunch_size;
+   if (g_memory_budget_mb > 0) {
+      clusterBunchSize =
+         CapClusterBunchSize(clusterBunchSize, GetAverageClusterSize(ntupleName, path), g_memory_budget_mb);
+   }
+
    RNTupleReadOptions options;
-   if (g_cluster_bunch_size < 1) {
+   if (clusterBunchSize < 1) {
       options.SetClusterCache(RNTupleReadOptions::EClusterCache::kOff);
    } else {
-      options.SetClusterBunchSize(g_cluster_bunch_size);
+      options.SetClusterBunchSize(clusterBunchSize);
    }
+   if (g_unzip_threads == 0)
+      options.SetUseImplicitMT(RNTupleReadOptions::EImplicitMT::kOff);
+   PrintPrefetchSettings(clusterBunchSize, g_unzip_threads != 0, g_memory_budget_mb, g_unzip_threads_only_mt);
    return options;
 }
 
@@ -74,15 +108,22 @@ static void Show(TH1D *h) {
    app.Run();
 }
 
-static void TreeDirect(const std::string &path) {
-   auto ts_init = std::chrono::steady_clock::now();
+/// Number of selected dimuon candidates that are buffered before their masses are computed in one batch
+constexpr std::size_t kDimuonBatchSize = 4096;
 
-   auto file = OpenOrDownload(path);
-   auto tree = file->Get<TTree>("Events");
-   TTreePerfStats *ps = nullptr;
-   if (g_perf_stats)
-      ps = new TTreePerfStats("ioperf", tree);
+/// Stages of the cut flow profile (-f)
+enum ECutFlowStages { kStageNMuon, kStageCharge, kStageKinematics };
+static const std::vector<std::string> kCutFlowStages{"nMuon", "Muon_charge", "kinematics"};
+
+static void FillDimuonMasses(kinematics::PairBuffer &dimuons, std::vector<double> &masses, TH1D *hMass)
+{
+   masses.resize(dimuons.GetSize());
+   kinematics::PtEtaPhiMMassBatch(dimuons, masses.data());
+   hMass->FillN(masses.size(), masses.data(), nullptr);
+   dimuons.Clear();
+}
 
+static void ProcessTreeRange(TTree *tree, const EntryRange &range, TH1D *hMass, CutFlow *cutFlow) {
    unsigned int nMuons;
    TBranch *br_nMuons;
    tree->SetBranchAddress("nMuon", &nMuons, &br_nMuons);
@@ -104,55 +145,103 @@ static void TreeDirect(const std::string &path) {
    TBranch *br_MuonMass;
    tree->SetBranchAddress("Muon_mass", &Muon_mass, &br_MuonMass);
 
-   auto hMass = new TH1D("Dimuon_mass", "Dimuon_mass", 2000, 0.25, 300);
+   kinematics::PairBuffer dimuons;
+   std::vector<double> masses;
 
-   auto nEntries = tree->GetEntries();
-   std::chrono::steady_clock::time_point ts_first = std::chrono::steady_clock::now();
-   for (decltype(nEntries) entryId = 0; entryId < nEntries; ++entryId) {
+   tree->SetCacheEntryRange(range.first, range.second);
+   TimelineLoop loop(range.first, range.second, [&] { return GetClusterStarts(tree); });
+   for (Long64_t entryId = range.first; entryId < Long64_t(range.second); ++entryId) {
+      loop.Next(entryId);
       if (entryId % 1000 == 0)
          std::cout << "Processed " << entryId << " entries" << std::endl;
 
       tree->LoadTree(entryId);
 
-      br_nMuons->GetEntry(entryId);
-      if (nMuons != 2)
-         continue;
-      br_MuonCharge->GetEntry(entryId);
-      if (Muon_charge[0] == Muon_charge[1])
-         continue;
+      {
+         CutFlowRAII stage(cutFlow, kStageNMuon);
+         br_nMuons->GetEntry(entryId);
+         if (!stage.Pass(nMuons == 2))
+            continue;
+      }
+      {
+         CutFlowRAII stage(cutFlow, kStageCharge);
+         br_MuonCharge->GetEntry(entryId);
+         if (!stage.Pass(Muon_charge[0] != Muon_charge[1]))
+            continue;
+      }
 
+      CutFlowRAII stage(cutFlow, kStageKinematics);
+      stage.Pass(true);
       br_MuonPhi->GetEntry(entryId);
       br_MuonPt->GetEntry(entryId);
       br_MuonEta->GetEntry(entryId);
       br_MuonMass->GetEntry(entryId);
-      float x_sum = 0.;
-      float y_sum = 0.;
-      float z_sum = 0.;
-      float e_sum = 0.;
-      for (std::size_t i = 0u; i < 2; ++i) {
-         // Convert to (e, x, y, z) coordinate system and update sums
-         const auto x = Muon_pt[i] * std::cos(Muon_phi[i]);
-         x_sum += x;
-         const auto y = Muon_pt[i] * std::sin(Muon_phi[i]);
-         y_sum += y;
-         const auto z = Muon_pt[i] * std::sinh(Muon_eta[i]);
-         z_sum += z;
-         const auto e = std::sqrt(x * x + y * y + z * z + Muon_mass[i] * Muon_mass[i]);
-         e_sum += e;
-      }
-      // Return invariant mass with (+, -, -, -) metric
-      auto mass = std::sqrt(e_sum * e_sum - x_sum * x_sum - y_sum * y_sum - z_sum * z_sum);
-      hMass->Fill(mass);
+      dimuons.Add(Muon_pt[0], Muon_eta[0], Muon_phi[0], Muon_mass[0],
+                  Muon_pt[1], Muon_eta[1], Muon_phi[1], Muon_mass[1]);
+      if (dimuons.GetSize() == kDimuonBatchSize)
+         FillDimuonMasses(dimuons, masses, hMass);
+   }
+   FillDimuonMasses(dimuons, masses, hMass);
+}
+
+static void TreeDirect(const std::string &path) {
+   auto ts_init = std::chrono::steady_clock::now();
+
+   auto file = OpenOrDownload(path);
+   auto tree = file->Get<TTree>("Events");
+   TTreePerfStats *ps = nullptr;
+   if (g_perf_stats || g_hw_counters)
+      ps = new TTreePerfStats("ioperf", tree);
+
+   auto hMass = new TH1D("Dimuon_mass", "Dimuon_mass", 2000, 0.25, 300);
+
+   // One file, tree, and partial histogram per thread; the first worker uses the main tree and histogram
+   auto ranges = PartitionEntries(GetClusterStarts(tree), tree->GetEntries(), g_n_threads);
+   std::vector<TFile *> files{file};
+   std::vector<TTree *> trees{tree};
+   std::vector<TTreePerfStats *> perfStats{ps};
+   std::vector<TH1D *> partials{hMass};
+   for (unsigned i = 1; i < ranges.size(); ++i) {
+      files.emplace_back(OpenOrDownload(path));
+      trees.emplace_back(files.back()->Get<TTree>("Events"));
+      if (ps)
+         perfStats.emplace_back(new TTreePerfStats("ioperf", trees.back()));
+      partials.emplace_back(static_cast<TH1D *>(hMass->Clone()));
+      partials.back()->SetDirectory(nullptr);
+   }
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < ranges.size(); ++i) {
+      cutFlows.emplace_back(kCutFlowStages);
+      cutFlows.back().SetBytesCounter(GetTreeBytesCounter(files[i]));
+   }
+
+   std::chrono::steady_clock::time_point ts_first = std::chrono::steady_clock::now();
+   MarkPerfPhase("init");
+   RunInThreads(ranges.size(), [&](unsigned i) {
+      ProcessTreeRange(trees[i], ranges[i], partials[i], g_cutflow ? &cutFlows[i] : nullptr);
+   });
+   for (unsigned i = 1; i < partials.size(); ++i) {
+      hMass->Add(partials[i]);
+      delete partials[i];
    }
 
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
    auto runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
    auto runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
 
-   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
-   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
-   if (g_perf_stats)
-      ps->Print();
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   g_results.events_read = tree->GetEntries();
+   g_results.events_selected = hMass->GetEntries();
+   if (g_perf_stats) {
+      for (auto p : perfStats)
+         p->Print();
+   }
+   if (g_perf_stats || g_hw_counters) {
+      for (auto p : perfStats)
+         AddTreePerfStats(p, &g_results);
+   }
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
 
    if (g_show)
       Show(hMass);
@@ -160,52 +249,49 @@ static void TreeDirect(const std::string &path) {
 }
 
 
-static void NTupleDirect(const std::string &path) {
-   using ENTupleInfo = ROOT::Experimental::ENTupleInfo;
-   using RNTupleModel = ROOT::Experimental::RNTupleModel;
-   using RNTupleReader = ROOT::Experimental::RNTupleReader;
-
-   // Trigger download if needed.
-   delete OpenOrDownload(path);
-
-   auto ts_init = std::chrono::steady_clock::now();
-
-   auto model = RNTupleModel::Create();
-   auto options = GetRNTupleOptions();
-   auto ntuple = RNTupleReader::Open(std::move(model), "Events", path, options);
-   if (g_perf_stats)
-      ntuple->EnableMetrics();
-
-   auto hMass = new TH1D("Dimuon_mass", "Dimuon_mass", 2000, 0.25, 300);
-
-   const auto &desc = ntuple->GetDescriptor();
+static void ProcessNTupleRange(ROOT::Experimental::RNTupleReader &ntuple, const EntryRange &range, TH1D *hMass,
+                               CutFlow *cutFlow)
+{
+   const auto &desc = ntuple.GetDescriptor();
    const auto columnId = desc.FindPhysicalColumnId(desc.FindFieldId("nMuon"), 0, 0);
    const auto collectionFieldId = desc.GetColumnDescriptor(columnId).GetFieldId();
    const auto collectionFieldName = desc.GetFieldDescriptor(collectionFieldId).GetFieldName();
 
-   auto viewMuon = ntuple->GetCollectionView(collectionFieldName);
+   auto viewMuon = ntuple.GetCollectionView(collectionFieldName);
    auto viewMuonCharge = viewMuon.GetView<std::int32_t>("_0.Muon_charge");
    auto viewMuonPt = viewMuon.GetView<float>("_0.Muon_pt");
    auto viewMuonEta = viewMuon.GetView<float>("_0.Muon_eta");
    auto viewMuonPhi = viewMuon.GetView<float>("_0.Muon_phi");
    auto viewMuonMass = viewMuon.GetView<float>("_0.Muon_mass");
 
-   std::chrono::steady_clock::time_point ts_first = std::chrono::steady_clock::now();
-   for (auto entryId : ntuple->GetEntryRange()) {
+   kinematics::PairBuffer dimuons;
+   std::vector<double> masses;
+
+   TimelineLoop loop(range.first, range.second, [&] { return GetClusterStarts(ntuple.GetDescriptor()); });
+   for (auto entryId : ROOT::Experimental::RNTupleGlobalRange(range.first, range.second)) {
+      loop.Next(entryId);
       if (entryId % 1000 == 0)
          std::cout << "Processed " << entryId << " entries" << std::endl;
 
-      if (viewMuon(entryId) != 2)
-         continue;
+      {
+         CutFlowRAII stage(cutFlow, kStageNMuon);
+         if (!stage.Pass(viewMuon(entryId) == 2))
+            continue;
+      }
 
-      std::int32_t charges[2];
       int i = 0;
-      for (auto m : viewMuon.GetCollectionRange(entryId)) {
-         charges[i++] = viewMuonCharge(m);
+      {
+         CutFlowRAII stage(cutFlow, kStageCharge);
+         std::int32_t charges[2];
+         for (auto m : viewMuon.GetCollectionRange(entryId)) {
+            charges[i++] = viewMuonCharge(m);
+         }
+         if (!stage.Pass(charges[0] != charges[1]))
+            continue;
       }
-      if (charges[0] == charges[1])
-         continue;
 
+      CutFlowRAII stage(cutFlow, kStageKinematics);
+      stage.Pass(true);
       float pt[2];
       float eta[2];
       float phi[2];
@@ -219,33 +305,186 @@ static void NTupleDirect(const std::string &path) {
          ++i;
       }
 
-      float x_sum = 0.;
-      float y_sum = 0.;
-      float z_sum = 0.;
-      float e_sum = 0.;
-      for (std::size_t i = 0u; i < 2; ++i) {
-         // Convert to (e, x, y, z) coordinate system and update sums
-         const auto x = pt[i] * std::cos(phi[i]);
-         x_sum += x;
-         const auto y = pt[i] * std::sin(phi[i]);
-         y_sum += y;
-         const auto z = pt[i] * std::sinh(eta[i]);
-         z_sum += z;
-         const auto e = std::sqrt(x * x + y * y + z * z + mass[i] * mass[i]);
-         e_sum += e;
+      dimuons.Add(pt[0], eta[0], phi[0], mass[0], pt[1], eta[1], phi[1], mass[1]);
+      if (dimuons.GetSize() == kDimuonBatchSize)
+         FillDimuonMasses(dimuons, masses, hMass);
+   }
+   FillDimuonMasses(dimuons, masses, hMass);
+}
+
+
+/// Lazy flavour of ProcessNTupleRange.  For every cluster, first scans the muon counts and charges through the reader
+/// and collects the selected entries.  Only then, the kinematics of the selected muons are mapped from the page source
+/// that has the cluster cache turned off, such that only the pt/eta/phi/mass pages with selected entries are read
+/// and decompressed.
+static void ProcessNTupleLazyRange(ROOT::Experimental::RNTupleReader &ntuple,
+                                   ROOT::Experimental::Internal::RPageSource &source, const EntryRange &range,
+                                   TH1D *hMass, CutFlow *cutFlow)
+{
+   using RClusterIndex = ROOT::Experimental::RClusterIndex;
+
+   const auto &desc = ntuple.GetDescriptor();
+   const auto columnId = desc.FindPhysicalColumnId(desc.FindFieldId("nMuon"), 0, 0);
+   const auto collectionFieldId = desc.GetColumnDescriptor(columnId).GetFieldId();
+   const auto collectionFieldName = desc.GetFieldDescriptor(collectionFieldId).GetFieldName();
+
+   auto viewMuon = ntuple.GetCollectionView(collectionFieldName);
+   auto viewMuonCharge = viewMuon.GetView<std::int32_t>("_0.Muon_charge");
+   NTuplePageSpans<float> pagesMuonPt(source, collectionFieldName + "._0.Muon_pt");
+   NTuplePageSpans<float> pagesMuonEta(source, collectionFieldName + "._0.Muon_eta");
+   NTuplePageSpans<float> pagesMuonPhi(source, collectionFieldName + "._0.Muon_phi");
+   NTuplePageSpans<float> pagesMuonMass(source, collectionFieldName + "._0.Muon_mass");
+
+   std::vector<std::pair<std::uint64_t, std::uint64_t>> clusters;
+   for (const auto &c : desc.GetClusterIterable()) {
+      const std::uint64_t first = std::max<std::uint64_t>(c.GetFirstEntryIndex(), range.first);
+      const std::uint64_t last = std::min<std::uint64_t>(c.GetFirstEntryIndex() + c.GetNEntries(), range.second);
+      if (first < last)
+         clusters.emplace_back(first, last);
+   }
+   std::sort(clusters.begin(), clusters.end());
+
+   kinematics::PairBuffer dimuons;
+   std::vector<double> masses;
+   // Cluster-local index of the first muon of every selected entry of the current cluster
+   std::vector<RClusterIndex> selected;
+
+   for (const auto &[clusterFirst, clusterLast] : clusters) {
+      TimelineScope chunk(TimelineCategory::kLoop, clusterFirst, clusterLast - clusterFirst);
+      selected.clear();
+      for (auto entryId = clusterFirst; entryId < clusterLast; ++entryId) {
+         if (entryId % 1000 == 0)
+            std::cout << "Processed " << entryId << " entries" << std::endl;
+
+         {
+            CutFlowRAII stage(cutFlow, kStageNMuon);
+            if (!stage.Pass(viewMuon(entryId) == 2))
+               continue;
+         }
+         CutFlowRAII stage(cutFlow, kStageCharge);
+         const auto firstMuon = *viewMuon.GetCollectionRange(entryId).begin();
+         const RClusterIndex secondMuon(firstMuon.GetClusterId(), firstMuon.GetIndex() + 1);
+         if (!stage.Pass(viewMuonCharge(firstMuon) != viewMuonCharge(secondMuon)))
+            continue;
+         selected.emplace_back(firstMuon);
+      }
+
+      for (const auto &firstMuon : selected) {
+         CutFlowRAII stage(cutFlow, kStageKinematics);
+         stage.Pass(true);
+         float pt[2];
+         float eta[2];
+         float phi[2];
+         float mass[2];
+         for (int i = 0; i < 2; ++i) {
+            // The two muons of an entry can be on different pages
+            const RClusterIndex m(firstMuon.GetClusterId(), firstMuon.GetIndex() + i);
+            pt[i] = pagesMuonPt.Get(m)[0];
+            eta[i] = pagesMuonEta.Get(m)[0];
+            phi[i] = pagesMuonPhi.Get(m)[0];
+            mass[i] = pagesMuonMass.Get(m)[0];
+         }
+
+         dimuons.Add(pt[0], eta[0], phi[0], mass[0], pt[1], eta[1], phi[1], mass[1]);
+         if (dimuons.GetSize() == kDimuonBatchSize)
+            FillDimuonMasses(dimuons, masses, hMass);
+      }
+   }
+   FillDimuonMasses(dimuons, masses, hMass);
+}
+
+
+static void NTupleDirect(const std::string &path) {
+   using ENTupleInfo = ROOT::Experimental::ENTupleInfo;
+   using RNTupleModel = ROOT::Experimental::RNTupleModel;
+   using RNTupleReader = ROOT::Experimental::RNTupleReader;
+
+   // Trigger download if needed.
+   delete OpenOrDownload(path);
+
+   // With a memory budget, the options read the ntuple's footer for the average cluster size; not part of the
+   // timed initialization
+   auto options = GetRNTupleOptions("Events", path);
+
+   auto ts_init = std::chrono::steady_clock::now();
+
+   auto model = RNTupleModel::Create();
+   auto ntuple = OpenNTupleReader(std::move(model), "Events", path, options, g_io_engine);
+   // The cut flow takes the bytes read from the metrics
+   if (g_perf_stats || g_hw_counters || g_cutflow)
+      ntuple->EnableMetrics();
+
+   auto hMass = new TH1D("Dimuon_mass", "Dimuon_mass", 2000, 0.25, 300);
+
+   // One reader and one partial histogram per thread; the first worker uses the main reader and histogram
+   auto ranges = PartitionEntries(GetClusterStarts(ntuple->GetDescriptor()), ntuple->GetNEntries(), g_n_threads);
+   std::vector<std::unique_ptr<RNTupleReader>> clones;
+   std::vector<RNTupleReader *> readers{ntuple.get()};
+   std::vector<TH1D *> partials{hMass};
+   for (unsigned i = 1; i < ranges.size(); ++i) {
+      clones.emplace_back(CloneNTupleReader(*ntuple, "Events", path, options, g_io_engine));
+      if (g_perf_stats || g_hw_counters || g_cutflow)
+         clones.back()->EnableMetrics();
+      readers.emplace_back(clones.back().get());
+      partials.emplace_back(static_cast<TH1D *>(hMass->Clone()));
+      partials.back()->SetDirectory(nullptr);
+   }
+   // In lazy mode, the muon kinematics are read page by page from one page source per thread without cluster cache
+   std::vector<std::unique_ptr<ROOT::Experimental::Internal::RPageSource>> sources;
+   auto lazyOptions = options;
+   lazyOptions.SetClusterCache(ROOT::Experimental::RNTupleReadOptions::EClusterCache::kOff);
+   for (unsigned i = 0; g_lazy && i < ranges.size(); ++i) {
+      sources.emplace_back(OpenNTuplePageSource("Events", path, lazyOptions, g_io_engine));
+      sources.back()->Attach();
+      if (g_perf_stats || g_hw_counters || g_cutflow)
+         sources.back()->GetMetrics().Enable();
+   }
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < ranges.size(); ++i) {
+      cutFlows.emplace_back(kCutFlowStages);
+      auto readerBytes = GetNTupleBytesCounter(readers[i]->GetMetrics());
+      if (g_lazy) {
+         auto sourceBytes = GetNTupleBytesCounter(sources[i]->GetMetrics());
+         cutFlows.back().SetBytesCounter([readerBytes, sourceBytes] { return readerBytes() + sourceBytes(); });
+      } else {
+         cutFlows.back().SetBytesCounter(readerBytes);
       }
-      // Return invariant mass with (+, -, -, -) metric
-      auto fmass = std::sqrt(e_sum * e_sum - x_sum * x_sum - y_sum * y_sum - z_sum * z_sum);
-      hMass->Fill(fmass);
+   }
+
+   std::chrono::steady_clock::time_point ts_first = std::chrono::steady_clock::now();
+   MarkPerfPhase("init");
+   RunInThreads(ranges.size(), [&](unsigned i) {
+      CutFlow *cutFlow = g_cutflow ? &cutFlows[i] : nullptr;
+      if (g_lazy)
+         ProcessNTupleLazyRange(*readers[i], *sources[i], ranges[i], partials[i], cutFlow);
+      else
+         ProcessNTupleRange(*readers[i], ranges[i], partials[i], cutFlow);
+   });
+   for (unsigned i = 1; i < partials.size(); ++i) {
+      hMass->Add(partials[i]);
+      delete partials[i];
    }
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
    auto runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
    auto runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
 
-   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
-   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
-   if (g_perf_stats)
-      ntuple->PrintInfo(ENTupleInfo::kMetrics);
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   g_results.events_read = ntuple->GetNEntries();
+   g_results.events_selected = hMass->GetEntries();
+   if (g_perf_stats) {
+      for (auto r : readers)
+         r->PrintInfo(ENTupleInfo::kMetrics);
+      for (const auto &s : sources)
+         s->GetMetrics().Print(std::cout);
+   }
+   if (g_perf_stats || g_hw_counters) {
+      for (auto r : readers)
+         AddNTupleMetrics(*r, &g_results);
+      for (const auto &s : sources)
+         AddNTupleMetrics(s->GetMetrics(), &g_results);
+   }
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
    if (g_show)
       Show(hMass);
 }
@@ -254,34 +493,124 @@ static void NTupleDirect(const std::string &path) {
 static void Rdf(ROOT::RDataFrame &df) {
    auto ts_init = std::chrono::steady_clock::now();
    std::chrono::steady_clock::time_point ts_first;
-   bool ts_first_set = false;
+   std::once_flag ts_first_flag;
 
-   auto df_timing = df.Define("TIMING", [&ts_first, &ts_first_set]() {
-      if (!ts_first_set)
+   auto df_timing = df.Define("TIMING", [&ts_first, &ts_first_flag]() {
+      // With implicit multi-threading, the Define runs concurrently in several slots
+      std::call_once(ts_first_flag, [&ts_first]() {
          ts_first = std::chrono::steady_clock::now();
-      ts_first_set = true;
-      return ts_first_set;}).Filter([](bool b){ return b; }, {"TIMING"});
-   auto df_2mu = df_timing.Filter([](unsigned int s) { return s == 2; }, {"nMuon"});
-   auto df_os = df_2mu.Filter([](const ROOT::VecOps::RVec<int> &c) {return c[0] != c[1];}, {"Muon_charge"});
+         MarkPerfPhase("init");
+      });
+      return true;}).Filter([](bool b){ return b; }, {"TIMING"});
+   // One cut flow per processing slot.  RDF reads the columns before it calls the lambdas, so the stages only
+   // measure the lambdas themselves.  Without -f, the adapters only forward the calls.
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < df.GetNSlots(); ++i)
+      cutFlows.emplace_back(kCutFlowStages);
+
+   auto df_2mu = df_timing.Filter(CutFlowFilter(cutFlows, kStageNMuon, [](unsigned int s) { return s == 2; }),
+                                  {"rdfslot_", "nMuon"});
+   auto df_os = df_2mu.Filter(CutFlowFilter(cutFlows, kStageCharge,
+                                            [](const ROOT::VecOps::RVec<int> &c) {return c[0] != c[1];}),
+                              {"rdfslot_", "Muon_charge"});
    //auto df_os = df_2mu.Filter("Muon_charge[0] != Muon_charge[1]");
-   auto df_mass = df_os.Define("Dimuon_mass", ROOT::VecOps::InvariantMass<float>,
-                               {"Muon_pt", "Muon_eta", "Muon_phi", "Muon_mass"});
+   auto df_mass = df_os.Define("Dimuon_mass",
+                               CutFlowDefine(cutFlows, kStageKinematics,
+                                             [](const ROOT::RVecF &pt, const ROOT::RVecF &eta, const ROOT::RVecF &phi,
+                                                const ROOT::RVecF &mass)
+                                             {
+                                                return kinematics::PtEtaPhiMMass(pt[0], eta[0], phi[0], mass[0],
+                                                                                 pt[1], eta[1], phi[1], mass[1]);
+                                             }),
+                               {"rdfslot_", "Muon_pt", "Muon_eta", "Muon_phi", "Muon_mass"});
+   auto hMass = df_mass.Histo1D<float>({"Dimuon_mass", "Dimuon_mass", 2000, 0.25, 300}, "Dimuon_mass");
+   // Only booked for the JSON summary
+   ROOT::RDF::RResultPtr<ULong64_t> nEvents;
+   if (g_json)
+      nEvents = df.Count();
+
+   *hMass;
+   auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
+   auto runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
+   auto runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
+
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   if (nEvents)
+      g_results.events_read = *nEvents;
+   g_results.events_selected = hMass->GetEntries();
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
+   if (g_show)
+      Show(hMass.GetPtr());
+}
+
+
+/// Optimized flavour of Rdf: the timer and both muon cuts are fused into a single Filter and the dimuon mass is
+/// computed with the RVec operations on the muon collection.
+static void RdfOptimized(ROOT::RDataFrame &df) {
+   auto ts_init = std::chrono::steady_clock::now();
+   std::chrono::steady_clock::time_point ts_first;
+   std::once_flag ts_first_flag;
+
+   // One cut flow per processing slot.  The fused Filter measures its cuts as separate stages, which do nothing
+   // without -f; the adapter of the Define then only forwards the call.
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < df.GetNSlots(); ++i)
+      cutFlows.emplace_back(kCutFlowStages);
+
+   auto df_os = df.Filter([&ts_first, &ts_first_flag, &cutFlows](unsigned int slot, unsigned int nMuon,
+                                                                 const ROOT::RVecI &charge) {
+      // With implicit multi-threading, the Filter runs concurrently in several slots
+      std::call_once(ts_first_flag, [&ts_first]() {
+         ts_first = std::chrono::steady_clock::now();
+         MarkPerfPhase("init");
+      });
+      CutFlow *cutFlow = cutFlows.empty() ? nullptr : &cutFlows[slot];
+      {
+         CutFlowRAII stage(cutFlow, kStageNMuon);
+         if (!stage.Pass(nMuon == 2))
+            return false;
+      }
+      CutFlowRAII stage(cutFlow, kStageCharge);
+      return stage.Pass(charge[0] != charge[1]);
+   }, {"rdfslot_", "nMuon", "Muon_charge"});
+   auto df_mass = df_os.Define("Dimuon_mass",
+                               CutFlowDefine(cutFlows, kStageKinematics,
+                                             [](const ROOT::RVecF &pt, const ROOT::RVecF &eta,
+                                                const ROOT::RVecF &phi, const ROOT::RVecF &mass)
+                                             {
+                                                return ROOT::VecOps::InvariantMass(pt, eta, phi, mass);
+                                             }),
+                               {"rdfslot_", "Muon_pt", "Muon_eta", "Muon_phi", "Muon_mass"});
    auto hMass = df_mass.Histo1D<float>({"Dimuon_mass", "Dimuon_mass", 2000, 0.25, 300}, "Dimuon_mass");
+   // Only booked for the JSON summary
+   ROOT::RDF::RResultPtr<ULong64_t> nEvents;
+   if (g_json)
+      nEvents = df.Count();
 
    *hMass;
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
    auto runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
    auto runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
 
-   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
-   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   if (nEvents)
+      g_results.events_read = *nEvents;
+   g_results.events_selected = hMass->GetEntries();
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
    if (g_show)
       Show(hMass.GetPtr());
 }
 
 
 static void Usage(const char *progname) {
-  printf("%s [-i input.root/ntuple] [-r(df)] [-m(t)] [-s(show)] [-p(erformance stats)] [-x cluster bunch size]\n",
+  printf("%s [-i input.root/ntuple] [-r(df)] [-O (optimized RDF, implies -r)] [-m(t)] [-s(show)]\n"
+         "   [-p(erformance stats)] [-x cluster bunch size] [-j threads for the direct event loop]\n"
+         "   [-l(azy muon kinematics)] [-f (cut flow profile)]\n"
+         "   [-u unzip threads] [-M cluster cache memory budget in MB]\n"
+         "   [-e I/O engine: pread (default), uring, uring-direct, mmap] [-H(ardware counters)]\n"
+         "   [-T timeline.json] [--json]\n",
          progname);
 }
 
@@ -289,9 +618,11 @@ int main(int argc, char **argv) {
    auto ts_init = std::chrono::steady_clock::now();
 
    bool use_rdf = false;
+   bool use_mt = false;
    std::string path;
+   static const struct option long_options[] = {{"json", no_argument, nullptr, 'J'}, {nullptr, 0, nullptr, 0}};
    int c;
-   while ((c = getopt(argc, argv, "hvsrpmi:x:")) != -1) {
+   while ((c = getopt_long(argc, argv, "hvHsrOpmlfi:x:j:u:M:e:T:", long_options, nullptr)) != -1) {
       switch (c) {
       case 'h':
       case 'v':
@@ -303,6 +634,10 @@ int main(int argc, char **argv) {
       case 'r':
          use_rdf = true;
          break;
+      case 'O':
+         use_rdf = true;
+         g_rdf_optimized = true;
+         break;
       case 'p':
          g_perf_stats = true;
          break;
@@ -310,11 +645,45 @@ int main(int argc, char **argv) {
          g_show = true;
          break;
       case 'm':
-         ROOT::EnableImplicitMT();
+         use_mt = true;
+         break;
+      case 'l':
+         g_lazy = true;
+         break;
+      case 'f':
+         g_cutflow = true;
          break;
       case 'x':
          g_cluster_bunch_size = atoi(optarg);
          break;
+      case 'u':
+         g_unzip_threads = atoi(optarg);
+         break;
+      case 'M':
+         g_memory_budget_mb = atoi(optarg);
+         break;
+      case 'e':
+         g_io_engine = GetIoEngine(optarg);
+         break;
+      case 'j': {
+         char *end;
+         long n = strtol(optarg, &end, 10);
+         if (*end != '\0' || n < 1) {
+            fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+            return 1;
+         }
+         g_n_threads = n;
+         break;
+      }
+      case 'J':
+         g_json = true;
+         break;
+      case 'H':
+         g_hw_counters = true;
+         break;
+      case 'T':
+         g_timeline_path = optarg;
+         break;
       default:
          fprintf(stderr, "Unknown option: -%c\n", c);
          Usage(argv[0]);
@@ -325,13 +694,36 @@ int main(int argc, char **argv) {
       Usage(argv[0]);
       return 1;
    }
+   if (g_hw_counters)
+      StartPerfCounters();
+   if (!g_timeline_path.empty())
+      StartTimeline();
+   if (g_n_threads > 1)
+      ROOT::EnableThreadSafety();
+   // Without -m, the unzip threads turn on implicit multi-threading only for the direct RNTuple event loop: it would
+   // also run the RDF event loop in parallel and read the tree branches in parallel
+   if (g_unzip_threads > 0 && !use_mt && (use_rdf || GetFileFormat(GetSuffix(path)) != FileFormats::kNtuple)) {
+      fprintf(stderr, "Without -m, the unzip threads (-u) only apply to the direct RNTuple event loop\n");
+      return 1;
+   }
+   if (g_unzip_threads > 0)
+      ROOT::EnableImplicitMT(g_unzip_threads);
+   else if (use_mt)
+      ROOT::EnableImplicitMT();
+   g_unzip_threads_only_mt = (g_unzip_threads > 0) && !use_mt;
 
    auto suffix = GetSuffix(path);
+   g_results.analysis = "cms";
+   g_results.input = path;
+   g_results.method = suffix + (use_rdf ? (g_rdf_optimized ? "+rdfopt" : "+rdf") : (g_lazy ? "+lazy" : ""));
    switch (GetFileFormat(suffix)) {
    case FileFormats::kRoot:
       if (use_rdf) {
          ROOT::RDataFrame df("Events", path);
-         Rdf(df);
+         if (g_rdf_optimized)
+            RdfOptimized(df);
+         else
+            Rdf(df);
       } else {
          TreeDirect(path);
       }
@@ -339,7 +731,10 @@ int main(int argc, char **argv) {
    case FileFormats::kNtuple:
       if (use_rdf) {
          ROOT::RDataFrame df("Events", path);
-         Rdf(df);
+         if (g_rdf_optimized)
+            RdfOptimized(df);
+         else
+            Rdf(df);
       } else {
          NTupleDirect(path);
       }
@@ -350,8 +745,19 @@ int main(int argc, char **argv) {
    }
 
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("finish");
    auto runtime_main = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_init).count();
    std::cout << "Runtime-Main: " << runtime_main << "us" << std::endl;
+   PrintPerfCounters(g_results);
+   if (!g_timeline_path.empty())
+      WriteTimeline(g_timeline_path);
+   if (g_json) {
+      if (GetFileFormat(suffix) == FileFormats::kRoot)
+         g_results.bytes_read = TFile::GetFileBytesRead();
+      g_results.runtime_main_us = runtime_main;
+      AddPerfCounters(&g_results);
+      std::cout << GetResultsJson(g_results) << std::endl;
+   }
 
    return 0;
 }
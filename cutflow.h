@@ -0,0 +1,273 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+#ifndef CUTFLOW_H_
+#define CUTFLOW_H_
+
+#include <ROOT/RNTupleMetrics.hxx>
+
+#include <TFile.h>
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "util.h"
+
+/// Cut-flow profile of an event loop.  For every stage of the loop, typically a cut and the columns it reads, counts
+/// the entries going in and coming out, the CPU cycles spent, and the bytes read from storage while in the stage.
+/// The stages are measured with a CutFlowRAII in the event loop or with CutFlowNode adapters around the Filters and
+/// Defines of an RDataFrame chain.  Every thread should use its own cut flow; the cut flows of the threads are summed
+/// with Add().
+///
+/// The bytes are only attributed to the stage that triggers the read if the read happens on the thread of the event
+/// loop, i.e. with the cluster cache turned off (-x 0).  Otherwise, the reads show up where the event loop waits for
+/// the prefetched clusters, if at all.
+class CutFlow {
+public:
+   struct RStage {
+      std::string fName;
+      std::uint64_t fNIn = 0;
+      std::uint64_t fNOut = 0;
+      std::uint64_t fNCycles = 0;
+      std::uint64_t fNBytes = 0;
+   };
+
+private:
+   std::vector<RStage> fStages;
+   /// Returns the number of bytes read so far, e.g. from the RNTuple metrics or TFile::GetBytesRead()
+   std::function<std::uint64_t()> fGetNBytes;
+
+public:
+   explicit CutFlow(const std::vector<std::string> &stageNames)
+   {
+      for (const auto &name : stageNames)
+         fStages.emplace_back(RStage{name});
+   }
+
+   void SetBytesCounter(std::function<std::uint64_t()> getNBytes) { fGetNBytes = std::move(getNBytes); }
+   std::uint64_t GetNBytes() const { return fGetNBytes ? fGetNBytes() : 0; }
+   RStage &GetStage(unsigned idx) { return fStages[idx]; }
+
+   /// The time stamp counter on x86, the steady clock in nanoseconds elsewhere
+   static std::uint64_t GetCycles()
+   {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+   }
+
+   /// Adds the numbers of another cut flow with the same stages, e.g. of another thread
+   void Add(const CutFlow &other)
+   {
+      for (unsigned i = 0; i < fStages.size() && i < other.fStages.size(); ++i) {
+         fStages[i].fNIn += other.fStages[i].fNIn;
+         fStages[i].fNOut += other.fStages[i].fNOut;
+         fStages[i].fNCycles += other.fStages[i].fNCycles;
+         fStages[i].fNBytes += other.fStages[i].fNBytes;
+      }
+   }
+
+   void Print() const
+   {
+      std::uint64_t nCycles = 0;
+      for (const auto &s : fStages)
+         nCycles += s.fNCycles;
+      printf("Cut flow:\n");
+      printf("   %-20s %12s %12s %8s %16s %10s %8s %14s\n", "stage", "in", "out", "pass", "cycles", "cyc/entry",
+             "share", "bytes");
+      for (const auto &s : fStages) {
+         printf("   %-20s %12" PRIu64 " %12" PRIu64 " %7.2f%% %16" PRIu64 " %10.1f %7.2f%% %14" PRIu64 "\n",
+                s.fName.c_str(), s.fNIn, s.fNOut, (s.fNIn == 0) ? 0.0 : 100.0 * s.fNOut / s.fNIn, s.fNCycles,
+                (s.fNIn == 0) ? 0.0 : double(s.fNCycles) / s.fNIn, (nCycles == 0) ? 0.0 : 100.0 * s.fNCycles / nCycles,
+                s.fNBytes);
+      }
+   }
+
+   /// Adds the stage numbers as CutFlow.<stage>.{in,out,cycles,bytes} metrics
+   void AddToResults(AnalysisResults *results) const
+   {
+      for (const auto &s : fStages) {
+         const std::string prefix = "CutFlow." + s.fName;
+         results->metrics.emplace_back(prefix + ".in", s.fNIn);
+         results->metrics.emplace_back(prefix + ".out", s.fNOut);
+         results->metrics.emplace_back(prefix + ".cycles", s.fNCycles);
+         results->metrics.emplace_back(prefix + ".bytes", s.fNBytes);
+      }
+   }
+};
+
+/// Measures one stage of the event loop for the current entry, from construction to destruction.  The entry counts
+/// as passed if Pass(true) has been called.  Does nothing for a null cut flow, so that the same event loop can be
+/// used with and without profiling.
+class CutFlowRAII {
+   CutFlow *fCutFlow;
+   CutFlow::RStage *fStage = nullptr;
+   std::uint64_t fStartCycles = 0;
+   std::uint64_t fStartBytes = 0;
+   bool fPass = false;
+
+public:
+   CutFlowRAII(CutFlow *cutFlow, unsigned stage) : fCutFlow(cutFlow)
+   {
+      if (!fCutFlow)
+         return;
+      fStage = &fCutFlow->GetStage(stage);
+      fStage->fNIn++;
+      fStartBytes = fCutFlow->GetNBytes();
+      fStartCycles = CutFlow::GetCycles();
+   }
+   CutFlowRAII(const CutFlowRAII &) = delete;
+   CutFlowRAII &operator=(const CutFlowRAII &) = delete;
+
+   ~CutFlowRAII()
+   {
+      if (!fCutFlow)
+         return;
+      fStage->fNCycles += CutFlow::GetCycles() - fStartCycles;
+      fStage->fNBytes += fCutFlow->GetNBytes() - fStartBytes;
+      fStage->fNOut += fPass;
+   }
+
+   /// Records the outcome of the stage's cut for the entry and returns it
+   bool Pass(bool pass)
+   {
+      fPass = pass;
+      return pass;
+   }
+};
+
+/// Position of an RDataFrame node in its cut flow stage.  A stage can span several consecutive Filters and Defines:
+/// the first node counts the entries going in, the last node counts the entries coming out, and all nodes add their
+/// cycles and bytes.
+enum class ECutFlowNode { kStage, kStageBegin, kStageInner, kStageEnd };
+
+namespace cutflow_detail {
+
+/// The function type of a lambda, a function object with a single operator(), or a function pointer
+template <typename F> struct CallableSignature : CallableSignature<decltype(&F::operator())> {};
+template <typename R, typename... Args> struct CallableSignature<R (*)(Args...)> { typedef R type(Args...); };
+template <typename C, typename R, typename... Args>
+struct CallableSignature<R (C::*)(Args...) const> { typedef R type(Args...); };
+template <typename C, typename R, typename... Args>
+struct CallableSignature<R (C::*)(Args...)> { typedef R type(Args...); };
+
+} // namespace cutflow_detail
+
+/// Profiling adapter for a Filter or Define callable of an RDataFrame chain.  The adapter takes the processing slot
+/// (the "rdfslot_" column) in front of the arguments of the callable and measures the call in the cut flow of the
+/// slot.  Without cut flows (no -f), it only forwards the call, so that the profiled chain is the benchmarked chain.
+/// Use CutFlowFilter() and CutFlowDefine() to create it.
+template <typename F, typename Signature = typename cutflow_detail::CallableSignature<F>::type>
+class CutFlowNode;
+
+template <typename F, typename R, typename... Args>
+class CutFlowNode<F, R(Args...)> {
+   F fFn;
+   std::vector<CutFlow> *fCutFlows;
+   unsigned fStage;
+   ECutFlowNode fPosition;
+   bool fIsFilter;
+
+public:
+   CutFlowNode(F fn, std::vector<CutFlow> *cutFlows, unsigned stage, ECutFlowNode position, bool isFilter)
+      : fFn(std::move(fn)), fCutFlows(cutFlows), fStage(stage), fPosition(position), fIsFilter(isFilter)
+   {
+   }
+
+   R operator()(unsigned slot, Args... args) const
+   {
+      if (fCutFlows->empty())
+         return fFn(args...);
+
+      auto &cutFlow = (*fCutFlows)[slot];
+      auto &stage = cutFlow.GetStage(fStage);
+      if (fPosition == ECutFlowNode::kStage || fPosition == ECutFlowNode::kStageBegin)
+         stage.fNIn++;
+      const auto startBytes = cutFlow.GetNBytes();
+      const auto startCycles = CutFlow::GetCycles();
+      R result = fFn(args...);
+      stage.fNCycles += CutFlow::GetCycles() - startCycles;
+      stage.fNBytes += cutFlow.GetNBytes() - startBytes;
+      if (fPosition == ECutFlowNode::kStage || fPosition == ECutFlowNode::kStageEnd) {
+         if constexpr (std::is_convertible_v<R, bool>)
+            stage.fNOut += fIsFilter ? static_cast<bool>(result) : true;
+         else
+            stage.fNOut++;
+      }
+      return result;
+   }
+};
+
+/// Wraps a Filter callable; the entry passes the stage if the callable returns true
+template <typename F>
+CutFlowNode<F> CutFlowFilter(std::vector<CutFlow> &cutFlows, unsigned stage, F fn,
+                             ECutFlowNode position = ECutFlowNode::kStage)
+{
+   return CutFlowNode<F>(std::move(fn), &cutFlows, stage, position, true /* isFilter */);
+}
+
+/// Wraps a Define callable; every entry that reaches the Define passes the stage
+template <typename F>
+CutFlowNode<F> CutFlowDefine(std::vector<CutFlow> &cutFlows, unsigned stage, F fn,
+                             ECutFlowNode position = ECutFlowNode::kStage)
+{
+   return CutFlowNode<F>(std::move(fn), &cutFlows, stage, position, false /* isFilter */);
+}
+
+/// Sums the cut flows of all threads and prints the result; if results is given, also adds it to the results
+inline void ReportCutFlows(const std::vector<CutFlow> &cutFlows, AnalysisResults *results)
+{
+   if (cutFlows.empty())
+      return;
+   CutFlow sum = cutFlows[0];
+   for (unsigned i = 1; i < cutFlows.size(); ++i)
+      sum.Add(cutFlows[i]);
+   sum.Print();
+   if (results)
+      sum.AddToResults(results);
+}
+
+/// Bytes counter for the cut flow that sums the szReadPayload and szReadOverhead counters of the page source of a
+/// reader or of a page source that is used directly.  The metrics need to be enabled.
+inline std::function<std::uint64_t()>
+GetNTupleBytesCounter(const ROOT::Experimental::Detail::RNTupleMetrics &metrics)
+{
+   std::vector<const ROOT::Experimental::Detail::RNTuplePerfCounter *> counters;
+   for (const std::string prefix : {"RNTupleReader.RPageSourceFile.", "RPageSourceFile."}) {
+      for (const std::string name : {"szReadPayload", "szReadOverhead"}) {
+         if (auto counter = metrics.GetCounter(prefix + name))
+            counters.emplace_back(counter);
+      }
+   }
+   return [counters] {
+      std::uint64_t nBytes = 0;
+      for (auto c : counters)
+         nBytes += c->GetValueAsInt();
+      return nBytes;
+   };
+}
+
+/// Bytes counter for the cut flow of a tree event loop: the bytes read through the given file.  Unlike
+/// TFile::GetFileBytesRead(), which counts the reads of all files of the process, it is specific to the thread if
+/// every thread reads its tree from its own file.
+inline std::function<std::uint64_t()> GetTreeBytesCounter(TFile *file)
+{
+   return [file] { return static_cast<std::uint64_t>(file->GetBytesRead()); };
+}
+
+#endif // CUTFLOW_H_
@@ -0,0 +1,456 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+/*
+  ff_analyze
+
+  Analyzes the read pattern recorded by fuse_forward.  The input is either a fuse_forward log directory (binary
+  trace) or a text log with one "<offset> <bytes read>" line per request, such as the output of bm_iopattern.sh.
+
+  The tool reports the request size and seek distance distributions, the fraction of sequential requests and of
+  re-read bytes, and the estimated time to serve the requests from a hard disk (seek time plus bandwidth) and from
+  a flash drive (IOPS or bandwidth limited per request).  Given the traced data file (-i) and the ntuple or tree
+  name (-n), the reads are mapped back to RNTuple pages and metadata or to TTree baskets, and the bytes read are
+  attributed to clusters and to columns or branches.
+
+  A binary trace is restricted to the reads of the file given with -f or, without -f, of the data file (-i).  The
+  file needs to be the real data file that fuse_forward forwarded to, not the path through the FUSE mount; the tool
+  fails if the trace has no reads of it.
+*/
+
+#include <ROOT/RNTuple.hxx>
+#include <ROOT/RNTupleDescriptor.hxx>
+#include <ROOT/RNTupleReadOptions.hxx>
+#include <ROOT/RPageStorage.hxx>
+
+#include <TBranch.h>
+#include <TFile.h>
+#include <TObjArray.h>
+#include <TTree.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fuse_trace.h"
+#include "util.h"
+
+using RClusterDescriptor = ROOT::Experimental::RClusterDescriptor;
+using RFieldDescriptor = ROOT::Experimental::RFieldDescriptor;
+using RNTuple = ROOT::Experimental::RNTuple;
+using RNTupleDescriptor = ROOT::Experimental::RNTupleDescriptor;
+using RNTupleLocator = ROOT::Experimental::RNTupleLocator;
+using RNTupleReadOptions = ROOT::Experimental::RNTupleReadOptions;
+using RPageSource = ROOT::Experimental::Internal::RPageSource;
+
+using Request = FuseTraceRequest;
+
+/// Device model parameters
+struct DeviceModel {
+   double fHddSeekMs = 8.0;
+   double fHddMBs = 150.0;
+   double fSsdKIops = 100.0;
+   double fSsdMBs = 2000.0;
+};
+
+/// Histogram with power-of-two bins: bin 0 holds the values 0 and 1, bin k > 0 holds [2^k, 2^(k+1))
+class Log2Histogram {
+   std::vector<std::uint64_t> fCounts = std::vector<std::uint64_t>(64, 0);
+   std::uint64_t fN = 0;
+
+   static unsigned GetBin(std::uint64_t value) { return (value < 2) ? 0 : (63 - __builtin_clzll(value)); }
+
+public:
+   void Fill(std::uint64_t value)
+   {
+      fCounts[GetBin(value)]++;
+      fN++;
+   }
+
+   void Print(const char *title) const
+   {
+      printf("%s (%" PRIu64 " entries)\n", title, fN);
+      if (fN == 0)
+         return;
+      unsigned first = 0;
+      unsigned last = 63;
+      while (fCounts[first] == 0)
+         first++;
+      while (fCounts[last] == 0)
+         last--;
+      const std::uint64_t max = *std::max_element(fCounts.begin(), fCounts.end());
+      for (unsigned i = first; i <= last; ++i) {
+         const std::uint64_t lo = (i == 0) ? 0 : (std::uint64_t(1) << i);
+         const int width = (fCounts[i] * 50 + max - 1) / max;
+         printf("   [%12" PRIu64 ", %12" PRIu64 ") %10" PRIu64 " %5.1f%% %.*s\n", lo, std::uint64_t(2) << i, fCounts[i],
+                100.0 * fCounts[i] / fN, width, "##################################################");
+      }
+   }
+};
+
+/// Keeps track of the union of the byte ranges read so far
+class RangeSet {
+   /// Maps the start of disjoint ranges to their end
+   std::map<std::uint64_t, std::uint64_t> fRanges;
+
+public:
+   /// Adds [from, to) and returns the number of bytes that were already in the set
+   std::uint64_t Add(std::uint64_t from, std::uint64_t to)
+   {
+      std::uint64_t overlap = 0;
+      auto itr = fRanges.upper_bound(from);
+      if (itr != fRanges.begin() && std::prev(itr)->second >= from)
+         itr = std::prev(itr);
+      while (itr != fRanges.end() && itr->first <= to) {
+         overlap += std::max<std::int64_t>(0, std::int64_t(std::min(to, itr->second)) -
+                                                 std::int64_t(std::max(from, itr->first)));
+         from = std::min(from, itr->first);
+         to = std::max(to, itr->second);
+         itr = fRanges.erase(itr);
+      }
+      fRanges[from] = to;
+      return overlap;
+   }
+};
+
+/// A byte range of the data file that belongs to a cluster and to a column, branch, or metadata block
+struct Region {
+   std::uint64_t fOffset;
+   std::uint64_t fSize;
+   int fCluster;  ///< Index in entry order, -1 for metadata
+   int fOwner;    ///< Index into Layout::fOwners
+};
+
+struct Layout {
+   std::vector<std::string> fOwners;
+   /// Sorted by offset
+   std::vector<Region> fRegions;
+   std::vector<std::uint64_t> fClusterBytes;
+   std::vector<std::uint64_t> fOwnerBytes;
+
+   int AddOwner(const std::string &name)
+   {
+      fOwners.emplace_back(name);
+      fOwnerBytes.emplace_back(0);
+      return fOwners.size() - 1;
+   }
+
+   void AddRegion(std::uint64_t offset, std::uint64_t size, int cluster, int owner)
+   {
+      if (size == 0)
+         return;
+      fRegions.emplace_back(Region{offset, size, cluster, owner});
+      fOwnerBytes[owner] += size;
+      if (cluster >= 0)
+         fClusterBytes[cluster] += size;
+   }
+};
+
+static void AddNTupleColumns(Layout &layout, std::map<ROOT::Experimental::DescriptorId_t, int> &owners,
+                             const RNTupleDescriptor &desc, const RFieldDescriptor &fieldDesc)
+{
+   for (const auto &f : desc.GetFieldIterable(fieldDesc)) {
+      for (const auto &c : desc.GetColumnIterable(f)) {
+         if (c.IsAliasColumn())
+            continue;
+         owners[c.GetPhysicalId()] =
+            layout.AddOwner(desc.GetQualifiedFieldName(f.GetId()) + "[" + std::to_string(c.GetIndex()) + "]");
+      }
+      AddNTupleColumns(layout, owners, desc, f);
+   }
+}
+
+static Layout GetNTupleLayout(const std::string &path, const std::string &ntupleName)
+{
+   Layout layout;
+   std::unique_ptr<TFile> file(TFile::Open(path.c_str()));
+   if (!file || file->IsZombie()) {
+      fprintf(stderr, "cannot open %s\n", path.c_str());
+      exit(1);
+   }
+   auto anchor = file->Get<RNTuple>(ntupleName.c_str());
+   if (anchor == nullptr) {
+      fprintf(stderr, "no ntuple %s in %s\n", ntupleName.c_str(), path.c_str());
+      exit(1);
+   }
+   layout.AddRegion(anchor->GetSeekHeader(), anchor->GetNBytesHeader(), -1, layout.AddOwner("[header]"));
+   layout.AddRegion(anchor->GetSeekFooter(), anchor->GetNBytesFooter(), -1, layout.AddOwner("[footer]"));
+
+   auto source = RPageSource::Create(ntupleName, path, RNTupleReadOptions());
+   source->Attach();
+   auto desc = source->GetSharedDescriptorGuard();
+
+   const int pageListOwner = layout.AddOwner("[page list]");
+   for (const auto &cg : desc->GetClusterGroupIterable()) {
+      const auto &locator = cg.GetPageListLocator();
+      layout.AddRegion(locator.GetPosition<std::uint64_t>(), locator.fBytesOnStorage, -1, pageListOwner);
+   }
+
+   std::map<ROOT::Experimental::DescriptorId_t, int> owners;
+   AddNTupleColumns(layout, owners, desc.GetRef(), desc->GetFieldDescriptor(desc->GetFieldZeroId()));
+
+   std::vector<const RClusterDescriptor *> clusters;
+   for (const auto &cluster : desc->GetClusterIterable())
+      clusters.emplace_back(&cluster);
+   std::sort(clusters.begin(), clusters.end(), [](const RClusterDescriptor *a, const RClusterDescriptor *b) {
+      return a->GetFirstEntryIndex() < b->GetFirstEntryIndex();
+   });
+   layout.fClusterBytes.resize(clusters.size(), 0);
+   for (unsigned i = 0; i < clusters.size(); ++i) {
+      for (const auto &[physicalId, owner] : owners) {
+         if (!clusters[i]->ContainsColumn(physicalId))
+            continue;
+         for (const auto &pi : clusters[i]->GetPageRange(physicalId).fPageInfos) {
+            if (pi.fLocator.fType != RNTupleLocator::kTypeFile)
+               continue;
+            layout.AddRegion(pi.fLocator.GetPosition<std::uint64_t>(), pi.fLocator.fBytesOnStorage, i, owner);
+         }
+      }
+   }
+   return layout;
+}
+
+static void AddTreeBaskets(Layout &layout, TObjArray *branches, const std::vector<std::uint64_t> &clusterStarts)
+{
+   for (auto obj : *branches) {
+      auto branch = static_cast<TBranch *>(obj);
+      const int nBaskets = branch->GetWriteBasket();
+      if (nBaskets > 0) {
+         const int owner = layout.AddOwner(branch->GetName());
+         for (int i = 0; i < nBaskets; ++i) {
+            if (branch->GetBasketSeek(i) == 0)
+               continue;
+            const std::uint64_t firstEntry = branch->GetBasketEntry()[i];
+            const int cluster =
+               std::upper_bound(clusterStarts.begin(), clusterStarts.end(), firstEntry) - clusterStarts.begin() - 1;
+            layout.AddRegion(branch->GetBasketSeek(i), branch->GetBasketBytes()[i], cluster, owner);
+         }
+      }
+      AddTreeBaskets(layout, branch->GetListOfBranches(), clusterStarts);
+   }
+}
+
+static Layout GetTreeLayout(const std::string &path, const std::string &treeName)
+{
+   Layout layout;
+   std::unique_ptr<TFile> file(TFile::Open(path.c_str()));
+   if (!file || file->IsZombie()) {
+      fprintf(stderr, "cannot open %s\n", path.c_str());
+      exit(1);
+   }
+   auto tree = file->Get<TTree>(treeName.c_str());
+   if (tree == nullptr) {
+      fprintf(stderr, "no tree %s in %s\n", treeName.c_str(), path.c_str());
+      exit(1);
+   }
+   auto clusterStarts = GetClusterStarts(tree);
+   layout.fClusterBytes.resize(clusterStarts.size(), 0);
+   AddTreeBaskets(layout, tree->GetListOfBranches(), clusterStarts);
+   return layout;
+}
+
+static void SortLayout(Layout &layout)
+{
+   std::sort(layout.fRegions.begin(), layout.fRegions.end(),
+             [](const Region &a, const Region &b) { return a.fOffset < b.fOffset; });
+}
+
+static void AnalyzePattern(const std::vector<Request> &requests, const DeviceModel &model)
+{
+   Log2Histogram sizes;
+   Log2Histogram forwardSeeks;
+   Log2Histogram backwardSeeks;
+   RangeSet rangeSet;
+   std::uint64_t nBytes = 0;
+   std::uint64_t nSequential = 0;
+   std::uint64_t nRereadBytes = 0;
+   double hddSecs = 0.0;
+   double ssdSecs = 0.0;
+
+   std::uint64_t prevEnd = 0;
+   for (unsigned i = 0; i < requests.size(); ++i) {
+      const auto &r = requests[i];
+      sizes.Fill(r.fSize);
+      nBytes += r.fSize;
+      nRereadBytes += rangeSet.Add(r.fOffset, r.fOffset + r.fSize);
+
+      bool isSequential = (i > 0) && (r.fOffset == prevEnd);
+      if (isSequential) {
+         nSequential++;
+      } else if (i > 0) {
+         if (r.fOffset > prevEnd)
+            forwardSeeks.Fill(r.fOffset - prevEnd);
+         else
+            backwardSeeks.Fill(prevEnd - r.fOffset);
+      }
+      prevEnd = r.fOffset + r.fSize;
+
+      // The first request needs a seek, too
+      if (!isSequential)
+         hddSecs += model.fHddSeekMs / 1000.0;
+      hddSecs += r.fSize / (model.fHddMBs * 1000 * 1000);
+      ssdSecs += std::max(1.0 / (model.fSsdKIops * 1000), r.fSize / (model.fSsdMBs * 1000 * 1000));
+   }
+
+   printf("IoPattern-Requests: %zu\n", requests.size());
+   printf("IoPattern-Bytes: %" PRIu64 "\n", nBytes);
+   printf("IoPattern-AvgRequestSize: %.0f\n", requests.empty() ? 0.0 : double(nBytes) / requests.size());
+   printf("IoPattern-Sequential: %.3f\n", (requests.size() < 2) ? 0.0 : double(nSequential) / (requests.size() - 1));
+   printf("IoPattern-Reread: %.3f\n", (nBytes == 0) ? 0.0 : double(nRereadBytes) / nBytes);
+   printf("IoPattern-HddSeconds: %.3f  (%.1f ms seek, %.0f MB/s)\n", hddSecs, model.fHddSeekMs, model.fHddMBs);
+   printf("IoPattern-SsdSeconds: %.3f  (%.0fk IOPS, %.0f MB/s)\n", ssdSecs, model.fSsdKIops, model.fSsdMBs);
+   printf("\n");
+   sizes.Print("Request size [B]");
+   forwardSeeks.Print("Forward seek distance [B]");
+   backwardSeeks.Print("Backward seek distance [B]");
+}
+
+static void AnalyzeLayout(const std::vector<Request> &requests, const Layout &layout, unsigned nTop,
+                          bool perCluster)
+{
+   const auto nClusters = layout.fClusterBytes.size();
+   std::vector<std::uint64_t> clusterRead(nClusters, 0);
+   std::vector<std::uint64_t> clusterRequests(nClusters, 0);
+   std::vector<std::uint64_t> ownerRead(layout.fOwners.size(), 0);
+   std::uint64_t nBytes = 0;
+   std::uint64_t nData = 0;
+   std::uint64_t nMeta = 0;
+
+   for (const auto &r : requests) {
+      nBytes += r.fSize;
+      const std::uint64_t end = r.fOffset + r.fSize;
+      auto itr = std::upper_bound(layout.fRegions.begin(), layout.fRegions.end(), r.fOffset,
+                                  [](std::uint64_t offset, const Region &region) { return offset < region.fOffset; });
+      if (itr != layout.fRegions.begin())
+         --itr;
+      int lastCluster = -1;
+      for (; itr != layout.fRegions.end() && itr->fOffset < end; ++itr) {
+         const std::uint64_t from = std::max(r.fOffset, itr->fOffset);
+         const std::uint64_t to = std::min(end, itr->fOffset + itr->fSize);
+         if (from >= to)
+            continue;
+         ownerRead[itr->fOwner] += to - from;
+         if (itr->fCluster < 0) {
+            nMeta += to - from;
+            continue;
+         }
+         nData += to - from;
+         clusterRead[itr->fCluster] += to - from;
+         if (itr->fCluster != lastCluster)
+            clusterRequests[itr->fCluster]++;
+         lastCluster = itr->fCluster;
+      }
+   }
+
+   unsigned nTouched = 0;
+   for (auto n : clusterRead)
+      nTouched += (n > 0);
+   printf("\n");
+   printf("Layout-Data: %.3f\n", (nBytes == 0) ? 0.0 : double(nData) / nBytes);
+   printf("Layout-Metadata: %.3f\n", (nBytes == 0) ? 0.0 : double(nMeta) / nBytes);
+   printf("Layout-Unmapped: %.3f\n", (nBytes == 0) ? 0.0 : double(nBytes - nData - nMeta) / nBytes);
+   printf("Layout-ClustersTouched: %u / %zu\n", nTouched, nClusters);
+
+   if (perCluster) {
+      printf("\n%8s %10s %14s %8s\n", "cluster", "requests", "bytes read", "fraction");
+      for (unsigned i = 0; i < nClusters; ++i) {
+         printf("%8u %10" PRIu64 " %14" PRIu64 " %8.3f\n", i, clusterRequests[i], clusterRead[i],
+                (layout.fClusterBytes[i] == 0) ? 0.0 : double(clusterRead[i]) / layout.fClusterBytes[i]);
+      }
+   }
+
+   std::vector<unsigned> order(layout.fOwners.size());
+   for (unsigned i = 0; i < order.size(); ++i)
+      order[i] = i;
+   std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) { return ownerRead[a] > ownerRead[b]; });
+   printf("\n%14s %8s  %s\n", "bytes read", "fraction", "column / branch");
+   for (unsigned i = 0; i < std::min<std::size_t>(nTop, order.size()); ++i) {
+      const auto o = order[i];
+      if (ownerRead[o] == 0)
+         break;
+      printf("%14" PRIu64 " %8.3f  %s\n", ownerRead[o],
+             (layout.fOwnerBytes[o] == 0) ? 0.0 : double(ownerRead[o]) / layout.fOwnerBytes[o],
+             layout.fOwners[o].c_str());
+   }
+}
+
+static void Usage(const char *progname)
+{
+   printf("%s [-f <real path of the traced file>] [-i <data file> -n <ntuple/tree name>] [-c(lusters)]\n"
+          "   [-t <top columns/branches>] [-S <HDD seek ms>] [-B <HDD MB/s>] [-I <SSD kIOPS>] [-b <SSD MB/s>]\n"
+          "   <log directory | offset-size text log>\n",
+          progname);
+}
+
+int main(int argc, char **argv)
+{
+   std::string filterPath;
+   std::string dataPath;
+   std::string name;
+   unsigned nTop = 20;
+   bool perCluster = false;
+   DeviceModel model;
+   int c;
+   while ((c = getopt(argc, argv, "hvf:i:n:ct:S:B:I:b:")) != -1) {
+      switch (c) {
+      case 'h':
+      case 'v':
+         Usage(argv[0]);
+         return 0;
+      case 'f': filterPath = optarg; break;
+      case 'i': dataPath = optarg; break;
+      case 'n': name = optarg; break;
+      case 'c': perCluster = true; break;
+      case 't': nTop = atoi(optarg); break;
+      case 'S': model.fHddSeekMs = atof(optarg); break;
+      case 'B': model.fHddMBs = atof(optarg); break;
+      case 'I': model.fSsdKIops = atof(optarg); break;
+      case 'b': model.fSsdMBs = atof(optarg); break;
+      default:
+         fprintf(stderr, "Unknown option: -%c\n", c);
+         Usage(argv[0]);
+         return 1;
+      }
+   }
+   if ((optind != argc - 1) || (dataPath.empty() != name.empty())) {
+      Usage(argv[0]);
+      return 1;
+   }
+   std::string logPath = argv[optind];
+
+   // Without -f, restrict a trace to the data file if it is given
+   if (filterPath.empty() && !dataPath.empty()) {
+      char realPath[PATH_MAX];
+      if (realpath(dataPath.c_str(), realPath) != nullptr)
+         filterPath = realPath;
+   }
+   std::vector<Request> requests;
+   std::uint64_t nDropped;
+   if (!ReadFuseRequests(logPath, filterPath, &requests, &nDropped))
+      return 1;
+   if (nDropped > 0)
+      fprintf(stderr, "Warning: %" PRIu64 " trace records were dropped, the analysis is incomplete\n", nDropped);
+
+   AnalyzePattern(requests, model);
+
+   if (!dataPath.empty()) {
+      auto format = GetFileFormat(GetSuffix(dataPath));
+      Layout layout =
+         (format == FileFormats::kNtuple) ? GetNTupleLayout(dataPath, name) : GetTreeLayout(dataPath, name);
+      SortLayout(layout);
+      AnalyzeLayout(requests, layout, nTop, perCluster);
+   }
+   return 0;
+}
@@ -0,0 +1,69 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+// Decodes the binary read trace written by fuse_forward.  By default, prints
+// one "<offset> <bytes read>" line per read in the order in which the reads
+// were issued, which is the format of the former per-file text logs.
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "fuse_trace.h"
+
+using namespace std;
+
+static void Usage(const char *progname) {
+  printf("%s [-f <real path of the traced file>] [-a(ll fields)] <log directory>\n", progname);
+}
+
+int main(int argc, char **argv) {
+  string filter_path;
+  bool all_fields = false;
+  int c;
+  while ((c = getopt(argc, argv, "hvf:a")) != -1) {
+    switch (c) {
+      case 'h':
+      case 'v':
+        Usage(argv[0]);
+        return 0;
+      case 'f':
+        filter_path = optarg;
+        break;
+      case 'a':
+        all_fields = true;
+        break;
+      default:
+        fprintf(stderr, "Unknown option: -%c\n", c);
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    Usage(argv[0]);
+    return 1;
+  }
+  string log_dir = argv[optind];
+
+  vector<FuseTraceRecord> records;
+  uint64_t n_dropped;
+  if (!ReadFuseTrace(log_dir, filter_path, &records, &n_dropped))
+    return 1;
+
+  if (all_fields)
+    printf("# timestamp_ns latency_ns file_id thread_id offset size result\n");
+  for (const auto &r : records) {
+    if (all_fields) {
+      printf("%" PRIu64 " %" PRIu64 " %u %u %" PRId64 " %u %d\n", r.fTimestampNs, r.fLatencyNs,
+             r.fFileId, r.fThreadId, r.fOffset, r.fSize, r.fResult);
+    } else if (r.fResult >= 0) {
+      printf("%" PRId64 " %d\n", r.fOffset, r.fResult);
+    }
+  }
+
+  fprintf(stderr, "%zu reads decoded, %" PRIu64 " trace records dropped\n", records.size(), n_dropped);
+  return 0;
+}
@@ -0,0 +1,302 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+// Replays a read sequence recorded by fuse_forward against a local file with
+// alternative read strategies.  For every strategy, reports the number of
+// read requests and round trips, the bytes read and over-read, the replay wall
+// time, and the estimated time on a remote storage with the given latency and
+// bandwidth.  A negative over-read means that re-reads in the recorded sequence
+// are served by the coalesced or read-ahead data.  The strategies are
+//   - as-is: the recorded requests
+//   - gap:<bytes>: merges a request into the previous one if it starts at most
+//     <bytes> after its end (gap-tolerant coalescing of a stream of reads)
+//   - vec:<n>[:<bytes>]: vector reads of batches of n requests; within a batch,
+//     the ranges are sorted and coalesced with the given maximum gap
+//     (default 0).  A batch costs one round trip.
+//   - ra:<bytes>: read-ahead window; a request that is not fully in the window
+//     reads <bytes> (at least the request) starting at its offset
+// Unless -w is given, the data file is evicted from the page cache before
+// every strategy, so that no strategy is served from the pages cached by the
+// previous ones.
+// A binary trace is restricted to the reads of the file given with -f or,
+// without -f, of the data file.  This is the real data file that fuse_forward
+// forwarded to, not the path through the FUSE mount; the tool fails if the
+// trace has no reads of it.
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "fuse_trace.h"
+
+using namespace std;
+
+using Request = FuseTraceRequest;
+
+enum class Strategies { kAsIs, kGap, kVector, kReadAhead };
+
+struct Strategy {
+  string name;
+  Strategies type;
+  uint64_t gap;
+  unsigned batch;
+  uint64_t window;
+};
+
+struct ReplayResult {
+  uint64_t n_requests = 0;
+  uint64_t n_roundtrips = 0;
+  uint64_t n_bytes = 0;
+  double wall_secs = 0.0;
+};
+
+static double GetMonotonicSecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool ParseStrategy(const string &spec, Strategy *s) {
+  s->name = spec;
+  s->gap = 0;
+  s->batch = 1;
+  s->window = 0;
+  if (spec == "as-is") {
+    s->type = Strategies::kAsIs;
+    return true;
+  }
+  size_t colon = spec.find(':');
+  if (colon == string::npos)
+    return false;
+  string kind = spec.substr(0, colon);
+  const char *arg = spec.c_str() + colon + 1;
+  char *end;
+  if (kind == "gap") {
+    s->type = Strategies::kGap;
+    s->gap = strtoull(arg, &end, 10);
+  } else if (kind == "vec") {
+    s->type = Strategies::kVector;
+    s->batch = strtoul(arg, &end, 10);
+    if (*end == ':')
+      s->gap = strtoull(end + 1, &end, 10);
+    if (s->batch == 0)
+      return false;
+  } else if (kind == "ra") {
+    s->type = Strategies::kReadAhead;
+    s->window = strtoull(arg, &end, 10);
+  } else {
+    return false;
+  }
+  return *end == '\0';
+}
+
+// Sorts and merges ranges that overlap or are at most max_gap bytes apart
+static vector<Request> Coalesce(vector<Request> ranges, uint64_t max_gap) {
+  sort(ranges.begin(), ranges.end(),
+    [](const Request &a, const Request &b) { return a.fOffset < b.fOffset; });
+  vector<Request> result;
+  for (const auto &r : ranges) {
+    if (!result.empty() &&
+        (r.fOffset <= result.back().fOffset + result.back().fSize + max_gap))
+    {
+      uint64_t end = max(result.back().fOffset + result.back().fSize, r.fOffset + r.fSize);
+      result.back().fSize = end - result.back().fOffset;
+    } else {
+      result.push_back(r);
+    }
+  }
+  return result;
+}
+
+// Transforms the recorded requests into batches of reads; every batch is one
+// round trip
+static vector<vector<Request>> Plan(const vector<Request> &requests, const Strategy &s) {
+  vector<vector<Request>> batches;
+  switch (s.type) {
+    case Strategies::kAsIs:
+      for (const auto &r : requests)
+        batches.push_back({r});
+      break;
+    case Strategies::kGap:
+      for (const auto &r : requests) {
+        if (!batches.empty()) {
+          Request &prev = batches.back()[0];
+          uint64_t prev_end = prev.fOffset + prev.fSize;
+          if ((r.fOffset >= prev_end) && (r.fOffset <= prev_end + s.gap)) {
+            prev.fSize = r.fOffset + r.fSize - prev.fOffset;
+            continue;
+          }
+        }
+        batches.push_back({r});
+      }
+      break;
+    case Strategies::kVector:
+      for (size_t i = 0; i < requests.size(); i += s.batch) {
+        vector<Request> batch(requests.begin() + i,
+                              requests.begin() + min(requests.size(), i + s.batch));
+        batches.push_back(Coalesce(batch, s.gap));
+      }
+      break;
+    case Strategies::kReadAhead: {
+      uint64_t win_begin = 0;
+      uint64_t win_end = 0;
+      for (const auto &r : requests) {
+        if ((r.fOffset >= win_begin) && (r.fOffset + r.fSize <= win_end))
+          continue;
+        win_begin = r.fOffset;
+        win_end = r.fOffset + max(r.fSize, s.window);
+        batches.push_back({Request{win_begin, win_end - win_begin}});
+      }
+      break;
+    }
+  }
+  return batches;
+}
+
+static ReplayResult Replay(int fd, const vector<vector<Request>> &batches, bool evict) {
+  ReplayResult result;
+  uint64_t max_size = 0;
+  for (const auto &batch : batches) {
+    for (const auto &r : batch)
+      max_size = max(max_size, r.fSize);
+  }
+  vector<char> buf(max_size);
+
+  if (evict) {
+    // As in page_cache: dirty pages are not evicted by POSIX_FADV_DONTNEED
+    fdatasync(fd);
+    int err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    if (err != 0) {
+      fprintf(stderr, "cannot evict the data file (%s)\n", strerror(err));
+      exit(1);
+    }
+  }
+  double start = GetMonotonicSecs();
+  for (const auto &batch : batches) {
+    result.n_roundtrips++;
+    for (const auto &r : batch) {
+      result.n_requests++;
+      ssize_t nbytes = pread(fd, buf.data(), r.fSize, r.fOffset);
+      if (nbytes < 0) {
+        perror("pread");
+        exit(1);
+      }
+      result.n_bytes += nbytes;
+    }
+  }
+  result.wall_secs = GetMonotonicSecs() - start;
+  return result;
+}
+
+static void Usage(const char *progname) {
+  printf("%s [-f <real path of the traced file>] [-s <strategy>[,<strategy>...]] [-w(arm page cache)]\n"
+         "  [-L <latency ms>] [-B <bandwidth MB/s>] <log directory | offset-size text log> <data file>\n"
+         "strategies: as-is, gap:<bytes>, vec:<n>[:<max gap bytes>], ra:<bytes>\n", progname);
+}
+
+int main(int argc, char **argv) {
+  string filter_path;
+  string strategy_list = "as-is,gap:4096,gap:65536,gap:1048576,"
+                         "vec:16,vec:64:65536,vec:256:65536,ra:131072,ra:1048576,ra:4194304";
+  bool evict = true;
+  double latency_ms = 10.0;
+  double bandwidth_mbs = 100.0;
+  int c;
+  while ((c = getopt(argc, argv, "hvf:s:wL:B:")) != -1) {
+    switch (c) {
+      case 'h':
+      case 'v':
+        Usage(argv[0]);
+        return 0;
+      case 'f':
+        filter_path = optarg;
+        break;
+      case 's':
+        strategy_list = optarg;
+        break;
+      case 'w':
+        evict = false;
+        break;
+      case 'L':
+        latency_ms = atof(optarg);
+        break;
+      case 'B':
+        bandwidth_mbs = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, "Unknown option: -%c\n", c);
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 2) {
+    Usage(argv[0]);
+    return 1;
+  }
+  string log_path = argv[optind];
+  string data_path = argv[optind + 1];
+
+  vector<Strategy> strategies;
+  size_t pos = 0;
+  while (pos <= strategy_list.length()) {
+    size_t comma = strategy_list.find(',', pos);
+    if (comma == string::npos)
+      comma = strategy_list.length();
+    Strategy s;
+    if (!ParseStrategy(strategy_list.substr(pos, comma - pos), &s)) {
+      fprintf(stderr, "invalid strategy: %s\n", strategy_list.substr(pos, comma - pos).c_str());
+      return 1;
+    }
+    strategies.push_back(s);
+    pos = comma + 1;
+  }
+
+  // Without -f, the trace is restricted to the data file
+  if (filter_path.empty()) {
+    char *real_path = realpath(data_path.c_str(), NULL);
+    if (real_path != NULL) {
+      filter_path = real_path;
+      free(real_path);
+    }
+  }
+  vector<Request> requests;
+  uint64_t n_dropped;
+  if (!ReadFuseRequests(log_path, filter_path, &requests, &n_dropped))
+    return 1;
+  if (n_dropped > 0)
+    fprintf(stderr, "Warning: %" PRIu64 " trace records were dropped\n", n_dropped);
+  uint64_t n_useful = 0;
+  for (const auto &r : requests)
+    n_useful += r.fSize;
+
+  int fd = open(data_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "cannot open %s\n", data_path.c_str());
+    return 1;
+  }
+
+  printf("# %zu recorded requests, %" PRIu64 " bytes; remote model: %.1f ms latency, %.1f MB/s\n",
+         requests.size(), n_useful, latency_ms, bandwidth_mbs);
+  printf("%-20s %10s %10s %14s %10s %10s %10s\n", "strategy", "requests", "roundtrips",
+         "bytes read", "over-read", "replay[s]", "remote[s]");
+  for (const auto &s : strategies) {
+    ReplayResult r = Replay(fd, Plan(requests, s), evict);
+    double over_read = (n_useful == 0) ? 0.0 : (double(r.n_bytes) - n_useful) / n_useful;
+    double remote_secs = r.n_roundtrips * latency_ms / 1000.0 +
+                         r.n_bytes / (bandwidth_mbs * 1000 * 1000);
+    printf("%-20s %10" PRIu64 " %10" PRIu64 " %14" PRIu64 " %10.3f %10.3f %10.3f\n", s.name.c_str(), r.n_requests,
+           r.n_roundtrips, r.n_bytes, over_read, r.wall_secs, remote_secs);
+  }
+  close(fd);
+  return 0;
+}
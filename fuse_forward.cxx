@@ -10,29 +10,192 @@
 #include <fcntl.h>
 #include <fuse.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <map>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include "fuse_trace.h"
 
 using namespace std;
 
+// The FUSE file handle of an open file
+struct FileHandle {
+  int fd;
+  uint32_t file_id;
+};
+
 string *g_phys_path;
 string *g_log_path;
-map<int, int> *g_fd2log;
+
+// Index of the traced files, written on open()
+FILE *g_trace_index = NULL;
+mutex *g_trace_index_lock;
+atomic<uint32_t> g_next_file_id{0};
+
+// One trace ring per FUSE worker thread; the list only changes when a thread
+// issues its first read
+vector<FuseTraceRing *> *g_trace_rings;
+mutex *g_trace_rings_lock;
+thread_local FuseTraceRing *t_trace_ring = NULL;
+thread_local uint32_t t_thread_id = 0;
+
+int g_trace_fd = -1;
+thread *g_drain_thread = NULL;
+atomic<bool> g_drain_stop{false};
+
+// Remote storage emulation, configured by FF_LATENCY_MS, FF_JITTER, and
+// FF_BANDWIDTH_MBS.  Every read request is delayed by the latency plus a
+// jitter sample.  The bandwidth cap models a single link shared by all
+// requests: the transfers are serialized on the link, the latencies overlap.
+enum class JitterDistributions { kNone, kUniform, kNormal, kExponential };
+
+bool g_emulate = false;
+uint64_t g_latency_ns = 0;
+JitterDistributions g_jitter_dist = JitterDistributions::kNone;
+uint64_t g_jitter_ns = 0;
+double g_bandwidth_bps = 0.0;  // bytes per second, 0 for unlimited
+mutex *g_link_lock;
+uint64_t g_link_free_ns = 0;
+thread_local mt19937_64 *t_rng = NULL;
 
 static string GetRealPath(const char *path) {
   return (*g_phys_path) + string(path);
 }
 
-static string GetLogPath(const string &real_path) {
-  string chiffre_path(real_path);
-  std::replace(chiffre_path.begin(), chiffre_path.end(), '/', '-');
-  return *g_log_path + string("/") + chiffre_path;
+static uint64_t GetMonotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static bool ParseJitter(const string &spec) {
+  size_t colon = spec.find(':');
+  if (colon == string::npos)
+    return false;
+  string dist = spec.substr(0, colon);
+  if (dist == "uniform")
+    g_jitter_dist = JitterDistributions::kUniform;
+  else if (dist == "normal")
+    g_jitter_dist = JitterDistributions::kNormal;
+  else if (dist == "exp")
+    g_jitter_dist = JitterDistributions::kExponential;
+  else
+    return false;
+  g_jitter_ns = atof(spec.c_str() + colon + 1) * 1000000;
+  return true;
+}
+
+// Random extra delay of a request; the parameter is the width of the uniform
+// distribution, the standard deviation of the (truncated) normal
+// distribution, or the mean of the exponential distribution
+static uint64_t GetJitterNs() {
+  if (g_jitter_dist == JitterDistributions::kNone || g_jitter_ns == 0)
+    return 0;
+  if (t_rng == NULL)
+    t_rng = new mt19937_64(syscall(SYS_gettid));
+  double jitter = 0.0;
+  switch (g_jitter_dist) {
+    case JitterDistributions::kUniform:
+      jitter = uniform_real_distribution<double>(0.0, g_jitter_ns)(*t_rng);
+      break;
+    case JitterDistributions::kNormal:
+      jitter = normal_distribution<double>(0.0, g_jitter_ns)(*t_rng);
+      break;
+    case JitterDistributions::kExponential:
+      jitter = exponential_distribution<double>(1.0 / g_jitter_ns)(*t_rng);
+      break;
+    default:
+      break;
+  }
+  // A negative sample shortens the latency but cannot make the request
+  // complete before it was issued
+  if (jitter < -static_cast<double>(g_latency_ns))
+    jitter = -static_cast<double>(g_latency_ns);
+  return g_latency_ns + jitter;
+}
+
+// Reserves the shared link for the transfer of nbytes; returns the time at
+// which the transfer is complete
+static uint64_t ReserveLink(uint64_t now, size_t nbytes) {
+  if (g_bandwidth_bps == 0.0)
+    return now;
+  uint64_t transfer_ns = nbytes / g_bandwidth_bps * 1000000000;
+  lock_guard<mutex> guard(*g_link_lock);
+  g_link_free_ns = max(g_link_free_ns, now) + transfer_ns;
+  return g_link_free_ns;
+}
+
+// Delays the reply to a read request issued at issue_ns that returned nbytes
+// such that it arrives no earlier than it would from the emulated remote
+// storage.  The time of the local read counts towards the delay.
+static void EmulateRemote(uint64_t issue_ns, size_t nbytes) {
+  uint64_t latency_ns = GetJitterNs();
+  uint64_t deadline_ns = ReserveLink(issue_ns, nbytes) + latency_ns;
+  struct timespec ts;
+  ts.tv_sec = deadline_ns / 1000000000;
+  ts.tv_nsec = deadline_ns % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
+}
+
+static FuseTraceRing *GetTraceRing() {
+  if (t_trace_ring == NULL) {
+    t_trace_ring = new FuseTraceRing();
+    t_thread_id = syscall(SYS_gettid);
+    lock_guard<mutex> guard(*g_trace_rings_lock);
+    g_trace_rings->push_back(t_trace_ring);
+  }
+  return t_trace_ring;
+}
+
+// Moves the records of all rings to the trace file; returns the number of
+// records written
+static size_t DrainTraceRings() {
+  static FuseTraceRecord buf[4096];
+  vector<FuseTraceRing *> rings;
+  {
+    lock_guard<mutex> guard(*g_trace_rings_lock);
+    rings = *g_trace_rings;
+  }
+  size_t n_total = 0;
+  for (auto ring : rings) {
+    size_t n;
+    while ((n = ring->Pop(buf, sizeof(buf) / sizeof(buf[0]))) > 0) {
+      size_t nbytes = n * sizeof(FuseTraceRecord);
+      const char *pos = reinterpret_cast<const char *>(buf);
+      while (nbytes > 0) {
+        ssize_t written = write(g_trace_fd, pos, nbytes);
+        if (written < 0) {
+          if (errno == EINTR)
+            continue;
+          return n_total;
+        }
+        pos += written;
+        nbytes -= written;
+      }
+      n_total += n;
+    }
+  }
+  return n_total;
+}
+
+static void DrainMain() {
+  while (!g_drain_stop.load()) {
+    if (DrainTraceRings() == 0)
+      this_thread::sleep_for(chrono::milliseconds(10));
+  }
+  DrainTraceRings();
 }
 
 static int MkFuseRetval(int retval) {
@@ -53,11 +216,15 @@ static int ff_open(const char *path, struct fuse_file_info *fi) {
   string real_path = GetRealPath(path);
   int fd = open(real_path.c_str(), fi->flags);
   if (fd >= 0) {
-    fi->fh = fd;
-    int fd_log = open(GetLogPath(real_path).c_str(),
-       O_CREAT | O_APPEND | O_WRONLY, 0644);
-    assert(fd_log >= 0);
-    (*g_fd2log)[fd] = fd_log;
+    FileHandle *handle = new FileHandle{fd, g_next_file_id++};
+    fi->fh = reinterpret_cast<uintptr_t>(handle);
+    // Otherwise the page cache serves repeated reads without delay and
+    // readahead splits the reads into unrealistically small requests
+    if (g_emulate)
+      fi->direct_io = 1;
+    lock_guard<mutex> guard(*g_trace_index_lock);
+    fprintf(g_trace_index, "%u %s\n", handle->file_id, real_path.c_str());
+    fflush(g_trace_index);
   }
   return MkFuseRetval(fd);
 }
@@ -70,22 +237,54 @@ static int ff_read(
   off_t offset,
   struct fuse_file_info *fi)
 {
-  int nbytes = pread(fi->fh, buf, size, offset);
+  FileHandle *handle = reinterpret_cast<FileHandle *>(fi->fh);
+  FuseTraceRing *ring = GetTraceRing();
+  FuseTraceRecord record;
+  record.fTimestampNs = GetMonotonicNs();
+  int nbytes = pread(handle->fd, buf, size, offset);
+  if (g_emulate)
+    EmulateRemote(record.fTimestampNs, (nbytes > 0) ? nbytes : 0);
+  record.fLatencyNs = GetMonotonicNs() - record.fTimestampNs;
+  record.fOffset = offset;
+  record.fSize = size;
+  record.fResult = (nbytes < 0) ? -errno : nbytes;
+  record.fFileId = handle->file_id;
+  record.fThreadId = t_thread_id;
+  ring->Push(record);
   if (nbytes < 0)
-    return -errno;
-  dprintf((*g_fd2log)[fi->fh], "%ld %d\n", offset, nbytes);
+    return record.fResult;
   return nbytes;
 }
 
 
 static int ff_release(const char *path, struct fuse_file_info *fi) {
-  int retval = close(fi->fh);
-  close((*g_fd2log)[fi->fh]);
-  g_fd2log->erase(fi->fh);
+  FileHandle *handle = reinterpret_cast<FileHandle *>(fi->fh);
+  int retval = close(handle->fd);
+  delete handle;
   return MkFuseRetval(retval);
 }
 
 
+// Called in the daemonized FUSE process, so the drain thread is started here
+// rather than in main()
+static void *ff_init(struct fuse_conn_info *conn) {
+  g_drain_thread = new thread(DrainMain);
+  return NULL;
+}
+
+
+static void ff_destroy(void *private_data) {
+  g_drain_stop.store(true);
+  g_drain_thread->join();
+  uint64_t n_dropped = 0;
+  for (auto ring : *g_trace_rings)
+    n_dropped += ring->GetNDropped();
+  fprintf(g_trace_index, "# dropped %" PRIu64 "\n", n_dropped);
+  fclose(g_trace_index);
+  close(g_trace_fd);
+}
+
+
 static int ff_opendir(const char *path, struct fuse_file_info *fi) {
   string real_path = GetRealPath(path);
   DIR *dirp = opendir(real_path.c_str());
@@ -138,7 +337,53 @@ int main(int argc, char **argv) {
     printf("FF_LOG_PATH must be absolute\n");
     return 1;
   }
-  g_fd2log = new map<int, int>();
+  if (getenv("FF_LATENCY_MS") != NULL) {
+    g_latency_ns = atof(getenv("FF_LATENCY_MS")) * 1000000;
+    g_emulate = true;
+  }
+  if (getenv("FF_JITTER") != NULL) {
+    if (!ParseJitter(getenv("FF_JITTER"))) {
+      printf("FF_JITTER must be uniform:<ms>, normal:<ms>, or exp:<ms>\n");
+      return 1;
+    }
+    g_emulate = true;
+  }
+  if (getenv("FF_BANDWIDTH_MBS") != NULL) {
+    g_bandwidth_bps = atof(getenv("FF_BANDWIDTH_MBS")) * 1000 * 1000;
+    g_emulate = true;
+  }
+  g_link_lock = new mutex();
+  if (g_emulate) {
+    printf("Emulating remote storage: %.1f ms latency, %.1f ms jitter, %.1f MB/s\n",
+           g_latency_ns / 1000000.0, g_jitter_ns / 1000000.0,
+           g_bandwidth_bps / (1000 * 1000));
+  }
+
+  g_trace_index_lock = new mutex();
+  g_trace_rings = new vector<FuseTraceRing *>();
+  g_trace_rings_lock = new mutex();
+
+  string trace_path = *g_log_path + "/" FUSE_TRACE_FILE;
+  g_trace_fd = open(trace_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (g_trace_fd < 0) {
+    printf("cannot create %s\n", trace_path.c_str());
+    return 1;
+  }
+  FuseTraceHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.fMagic, kFuseTraceMagic, sizeof(header.fMagic));
+  header.fVersion = kFuseTraceVersion;
+  header.fRecordSize = sizeof(FuseTraceRecord);
+  if (write(g_trace_fd, &header, sizeof(header)) != sizeof(header)) {
+    printf("cannot write %s\n", trace_path.c_str());
+    return 1;
+  }
+  string index_path = *g_log_path + "/" FUSE_TRACE_INDEX;
+  g_trace_index = fopen(index_path.c_str(), "w");
+  if (g_trace_index == NULL) {
+    printf("cannot create %s\n", index_path.c_str());
+    return 1;
+  }
 
   struct fuse_operations ff_operations;
   memset(&ff_operations, 0, sizeof(ff_operations));
@@ -149,6 +394,8 @@ int main(int argc, char **argv) {
   ff_operations.opendir = ff_opendir;
   ff_operations.readdir = ff_readdir;
   ff_operations.releasedir = ff_releasedir;
+  ff_operations.init = ff_init;
+  ff_operations.destroy = ff_destroy;
 
   int retval = fuse_main(argc, argv, &ff_operations, NULL);
   return retval;
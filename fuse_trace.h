@@ -0,0 +1,217 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+#ifndef FUSE_TRACE_H_
+#define FUSE_TRACE_H_
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Binary read trace written by fuse_forward and decoded by ff_decode.  The
+// log directory contains the trace file and a text index of the traced files,
+// one "<file id> <real path>" line per open().
+#define FUSE_TRACE_FILE "trace"
+#define FUSE_TRACE_INDEX "files"
+
+struct FuseTraceHeader {
+  char fMagic[8];  ///< "FFTRACE" with a terminating null byte
+  uint32_t fVersion;
+  uint32_t fRecordSize;
+};
+
+struct FuseTraceRecord {
+  uint64_t fTimestampNs;  ///< CLOCK_MONOTONIC when the read was issued
+  uint64_t fLatencyNs;
+  int64_t fOffset;
+  uint32_t fSize;  ///< Requested number of bytes
+  int32_t fResult;  ///< Number of bytes read or -errno
+  uint32_t fFileId;
+  uint32_t fThreadId;
+};
+static_assert(sizeof(FuseTraceRecord) == 40, "unexpected trace record layout");
+
+static const char kFuseTraceMagic[8] = "FFTRACE";
+static const uint32_t kFuseTraceVersion = 1;
+
+/**
+ * Single-producer, single-consumer ring of trace records.  Every FUSE worker
+ * thread owns one ring and pushes without locks; the drain thread pops.  If
+ * the ring is full, the record is dropped and counted rather than stalling
+ * the read that is being measured.
+ */
+class FuseTraceRing {
+  static const uint64_t kCapacity = 1 << 16;
+
+  FuseTraceRecord fRecords[kCapacity];
+  /// Next slot to write, advanced by the producer
+  std::atomic<uint64_t> fHead{0};
+  /// Next slot to read, advanced by the consumer
+  std::atomic<uint64_t> fTail{0};
+  std::atomic<uint64_t> fNDropped{0};
+
+public:
+  bool Push(const FuseTraceRecord &record) {
+    const uint64_t head = fHead.load(std::memory_order_relaxed);
+    if (head - fTail.load(std::memory_order_acquire) == kCapacity) {
+      fNDropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    fRecords[head % kCapacity] = record;
+    fHead.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Copies up to max_records records into buf; returns the number of records copied
+  size_t Pop(FuseTraceRecord *buf, size_t max_records) {
+    const uint64_t tail = fTail.load(std::memory_order_relaxed);
+    const uint64_t head = fHead.load(std::memory_order_acquire);
+    const size_t n = std::min<uint64_t>(head - tail, max_records);
+    for (size_t i = 0; i < n; ++i)
+      buf[i] = fRecords[(tail + i) % kCapacity];
+    fTail.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+  uint64_t GetNDropped() const { return fNDropped.load(std::memory_order_relaxed); }
+};
+
+/**
+ * Reads the trace records of the log directory log_dir, in the order in which
+ * the reads were issued.  If filter_path is not empty, only the reads from
+ * that file are returned.  The filter is the real path of the data file
+ * behind the FUSE mount, as listed in the index, not the path through the
+ * mount point.  If no traced file matches the filter, or on other failures,
+ * prints the reason to stderr and returns false.
+ */
+static inline bool ReadFuseTrace(
+  const std::string &log_dir,
+  const std::string &filter_path,
+  std::vector<FuseTraceRecord> *records,
+  uint64_t *n_dropped)
+{
+  // A file that is opened multiple times has multiple file ids
+  std::set<uint32_t> file_ids;
+  std::set<std::string> traced_paths;
+  *n_dropped = 0;
+  std::ifstream index((log_dir + "/" FUSE_TRACE_INDEX).c_str());
+  std::string line;
+  while (std::getline(index, line)) {
+    if (line.compare(0, 10, "# dropped ") == 0) {
+      if (sscanf(line.c_str() + 10, "%" SCNu64, n_dropped) != 1)
+        *n_dropped = 0;
+      continue;
+    }
+    std::istringstream iss(line);
+    uint32_t id;
+    std::string path;
+    if (!(iss >> id) || !std::getline(iss >> std::ws, path))
+      continue;
+    if (filter_path.empty() || path == filter_path)
+      file_ids.insert(id);
+    traced_paths.insert(path);
+  }
+  if (!filter_path.empty() && file_ids.empty()) {
+    fprintf(stderr, "%s is not in the trace, expected the real path of the data file; the traced files are:\n",
+            filter_path.c_str());
+    for (const auto &p : traced_paths)
+      fprintf(stderr, "  %s\n", p.c_str());
+    return false;
+  }
+
+  std::string trace_path = log_dir + "/" FUSE_TRACE_FILE;
+  FILE *f = fopen(trace_path.c_str(), "rb");
+  if (f == NULL) {
+    fprintf(stderr, "cannot open %s\n", trace_path.c_str());
+    return false;
+  }
+  FuseTraceHeader header;
+  if ((fread(&header, sizeof(header), 1, f) != 1) ||
+      (memcmp(header.fMagic, kFuseTraceMagic, sizeof(header.fMagic)) != 0) ||
+      (header.fVersion != kFuseTraceVersion) ||
+      (header.fRecordSize != sizeof(FuseTraceRecord)))
+  {
+    fprintf(stderr, "%s is not a fuse_forward trace\n", trace_path.c_str());
+    fclose(f);
+    return false;
+  }
+
+  records->clear();
+  FuseTraceRecord buf[4096];
+  size_t n;
+  while ((n = fread(buf, sizeof(FuseTraceRecord), 4096, f)) > 0) {
+    for (size_t i = 0; i < n; ++i) {
+      if (file_ids.count(buf[i].fFileId))
+        records->push_back(buf[i]);
+    }
+  }
+  fclose(f);
+
+  // The drain thread writes the rings one after the other
+  std::stable_sort(records->begin(), records->end(),
+    [](const FuseTraceRecord &a, const FuseTraceRecord &b) {
+      return a.fTimestampNs < b.fTimestampNs; });
+  return true;
+}
+
+/// A read request as seen by the file system
+struct FuseTraceRequest {
+  uint64_t fOffset;
+  uint64_t fSize;  ///< Number of bytes read
+};
+
+/**
+ * Reads the successful read requests of either a fuse_forward log directory
+ * (see ReadFuseTrace(), filtered by filter_path) or a text log with one
+ * "<offset> <bytes read>" line per request, such as the output of
+ * bm_iopattern.sh.  Text logs are not filtered.  On failure, prints the
+ * reason to stderr and returns false.
+ */
+static inline bool ReadFuseRequests(
+  const std::string &log_path,
+  const std::string &filter_path,
+  std::vector<FuseTraceRequest> *requests,
+  uint64_t *n_dropped)
+{
+  requests->clear();
+  *n_dropped = 0;
+  struct stat info;
+  if ((stat(log_path.c_str(), &info) == 0) && S_ISDIR(info.st_mode)) {
+    std::vector<FuseTraceRecord> records;
+    if (!ReadFuseTrace(log_path, filter_path, &records, n_dropped))
+      return false;
+    for (const auto &r : records) {
+      if (r.fResult > 0)
+        requests->push_back(FuseTraceRequest{uint64_t(r.fOffset), uint64_t(r.fResult)});
+    }
+    return true;
+  }
+
+  std::ifstream log(log_path.c_str());
+  if (!log) {
+    fprintf(stderr, "cannot open %s\n", log_path.c_str());
+    return false;
+  }
+  int64_t offset;
+  int64_t size;
+  while (log >> offset >> size) {
+    if (size > 0)
+      requests->push_back(FuseTraceRequest{uint64_t(offset), uint64_t(size)});
+  }
+  return true;
+}
+
+#endif  // FUSE_TRACE_H_
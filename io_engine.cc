@@ -0,0 +1,497 @@
+/**
+ * Author jblomer@cern.ch
+ */
+
+#include "io_engine.h"
+#include "timeline.h"
+
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleReader.hxx>
+#include <ROOT/RNTupleReadOptions.hxx>
+#include <ROOT/RPageStorageFile.hxx>
+#include <ROOT/RRawFile.hxx>
+#include <ROOT/TTaskGroup.hxx>
+#include <TROOT.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#ifdef HAS_URING
+#include <linux/io_uring.h>
+#include <liburing.h>
+#endif
+
+IoEngines GetIoEngine(const std::string &name) {
+  if (name == "pread")
+    return IoEngines::kPread;
+  if (name == "uring")
+    return IoEngines::kUring;
+  if (name == "uring-direct")
+    return IoEngines::kUringDirect;
+  if (name == "mmap")
+    return IoEngines::kMmap;
+  std::cerr << "Unknown I/O engine: " << name << std::endl;
+  abort();
+}
+
+
+std::string GetIoEngineName(const IoEngines engine) {
+  switch (engine) {
+    case IoEngines::kPread: return "pread";
+    case IoEngines::kUring: return "uring";
+    case IoEngines::kUringDirect: return "uring-direct";
+    case IoEngines::kMmap: return "mmap";
+  }
+  abort();
+}
+
+
+bool IsUringAvailable() {
+#ifdef HAS_URING
+  return !(syscall(__NR_io_uring_register, 0, IORING_UNREGISTER_BUFFERS,
+                   NULL, 0) && errno == ENOSYS);
+#else
+  return false;
+#endif
+}
+
+
+namespace {
+
+/**
+ * Raw file backend that maps the entire file.  The page source still owns
+ * its page buffers, so the requested ranges are copied from the mapping;
+ * that copy replaces the copy in the kernel of a read system call.  The
+ * mapping is advised for sequential access and every vector read, i.e. a
+ * cluster bunch, is advised as needed before it is copied.
+ */
+class RRawFileMmap : public ROOT::Internal::RRawFile {
+  int fFd = -1;
+  unsigned char *fMap = nullptr;
+  std::uint64_t fSize = 0;
+
+  /// Copies the available part of the range and returns the number of bytes copied
+  std::size_t Copy(void *buffer, std::size_t nbytes, std::uint64_t offset) const {
+    if (offset >= fSize)
+      return 0;
+    nbytes = std::min<std::uint64_t>(nbytes, fSize - offset);
+    memcpy(buffer, fMap + offset, nbytes);
+    return nbytes;
+  }
+
+protected:
+  void OpenImpl() final {
+    fFd = open(fUrl.c_str(), O_RDONLY);
+    if (fFd < 0)
+      throw std::runtime_error("cannot open '" + fUrl + "': " + strerror(errno));
+    struct stat info;
+    if (fstat(fFd, &info) != 0)
+      throw std::runtime_error("cannot stat '" + fUrl + "': " + strerror(errno));
+    fSize = info.st_size;
+    if (fSize == 0)
+      return;
+    void *map = mmap(nullptr, fSize, PROT_READ, MAP_SHARED, fFd, 0);
+    if (map == MAP_FAILED)
+      throw std::runtime_error("cannot map '" + fUrl + "': " + strerror(errno));
+    fMap = static_cast<unsigned char *>(map);
+    madvise(fMap, fSize, MADV_SEQUENTIAL);
+  }
+
+  size_t ReadAtImpl(void *buffer, size_t nbytes, std::uint64_t offset) final {
+    return Copy(buffer, nbytes, offset);
+  }
+
+  void ReadVImpl(RIOVec *ioVec, unsigned int nReq) final {
+    // One madvise() for the envelope of the requests rather than one per page
+    std::uint64_t begin = fSize;
+    std::uint64_t end = 0;
+    for (unsigned i = 0; i < nReq; ++i) {
+      if (ioVec[i].fSize == 0)
+        continue;
+      begin = std::min(begin, ioVec[i].fOffset);
+      end = std::max(end, ioVec[i].fOffset + ioVec[i].fSize);
+    }
+    end = std::min(end, fSize);
+    if (begin < end) {
+      const std::uint64_t page_size = sysconf(_SC_PAGESIZE);
+      begin -= begin % page_size;
+      madvise(fMap + begin, end - begin, MADV_WILLNEED);
+    }
+
+    for (unsigned i = 0; i < nReq; ++i)
+      ioVec[i].fOutBytes = Copy(ioVec[i].fBuffer, ioVec[i].fSize, ioVec[i].fOffset);
+  }
+
+  std::uint64_t GetSizeImpl() final { return fSize; }
+
+public:
+  RRawFileMmap(std::string_view path, ROptions options) : RRawFile(path, options) {}
+
+  ~RRawFileMmap() {
+    if (fMap)
+      munmap(fMap, fSize);
+    if (fFd >= 0)
+      close(fFd);
+  }
+
+  std::unique_ptr<RRawFile> Clone() const final {
+    return std::make_unique<RRawFileMmap>(fUrl, fOptions);
+  }
+
+  int GetFeatures() const final { return kFeatureHasSize; }
+};
+
+}  // anonymous namespace
+
+
+#ifdef HAS_URING
+
+namespace {
+
+/**
+ * Raw file backend that serves vector reads with a single io_uring batch.
+ * With O_DIRECT, the reads go through kQueueDepth aligned slots that are
+ * registered with the ring (IORING_OP_READ_FIXED) and are copied from there
+ * into the destination buffers, which RNTuple does not align.  Without
+ * O_DIRECT, the reads go straight into the destination buffers.
+ */
+class RRawFileUring : public ROOT::Internal::RRawFile {
+  static constexpr unsigned kQueueDepth = 32;
+  static constexpr std::size_t kAlignment = 4096;
+  static constexpr std::size_t kSlotSize = 512 * 1024;
+
+  /// A contiguous part of a read request that is served by a single SQE
+  struct RChunk {
+    unsigned fReq;
+    std::uint64_t fOffset;
+    std::size_t fSize;
+    unsigned char *fDest;
+  };
+
+  const bool fDirect;
+  int fFd = -1;
+  struct io_uring fRing;
+  bool fHasRing = false;
+  unsigned char *fSlots = nullptr;
+
+  /// Splits a chunk in direct mode such that its aligned range fits a slot
+  static RChunk Trim(const RChunk &chunk, std::size_t *rest) {
+    const std::uint64_t aligned = chunk.fOffset - chunk.fOffset % kAlignment;
+    const std::size_t payload =
+      std::min(chunk.fSize, kSlotSize - (chunk.fOffset - aligned));
+    *rest = chunk.fSize - payload;
+    return RChunk{chunk.fReq, chunk.fOffset, payload, chunk.fDest};
+  }
+
+protected:
+  void OpenImpl() final {
+    fFd = open(fUrl.c_str(), O_RDONLY | (fDirect ? O_DIRECT : 0));
+    if (fFd < 0)
+      throw std::runtime_error("cannot open '" + fUrl + "': " + strerror(errno));
+    int retval = io_uring_queue_init(kQueueDepth, &fRing, 0);
+    if (retval < 0)
+      throw std::runtime_error(std::string("io_uring_queue_init: ") + strerror(-retval));
+    fHasRing = true;
+    if (!fDirect)
+      return;
+
+    if (posix_memalign(reinterpret_cast<void **>(&fSlots), kAlignment,
+                       kQueueDepth * kSlotSize))
+      throw std::runtime_error("cannot allocate io_uring buffers");
+    struct iovec iovs[kQueueDepth];
+    for (unsigned i = 0; i < kQueueDepth; ++i) {
+      iovs[i].iov_base = fSlots + i * kSlotSize;
+      iovs[i].iov_len = kSlotSize;
+    }
+    retval = io_uring_register_buffers(&fRing, iovs, kQueueDepth);
+    if (retval < 0)
+      throw std::runtime_error(std::string("io_uring_register_buffers: ") + strerror(-retval));
+  }
+
+  size_t ReadAtImpl(void *buffer, size_t nbytes, std::uint64_t offset) final {
+    RIOVec ioVec;
+    ioVec.fBuffer = buffer;
+    ioVec.fOffset = offset;
+    ioVec.fSize = nbytes;
+    ReadVImpl(&ioVec, 1);
+    return ioVec.fOutBytes;
+  }
+
+  void ReadVImpl(RIOVec *ioVec, unsigned int nReq) final {
+    std::vector<RChunk> chunks;
+    for (unsigned i = 0; i < nReq; ++i) {
+      ioVec[i].fOutBytes = 0;
+      if (ioVec[i].fSize > 0) {
+        chunks.push_back(RChunk{i, ioVec[i].fOffset, ioVec[i].fSize,
+                                reinterpret_cast<unsigned char *>(ioVec[i].fBuffer)});
+      }
+    }
+
+    std::size_t next = 0;
+    RChunk batch[kQueueDepth];
+    while (next < chunks.size()) {
+      unsigned n = 0;
+      for (; n < kQueueDepth && next < chunks.size(); ++n) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&fRing);
+        if (fDirect) {
+          std::size_t rest;
+          batch[n] = Trim(chunks[next], &rest);
+          if (rest > 0) {
+            chunks[next].fOffset += batch[n].fSize;
+            chunks[next].fSize = rest;
+            chunks[next].fDest += batch[n].fSize;
+          } else {
+            next++;
+          }
+          const std::uint64_t aligned = batch[n].fOffset - batch[n].fOffset % kAlignment;
+          std::size_t length = batch[n].fOffset - aligned + batch[n].fSize;
+          length = (length + kAlignment - 1) / kAlignment * kAlignment;
+          io_uring_prep_read_fixed(sqe, fFd, fSlots + n * kSlotSize, length, aligned, n);
+        } else {
+          batch[n] = chunks[next++];
+          io_uring_prep_read(sqe, fFd, batch[n].fDest, batch[n].fSize, batch[n].fOffset);
+        }
+        io_uring_sqe_set_data64(sqe, n);
+      }
+
+      int retval = io_uring_submit_and_wait(&fRing, n);
+      if (retval < 0)
+        throw std::runtime_error(std::string("io_uring_submit_and_wait: ") + strerror(-retval));
+      for (unsigned i = 0; i < n; ++i) {
+        struct io_uring_cqe *cqe;
+        retval = io_uring_wait_cqe(&fRing, &cqe);
+        if (retval < 0)
+          throw std::runtime_error(std::string("io_uring_wait_cqe: ") + strerror(-retval));
+        const auto idx = io_uring_cqe_get_data64(cqe);
+        const int res = cqe->res;
+        io_uring_cqe_seen(&fRing, cqe);
+        if (res < 0)
+          throw std::runtime_error("read from '" + fUrl + "' failed: " + strerror(-res));
+
+        const RChunk &chunk = batch[idx];
+        std::size_t nbytes = res;
+        if (fDirect) {
+          const std::size_t skip = chunk.fOffset % kAlignment;
+          nbytes = (nbytes > skip) ? std::min(nbytes - skip, chunk.fSize) : 0;
+          memcpy(chunk.fDest, fSlots + idx * kSlotSize + skip, nbytes);
+        }
+        ioVec[chunk.fReq].fOutBytes += nbytes;
+        // Short read: queue the remainder unless at the end of the file
+        if (nbytes > 0 && nbytes < chunk.fSize) {
+          chunks.push_back(RChunk{chunk.fReq, chunk.fOffset + nbytes,
+                                  chunk.fSize - nbytes, chunk.fDest + nbytes});
+        }
+      }
+    }
+  }
+
+  std::uint64_t GetSizeImpl() final {
+    struct stat info;
+    if (fstat(fFd, &info) != 0)
+      throw std::runtime_error("cannot stat '" + fUrl + "': " + strerror(errno));
+    return info.st_size;
+  }
+
+public:
+  RRawFileUring(std::string_view path, ROptions options, bool direct)
+    : RRawFile(path, options), fDirect(direct) {}
+
+  ~RRawFileUring() {
+    if (fHasRing)
+      io_uring_queue_exit(&fRing);
+    if (fFd >= 0)
+      close(fFd);
+    free(fSlots);
+  }
+
+  std::unique_ptr<RRawFile> Clone() const final {
+    return std::make_unique<RRawFileUring>(fUrl, fOptions, fDirect);
+  }
+
+  int GetFeatures() const final { return kFeatureHasSize; }
+};
+
+}  // anonymous namespace
+
+#endif  // HAS_URING
+
+
+namespace {
+
+/**
+ * Raw file that forwards to another raw file and records the reads on the
+ * timeline.  The vector reads of the page source are the cluster bunches;
+ * with the cluster cache, they are issued by its I/O thread.  The wrapper
+ * does not buffer itself, the wrapped file does.
+ */
+class RRawFileTimeline : public ROOT::Internal::RRawFile {
+  std::unique_ptr<RRawFile> fFile;
+
+  static ROptions GetUnbufferedOptions() {
+    ROptions options;
+    options.fBlockSize = 0;
+    return options;
+  }
+
+protected:
+  // The wrapped file opens itself on first use
+  void OpenImpl() final {}
+
+  size_t ReadAtImpl(void *buffer, size_t nbytes, std::uint64_t offset) final {
+    TimelineScope scope(TimelineCategory::kRead, nbytes, 1);
+    return fFile->ReadAt(buffer, nbytes, offset);
+  }
+
+  void ReadVImpl(RIOVec *ioVec, unsigned int nReq) final {
+    std::uint64_t nbytes = 0;
+    for (unsigned i = 0; i < nReq; ++i)
+      nbytes += ioVec[i].fSize;
+    TimelineScope scope(TimelineCategory::kRead, nbytes, nReq);
+    fFile->ReadV(ioVec, nReq);
+  }
+
+  std::uint64_t GetSizeImpl() final { return fFile->GetSize(); }
+
+public:
+  explicit RRawFileTimeline(std::unique_ptr<RRawFile> file)
+    : RRawFile(file->GetUrl(), GetUnbufferedOptions()), fFile(std::move(file)) {}
+
+  std::unique_ptr<RRawFile> Clone() const final {
+    return std::make_unique<RRawFileTimeline>(fFile->Clone());
+  }
+
+  int GetFeatures() const final { return kFeatureHasSize; }
+};
+
+/**
+ * Same as ROOT's implicit multi-threading task scheduler for the page
+ * decompression, but records the decompression tasks on the timeline.
+ */
+class RTaskSchedulerTimeline
+  : public ROOT::Experimental::Internal::RPageStorage::RTaskScheduler
+{
+  ROOT::Experimental::TTaskGroup fTaskGroup;
+
+public:
+  void AddTask(const std::function<void(void)> &taskFunc) final {
+    fTaskGroup.Run([taskFunc] {
+      TimelineScope scope(TimelineCategory::kUnzip);
+      taskFunc();
+    });
+  }
+
+  void Wait() final { fTaskGroup.Wait(); }
+};
+
+// The page sources keep raw pointers to their task schedulers, so the
+// schedulers live until the end of the process
+std::mutex g_timeline_schedulers_lock;
+std::vector<std::unique_ptr<RTaskSchedulerTimeline>> g_timeline_schedulers;
+
+RTaskSchedulerTimeline *MakeTimelineTaskScheduler() {
+  std::lock_guard<std::mutex> guard(g_timeline_schedulers_lock);
+  g_timeline_schedulers.emplace_back(std::make_unique<RTaskSchedulerTimeline>());
+  return g_timeline_schedulers.back().get();
+}
+
+// Whether a reader with the given options decompresses through the implicit
+// multi-threading task scheduler, which is replaced to record the tasks
+bool NeedsTimelineTaskScheduler(const ROOT::Experimental::RNTupleReadOptions &options) {
+  return IsTimelineEnabled() && ROOT::IsImplicitMTEnabled() &&
+         options.GetUseImplicitMT() == ROOT::Experimental::RNTupleReadOptions::EImplicitMT::kDefault;
+}
+
+}  // anonymous namespace
+
+
+std::unique_ptr<ROOT::Experimental::Internal::RPageSource> OpenNTuplePageSource(
+  const std::string &ntuple_name,
+  const std::string &path,
+  const ROOT::Experimental::RNTupleReadOptions &options,
+  const IoEngines engine)
+{
+  std::string local_path = path;
+  if (local_path.compare(0, 7, "file://") == 0)
+    local_path = local_path.substr(7);
+  const bool is_remote = local_path.find("://") != std::string::npos;
+
+  std::unique_ptr<ROOT::Internal::RRawFile> file;
+  if (engine == IoEngines::kMmap && !is_remote)
+    file = std::make_unique<RRawFileMmap>(local_path, ROOT::Internal::RRawFile::ROptions());
+#ifdef HAS_URING
+  if (engine != IoEngines::kPread && engine != IoEngines::kMmap && !is_remote && IsUringAvailable()) {
+    file = std::make_unique<RRawFileUring>(
+      local_path, ROOT::Internal::RRawFile::ROptions(),
+      engine == IoEngines::kUringDirect);
+  }
+#endif
+  if (engine != IoEngines::kPread && !file) {
+    std::cerr << "Warning: I/O engine " << GetIoEngineName(engine)
+              << " not available for " << path << ", using pread" << std::endl;
+  }
+  if (IsTimelineEnabled()) {
+    if (!file)
+      file = ROOT::Internal::RRawFile::Create(is_remote ? path : local_path);
+    file = std::make_unique<RRawFileTimeline>(std::move(file));
+  }
+  if (file) {
+    return std::make_unique<ROOT::Experimental::Internal::RPageSourceFile>(
+      ntuple_name, std::move(file), options);
+  }
+  return ROOT::Experimental::Internal::RPageSource::Create(ntuple_name, path, options);
+}
+
+
+std::unique_ptr<ROOT::Experimental::RNTupleReader> OpenNTupleReader(
+  std::unique_ptr<ROOT::Experimental::RNTupleModel> model,
+  const std::string &ntuple_name,
+  const std::string &path,
+  const ROOT::Experimental::RNTupleReadOptions &options,
+  const IoEngines engine)
+{
+  using ROOT::Experimental::RNTupleReader;
+
+  auto source = OpenNTuplePageSource(ntuple_name, path, options, engine);
+  auto source_ptr = source.get();
+  std::unique_ptr<RNTupleReader> reader;
+  if (model)
+    reader = std::make_unique<RNTupleReader>(std::move(model), std::move(source));
+  else
+    reader = std::make_unique<RNTupleReader>(std::move(source));
+
+  // Replaces the reader's task scheduler before the first cluster is loaded.
+  // Clones of the reader use ROOT's scheduler again, see CloneNTupleReader().
+  if (NeedsTimelineTaskScheduler(options))
+    source_ptr->SetTaskScheduler(MakeTimelineTaskScheduler());
+  return reader;
+}
+
+
+std::unique_ptr<ROOT::Experimental::RNTupleReader> CloneNTupleReader(
+  ROOT::Experimental::RNTupleReader &reader,
+  const std::string &ntuple_name,
+  const std::string &path,
+  const ROOT::Experimental::RNTupleReadOptions &options,
+  const IoEngines engine)
+{
+  // The page source of a clone is not accessible, so its task scheduler
+  // cannot be replaced
+  if (NeedsTimelineTaskScheduler(options))
+    return OpenNTupleReader(nullptr, ntuple_name, path, options, engine);
+  return reader.Clone();
+}
@@ -0,0 +1,68 @@
+/**
+ * Author jblomer@cern.ch
+ */
+
+#ifndef IO_ENGINE_H_
+#define IO_ENGINE_H_
+
+#include <memory>
+#include <string>
+
+namespace ROOT {
+namespace Experimental {
+class RNTupleModel;
+class RNTupleReader;
+class RNTupleReadOptions;
+namespace Internal {
+class RPageSource;
+}
+}
+}
+
+/**
+ * The I/O backend used by the RNTuple page source for local files.  kPread is
+ * ROOT's default raw file.  The io_uring engines submit all the read requests
+ * of a vector read, i.e. all the pages of a cluster bunch, as one batch of
+ * SQEs.  kUringDirect opens the file with O_DIRECT and reads through aligned
+ * buffers registered with the ring.  kMmap maps the entire file and copies
+ * the requested ranges from the mapping, which replaces the read system calls
+ * by page faults on the mapping.
+ */
+enum class IoEngines { kPread, kUring, kUringDirect, kMmap };
+
+IoEngines GetIoEngine(const std::string &name);
+std::string GetIoEngineName(const IoEngines engine);
+
+// Same probe as check-uring; false if built without liburing
+bool IsUringAvailable();
+
+// The page source is not yet attached.  Remote paths always use the default engine.
+// If the timeline is enabled, the reads are recorded on the timeline.
+std::unique_ptr<ROOT::Experimental::Internal::RPageSource> OpenNTuplePageSource(
+  const std::string &ntuple_name,
+  const std::string &path,
+  const ROOT::Experimental::RNTupleReadOptions &options,
+  const IoEngines engine);
+
+// The model can be null, in which case it is created from the descriptor.
+// Remote paths always use the default engine.  If the timeline is enabled,
+// the reads and the implicit multi-threading decompression tasks are recorded.
+std::unique_ptr<ROOT::Experimental::RNTupleReader> OpenNTupleReader(
+  std::unique_ptr<ROOT::Experimental::RNTupleModel> model,
+  const std::string &ntuple_name,
+  const std::string &path,
+  const ROOT::Experimental::RNTupleReadOptions &options,
+  const IoEngines engine);
+
+// Same as reader.Clone(), i.e. a reader with the model created from the
+// descriptor.  If the timeline records the implicit multi-threading
+// decompression tasks, the clone is opened with OpenNTupleReader() from the
+// path instead, which reads the header and the footer again.
+std::unique_ptr<ROOT::Experimental::RNTupleReader> CloneNTupleReader(
+  ROOT::Experimental::RNTupleReader &reader,
+  const std::string &ntuple_name,
+  const std::string &path,
+  const ROOT::Experimental::RNTupleReadOptions &options,
+  const IoEngines engine);
+
+#endif  // IO_ENGINE_H_
@@ -0,0 +1,366 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+#ifndef KINEMATICS_H_
+#define KINEMATICS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Invariant mass kernels shared by the analyses.  Every kernel exists as an inline scalar function, used
+ * per entry and in the RDataFrame flavours, and as a batch function over structure-of-arrays inputs, used by the
+ * direct event loops.  The batch functions are compiled for AVX-512, AVX2 and the baseline instruction set and
+ * dispatch at runtime on the CPU features; the environment variable KINEMATICS_SIMD=generic|avx2|avx512 caps the
+ * selection for benchmarking.
+ *
+ * The transcendental functions are branch-free polynomial approximations (float precision) so that the loops
+ * vectorize without a vector math library.  Scalar and batch flavours use the same approximations; they agree up
+ * to float rounding (the AVX flavours contract to fused multiply-adds).  The two-body masses are computed from
+ * the opening term pt0 * pt1 * (cosh(deta) - cos(dphi)), which stays accurate for collinear pairs.
+ */
+
+#define KINEMATICS_INLINE inline __attribute__((always_inline))
+
+namespace kinematics {
+
+namespace detail {
+
+template <typename ToT, typename FromT>
+KINEMATICS_INLINE ToT BitCast(FromT from)
+{
+   static_assert(sizeof(ToT) == sizeof(FromT), "size mismatch");
+   ToT to;
+   memcpy(&to, &from, sizeof(ToT));
+   return to;
+}
+
+/// Adding 1.5 * 2^23 to a float of magnitude less than 2^22 rounds it to an integer in the lower mantissa bits
+constexpr float kRoundMagic = 12582912.0f;
+
+KINEMATICS_INLINE float Exp(float x)
+{
+   x = std::min(std::max(x, -87.0f), 88.0f);
+   // x = n * ln2 + r with |r| <= ln2 / 2
+   const float t = x * 1.44269504f + kRoundMagic;
+   const std::int32_t n = BitCast<std::int32_t>(t) - BitCast<std::int32_t>(kRoundMagic);
+   const float fn = t - kRoundMagic;
+   const float r = (x - fn * 0.693145751953125f) - fn * 1.42860677e-6f;
+   const float p = 1.0f + r * (1.0f + r * (0.5f + r * (1.66666667e-1f + r * (4.16666667e-2f +
+                   r * (8.33333333e-3f + r * 1.38888889e-3f)))));
+   return p * BitCast<float>((n + 127) << 23);
+}
+
+/// Sine and cosine of r, with x = q * pi/2 + r and |r| <= pi/4
+KINEMATICS_INLINE void SinCosReduced(float x, float &s, float &c, std::int32_t &q)
+{
+   // pi/2 split in three parts for the reduction
+   const float t = x * 0.636619772f + kRoundMagic;
+   q = BitCast<std::int32_t>(t) - BitCast<std::int32_t>(kRoundMagic);
+   const float fq = t - kRoundMagic;
+   const float r = ((x - fq * 1.5703125f) - fq * 4.83751297e-4f) - fq * 7.54978995e-8f;
+   const float r2 = r * r;
+   s = r + r * r2 * (-1.66666667e-1f + r2 * (8.33333333e-3f + r2 * -1.98412698e-4f));
+   c = 1.0f + r2 * (-0.5f + r2 * (4.16666667e-2f + r2 * (-1.38888889e-3f + r2 * 2.48015873e-5f)));
+}
+
+KINEMATICS_INLINE float Cos(float x)
+{
+   float s, c;
+   std::int32_t q;
+   SinCosReduced(x, s, c, q);
+   // cos(q * pi/2 + r) cycles through cos r, -sin r, -cos r, sin r
+   const float v = (q & 1) ? s : c;
+   return ((q + 1) & 2) ? -v : v;
+}
+
+KINEMATICS_INLINE float Sin(float x)
+{
+   float s, c;
+   std::int32_t q;
+   SinCosReduced(x, s, c, q);
+   // sin(q * pi/2 + r) cycles through sin r, cos r, -sin r, -cos r
+   const float v = (q & 1) ? c : s;
+   return (q & 2) ? -v : v;
+}
+
+KINEMATICS_INLINE float Sinh(float x)
+{
+   // The difference of exponentials cancels for small arguments, use the Taylor series there
+   const float e = Exp(x);
+   const float x2 = x * x;
+   const float small = x + x * x2 * (1.66666667e-1f + x2 * (8.33333333e-3f + x2 * 1.98412698e-4f));
+   return (std::abs(x) < 0.5f) ? small : 0.5f * (e - 1.0f / e);
+}
+
+KINEMATICS_INLINE float Cosh(float x)
+{
+   const float e = Exp(x);
+   return 0.5f * (e + 1.0f / e);
+}
+
+/// Given a_i = pt_i * cosh(eta_i), the absolute momenta of two particles, returns a0 * a1 - p0 * p1 in the
+/// form pt0 * pt1 * (cosh(deta) - cos(dphi)), which does not cancel for collinear particles
+KINEMATICS_INLINE float TransverseOpening(float pt0, float eta0, float phi0, float pt1, float eta1, float phi1)
+{
+   const float sh = Sinh(0.5f * (eta0 - eta1));
+   const float sn = Sin(0.5f * (phi0 - phi1));
+   return 2.0f * pt0 * pt1 * (sh * sh + sn * sn);
+}
+
+} // namespace detail
+
+
+/// Invariant mass of two particles given as (pt, eta, phi, mass)
+KINEMATICS_INLINE float PtEtaPhiMMass(float pt0, float eta0, float phi0, float m0,
+                                      float pt1, float eta1, float phi1, float m1)
+{
+   const float a0 = pt0 * detail::Cosh(eta0);
+   const float a1 = pt1 * detail::Cosh(eta1);
+   const float m0Sq = m0 * m0;
+   const float m1Sq = m1 * m1;
+   // e_i = a_i + d_i
+   const float d0 = m0Sq / (std::sqrt(a0 * a0 + m0Sq) + a0);
+   const float d1 = m1Sq / (std::sqrt(a1 * a1 + m1Sq) + a1);
+   const float opening = detail::TransverseOpening(pt0, eta0, phi0, pt1, eta1, phi1);
+   return std::sqrt(m0Sq + m1Sq + 2.0f * (opening + a0 * d1 + a1 * d0 + d0 * d1));
+}
+
+/// Invariant mass of two particles given as (pt, eta, phi, energy).  Like ROOT::Math::LorentzVector::mass(),
+/// a negative squared mass results in a negative mass.
+KINEMATICS_INLINE float PtEtaPhiEMass(float pt0, float eta0, float phi0, float e0,
+                                      float pt1, float eta1, float phi1, float e1)
+{
+   const float a0 = pt0 * detail::Cosh(eta0);
+   const float a1 = pt1 * detail::Cosh(eta1);
+   // e_i = a_i + d_i
+   const float d0 = e0 - a0;
+   const float d1 = e1 - a1;
+   const float opening = detail::TransverseOpening(pt0, eta0, phi0, pt1, eta1, phi1);
+   const float mSq = d0 * (e0 + a0) + d1 * (e1 + a1) + 2.0f * (opening + a0 * d1 + e1 * d0);
+   return std::copysign(std::sqrt(std::abs(mSq)), mSq);
+}
+
+KINEMATICS_INLINE double P2(double px, double py, double pz)
+{
+   return px * px + py * py + pz * pz;
+}
+
+KINEMATICS_INLINE double Energy(double px, double py, double pz, double m)
+{
+   return std::sqrt(P2(px, py, pz) + m * m);
+}
+
+/// Invariant mass of three particles of identical mass m given as (px, py, pz)
+KINEMATICS_INLINE double ThreeBodyMass(double px0, double py0, double pz0, double px1, double py1, double pz1,
+                                       double px2, double py2, double pz2, double m)
+{
+   const double p2 = P2(px0 + px1 + px2, py0 + py1 + py2, pz0 + pz1 + pz2);
+   const double e = Energy(px0, py0, pz0, m) + Energy(px1, py1, pz1, m) + Energy(px2, py2, pz2, m);
+   return std::sqrt(e * e - p2);
+}
+
+
+/// Two-body candidates in structure-of-arrays layout.  The fourth component is either the mass or the energy,
+/// depending on the kernel used on the buffer.
+struct PairBuffer {
+   std::vector<float> fPt0, fEta0, fPhi0, fX0;
+   std::vector<float> fPt1, fEta1, fPhi1, fX1;
+
+   void Add(float pt0, float eta0, float phi0, float x0, float pt1, float eta1, float phi1, float x1)
+   {
+      fPt0.push_back(pt0); fEta0.push_back(eta0); fPhi0.push_back(phi0); fX0.push_back(x0);
+      fPt1.push_back(pt1); fEta1.push_back(eta1); fPhi1.push_back(phi1); fX1.push_back(x1);
+   }
+   std::size_t GetSize() const { return fPt0.size(); }
+   void Clear()
+   {
+      fPt0.clear(); fEta0.clear(); fPhi0.clear(); fX0.clear();
+      fPt1.clear(); fEta1.clear(); fPhi1.clear(); fX1.clear();
+   }
+};
+
+/// Momentum components of three particles, each array of the same length
+struct ThreeBodyColumns {
+   const double *fPx[3];
+   const double *fPy[3];
+   const double *fPz[3];
+};
+
+
+enum class ESimdLevel { kGeneric, kAVX2, kAVX512 };
+
+inline ESimdLevel DetectSimdLevel()
+{
+   auto level = ESimdLevel::kGeneric;
+#if defined(__x86_64__)
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      level = ESimdLevel::kAVX2;
+   if (__builtin_cpu_supports("avx512f"))
+      level = ESimdLevel::kAVX512;
+#endif
+   const char *env = getenv("KINEMATICS_SIMD");
+   const std::string cap = env ? env : "";
+   if (cap == "generic")
+      level = ESimdLevel::kGeneric;
+   else if (cap == "avx2" && level == ESimdLevel::kAVX512)
+      level = ESimdLevel::kAVX2;
+   return level;
+}
+
+inline ESimdLevel GetSimdLevel()
+{
+   static const ESimdLevel level = DetectSimdLevel();
+   return level;
+}
+
+inline const char *GetSimdName()
+{
+   switch (GetSimdLevel()) {
+   case ESimdLevel::kAVX2: return "avx2";
+   case ESimdLevel::kAVX512: return "avx512";
+   default: return "generic";
+   }
+}
+
+
+namespace detail {
+
+KINEMATICS_INLINE void PtEtaPhiMMassLoop(const PairBuffer &pairs, double *__restrict mass)
+{
+   const float *__restrict pt0 = pairs.fPt0.data();
+   const float *__restrict eta0 = pairs.fEta0.data();
+   const float *__restrict phi0 = pairs.fPhi0.data();
+   const float *__restrict m0 = pairs.fX0.data();
+   const float *__restrict pt1 = pairs.fPt1.data();
+   const float *__restrict eta1 = pairs.fEta1.data();
+   const float *__restrict phi1 = pairs.fPhi1.data();
+   const float *__restrict m1 = pairs.fX1.data();
+   const std::size_t n = pairs.GetSize();
+#pragma GCC ivdep
+   for (std::size_t i = 0; i < n; ++i)
+      mass[i] = PtEtaPhiMMass(pt0[i], eta0[i], phi0[i], m0[i], pt1[i], eta1[i], phi1[i], m1[i]);
+}
+
+KINEMATICS_INLINE void PtEtaPhiEMassLoop(const PairBuffer &pairs, double *__restrict mass)
+{
+   const float *__restrict pt0 = pairs.fPt0.data();
+   const float *__restrict eta0 = pairs.fEta0.data();
+   const float *__restrict phi0 = pairs.fPhi0.data();
+   const float *__restrict e0 = pairs.fX0.data();
+   const float *__restrict pt1 = pairs.fPt1.data();
+   const float *__restrict eta1 = pairs.fEta1.data();
+   const float *__restrict phi1 = pairs.fPhi1.data();
+   const float *__restrict e1 = pairs.fX1.data();
+   const std::size_t n = pairs.GetSize();
+#pragma GCC ivdep
+   for (std::size_t i = 0; i < n; ++i)
+      mass[i] = PtEtaPhiEMass(pt0[i], eta0[i], phi0[i], e0[i], pt1[i], eta1[i], phi1[i], e1[i]);
+}
+
+KINEMATICS_INLINE void ThreeBodyMassLoop(const ThreeBodyColumns &p, double m, double *__restrict mass,
+                                         std::size_t n)
+{
+   const double *__restrict px0 = p.fPx[0];
+   const double *__restrict py0 = p.fPy[0];
+   const double *__restrict pz0 = p.fPz[0];
+   const double *__restrict px1 = p.fPx[1];
+   const double *__restrict py1 = p.fPy[1];
+   const double *__restrict pz1 = p.fPz[1];
+   const double *__restrict px2 = p.fPx[2];
+   const double *__restrict py2 = p.fPy[2];
+   const double *__restrict pz2 = p.fPz[2];
+#pragma GCC ivdep
+   for (std::size_t i = 0; i < n; ++i)
+      mass[i] = ThreeBodyMass(px0[i], py0[i], pz0[i], px1[i], py1[i], pz1[i], px2[i], py2[i], pz2[i], m);
+}
+
+// The vectorizer's cost model at -O2 rejects loops that need a scalar epilogue, hence the explicit optimize
+#define KINEMATICS_VECTORIZE optimize("tree-vectorize", "vect-cost-model=dynamic")
+
+__attribute__((KINEMATICS_VECTORIZE))
+inline void PtEtaPhiMMassGeneric(const PairBuffer &pairs, double *mass) { PtEtaPhiMMassLoop(pairs, mass); }
+__attribute__((KINEMATICS_VECTORIZE))
+inline void PtEtaPhiEMassGeneric(const PairBuffer &pairs, double *mass) { PtEtaPhiEMassLoop(pairs, mass); }
+__attribute__((KINEMATICS_VECTORIZE))
+inline void ThreeBodyMassGeneric(const ThreeBodyColumns &p, double m, double *mass, std::size_t n)
+{
+   ThreeBodyMassLoop(p, m, mass, n);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,fma"), KINEMATICS_VECTORIZE))
+inline void PtEtaPhiMMassAVX2(const PairBuffer &pairs, double *mass) { PtEtaPhiMMassLoop(pairs, mass); }
+__attribute__((target("avx2,fma"), KINEMATICS_VECTORIZE))
+inline void PtEtaPhiEMassAVX2(const PairBuffer &pairs, double *mass) { PtEtaPhiEMassLoop(pairs, mass); }
+__attribute__((target("avx2,fma"), KINEMATICS_VECTORIZE))
+inline void ThreeBodyMassAVX2(const ThreeBodyColumns &p, double m, double *mass, std::size_t n)
+{
+   ThreeBodyMassLoop(p, m, mass, n);
+}
+
+__attribute__((target("avx512f"), KINEMATICS_VECTORIZE))
+inline void PtEtaPhiMMassAVX512(const PairBuffer &pairs, double *mass) { PtEtaPhiMMassLoop(pairs, mass); }
+__attribute__((target("avx512f"), KINEMATICS_VECTORIZE))
+inline void PtEtaPhiEMassAVX512(const PairBuffer &pairs, double *mass) { PtEtaPhiEMassLoop(pairs, mass); }
+__attribute__((target("avx512f"), KINEMATICS_VECTORIZE))
+inline void ThreeBodyMassAVX512(const ThreeBodyColumns &p, double m, double *mass, std::size_t n)
+{
+   ThreeBodyMassLoop(p, m, mass, n);
+}
+#endif
+
+#undef KINEMATICS_VECTORIZE
+
+} // namespace detail
+
+
+/// Batch version of PtEtaPhiMMass; mass must hold pairs.GetSize() elements
+inline void PtEtaPhiMMassBatch(const PairBuffer &pairs, double *mass)
+{
+#if defined(__x86_64__)
+   switch (GetSimdLevel()) {
+   case ESimdLevel::kAVX512: return detail::PtEtaPhiMMassAVX512(pairs, mass);
+   case ESimdLevel::kAVX2: return detail::PtEtaPhiMMassAVX2(pairs, mass);
+   default: break;
+   }
+#endif
+   detail::PtEtaPhiMMassGeneric(pairs, mass);
+}
+
+/// Batch version of PtEtaPhiEMass; mass must hold pairs.GetSize() elements
+inline void PtEtaPhiEMassBatch(const PairBuffer &pairs, double *mass)
+{
+#if defined(__x86_64__)
+   switch (GetSimdLevel()) {
+   case ESimdLevel::kAVX512: return detail::PtEtaPhiEMassAVX512(pairs, mass);
+   case ESimdLevel::kAVX2: return detail::PtEtaPhiEMassAVX2(pairs, mass);
+   default: break;
+   }
+#endif
+   detail::PtEtaPhiEMassGeneric(pairs, mass);
+}
+
+/// Batch version of ThreeBodyMass over n entries
+inline void ThreeBodyMassBatch(const ThreeBodyColumns &p, double m, double *mass, std::size_t n)
+{
+#if defined(__x86_64__)
+   switch (GetSimdLevel()) {
+   case ESimdLevel::kAVX512: return detail::ThreeBodyMassAVX512(p, m, mass, n);
+   case ESimdLevel::kAVX2: return detail::ThreeBodyMassAVX2(p, m, mass, n);
+   default: break;
+   }
+#endif
+   detail::ThreeBodyMassGeneric(p, m, mass, n);
+}
+
+} // namespace kinematics
+
+#endif // KINEMATICS_H_
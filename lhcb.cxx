@@ -3,6 +3,7 @@
  */
 
 #include <fcntl.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -10,15 +11,18 @@
 #include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <ROOT/RDataFrame.hxx>
 #include <ROOT/RNTupleReader.hxx>
 #include <ROOT/RNTupleReadOptions.hxx>
+#include <ROOT/RNTupleView.hxx>
 #include <Compression.h>
 #include <TApplication.h>
 #include <TBranch.h>
@@ -34,26 +38,62 @@
 #include <TTreeReader.h>
 #include <TTreePerfStats.h>
 
+#include "cutflow.h"
+#include "io_engine.h"
+#include "kinematics.h"
+#include "ntuple_pages.h"
+#include "tree_bulk.h"
+#include "timeline.h"
 #include "util.h"
 
 bool g_perf_stats = false;
 bool g_show = false;
 int g_cluster_bunch_size = 1;
-
-static ROOT::Experimental::RNTupleReadOptions GetRNTupleOptions() {
+unsigned g_n_threads = 1;
+/// Negative: follow -m, zero: decompress on the reading thread, positive: size of the unzip thread pool
+int g_unzip_threads = -1;
+/// Set if implicit multi-threading is only turned on for the unzip threads, i.e. -u without -m
+bool g_unzip_threads_only_mt = false;
+unsigned g_memory_budget_mb = 0;
+IoEngines g_io_engine = IoEngines::kPread;
+bool g_rdf_optimized = false;
+bool g_bulk = false;
+bool g_spans = false;
+bool g_json = false;
+bool g_hw_counters = false;
+bool g_cutflow = false;
+std::string g_timeline_path;
+AnalysisResults g_results;
+
+static ROOT::Experimental::RNTupleReadOptions GetRNTupleOptions(const std::string &ntupleName,
+                                                                const std::string &path)
+{
    using RNTupleReadOptions = ROOT::Experimental::RNTupleReadOptions;
 
+   int clusterBunchSize = g_cluster_bunch_size;
+   if (g_memory_budget_mb > 0) {
+      clusterBunchSize =
+         CapClusterBunchSize(clusterBunchSize, GetAverageClusterSize(ntupleName, path), g_memory_budget_mb);
+   }
+
    RNTupleReadOptions options;
-   if (g_cluster_bunch_size < 1) {
+   if (clusterBunchSize < 1) {
       options.SetClusterCache(RNTupleReadOptions::EClusterCache::kOff);
    } else {
-      options.SetClusterBunchSize(g_cluster_bunch_size);
+      options.SetClusterBunchSize(clusterBunchSize);
    }
+   if (g_unzip_threads == 0)
+      options.SetUseImplicitMT(RNTupleReadOptions::EImplicitMT::kOff);
+   PrintPrefetchSettings(clusterBunchSize, g_unzip_threads != 0, g_memory_budget_mb, g_unzip_threads_only_mt);
    return options;
 }
 
 constexpr double kKaonMassMeV = 493.677;
 
+/// Stages of the cut flow profile (-f)
+enum ECutFlowStages { kStageIsMuon, kStageProbK, kStageProbPi, kStageKinematics };
+static const std::vector<std::string> kCutFlowStages{"isMuon", "ProbK", "ProbPi", "kinematics"};
+
 
 static void Show(TH1D *h) {
    auto app = TApplication("", nullptr, nullptr);
@@ -72,13 +112,12 @@ static void Show(TH1D *h) {
 
 static double GetP2(double px, double py, double pz)
 {
-   return px*px + py*py + pz*pz;
+   return kinematics::P2(px, py, pz);
 }
 
 static double GetKE(double px, double py, double pz)
 {
-   double p2 = GetP2(px, py, pz);
-   return sqrt(p2 + kKaonMassMeV*kKaonMassMeV);
+   return kinematics::Energy(px, py, pz, kKaonMassMeV);
 }
 
 
@@ -87,12 +126,15 @@ static void Dataframe(ROOT::RDataFrame &frame)
 {
    auto ts_init = std::chrono::steady_clock::now();
    std::chrono::steady_clock::time_point ts_first;
+   std::once_flag ts_first_flag;
 
-   auto fn_muon_cut_and_stopwatch = [&](unsigned int slot, ULong64_t entry, int is_muon) {
-      if (entry == 0) {
+   auto fn_muon_cut_and_stopwatch = [&](int is_muon) {
+      // With implicit multi-threading, the Filter runs concurrently in several slots
+      std::call_once(ts_first_flag, [&ts_first]() {
          std::cout << "starting timer" << std::endl;
          ts_first = std::chrono::steady_clock::now();
-      }
+         MarkPerfPhase("init");
+      });
       return !is_muon;
    };
    auto fn_muon_cut = [](int is_muon) { return !is_muon; };
@@ -101,47 +143,135 @@ static void Dataframe(ROOT::RDataFrame &frame)
    auto fn_sum = [](double p1, double p2, double p3) { return p1 + p2 + p3; };
    auto fn_mass = [](double B_E, double B_P2) { double r = sqrt(B_E*B_E - B_P2); return r; };
 
-   auto df_muon_cut = frame.Filter(fn_muon_cut_and_stopwatch, {"rdfslot_", "rdfentry_", "H1_isMuon"})
-                           .Filter(fn_muon_cut, {"H2_isMuon"})
-                           .Filter(fn_muon_cut, {"H3_isMuon"});
-   auto df_k_cut = df_muon_cut.Filter(fn_k_cut, {"H1_ProbK"})
-                              .Filter(fn_k_cut, {"H2_ProbK"})
-                              .Filter(fn_k_cut, {"H3_ProbK"});
-   auto df_pi_cut = df_k_cut.Filter(fn_pi_cut, {"H1_ProbPi"})
-                            .Filter(fn_pi_cut, {"H2_ProbPi"})
-                            .Filter(fn_pi_cut, {"H3_ProbPi"});
-   auto df_mass = df_pi_cut.Define("B_PX", fn_sum, {"H1_PX", "H2_PX", "H3_PX"})
-                           .Define("B_PY", fn_sum, {"H1_PY", "H2_PY", "H3_PY"})
-                           .Define("B_PZ", fn_sum, {"H1_PZ", "H2_PZ", "H3_PZ"})
-                           .Define("B_P2", GetP2, {"B_PX", "B_PY", "B_PZ"})
-                           .Define("K1_E", GetKE, {"H1_PX", "H1_PY", "H1_PZ"})
-                           .Define("K2_E", GetKE, {"H2_PX", "H2_PY", "H2_PZ"})
-                           .Define("K3_E", GetKE, {"H3_PX", "H3_PY", "H3_PZ"})
-                           .Define("B_E", fn_sum, {"K1_E", "K2_E", "K3_E"})
-                           .Define("B_m", fn_mass, {"B_E", "B_P2"});
+   // One cut flow per processing slot.  RDF reads the columns before it calls the lambdas, so the stages only
+   // measure the lambdas themselves.  Without -f, the adapters only forward the calls.
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < frame.GetNSlots(); ++i)
+      cutFlows.emplace_back(kCutFlowStages);
+   using P = ECutFlowNode;
+   auto fn_filter = [&](unsigned stage, auto fn, P position) { return CutFlowFilter(cutFlows, stage, fn, position); };
+   auto fn_define = [&](auto fn, P position) { return CutFlowDefine(cutFlows, kStageKinematics, fn, position); };
+
+   auto df_muon_cut =
+      frame.Filter(fn_filter(kStageIsMuon, fn_muon_cut_and_stopwatch, P::kStageBegin),
+                   {"rdfslot_", "H1_isMuon"})
+           .Filter(fn_filter(kStageIsMuon, fn_muon_cut, P::kStageInner), {"rdfslot_", "H2_isMuon"})
+           .Filter(fn_filter(kStageIsMuon, fn_muon_cut, P::kStageEnd), {"rdfslot_", "H3_isMuon"});
+   auto df_k_cut = df_muon_cut.Filter(fn_filter(kStageProbK, fn_k_cut, P::kStageBegin), {"rdfslot_", "H1_ProbK"})
+                              .Filter(fn_filter(kStageProbK, fn_k_cut, P::kStageInner), {"rdfslot_", "H2_ProbK"})
+                              .Filter(fn_filter(kStageProbK, fn_k_cut, P::kStageEnd), {"rdfslot_", "H3_ProbK"});
+   auto df_pi_cut = df_k_cut.Filter(fn_filter(kStageProbPi, fn_pi_cut, P::kStageBegin), {"rdfslot_", "H1_ProbPi"})
+                            .Filter(fn_filter(kStageProbPi, fn_pi_cut, P::kStageInner), {"rdfslot_", "H2_ProbPi"})
+                            .Filter(fn_filter(kStageProbPi, fn_pi_cut, P::kStageEnd), {"rdfslot_", "H3_ProbPi"});
+   // RDF evaluates the inputs of a Define before it calls it, so B_m is called last, once per entry of the stage: it
+   // counts the entries, the other Defines only add their cycles
+   auto df_mass = df_pi_cut.Define("B_PX", fn_define(fn_sum, P::kStageInner), {"rdfslot_", "H1_PX", "H2_PX", "H3_PX"})
+                           .Define("B_PY", fn_define(fn_sum, P::kStageInner), {"rdfslot_", "H1_PY", "H2_PY", "H3_PY"})
+                           .Define("B_PZ", fn_define(fn_sum, P::kStageInner), {"rdfslot_", "H1_PZ", "H2_PZ", "H3_PZ"})
+                           .Define("B_P2", fn_define(GetP2, P::kStageInner), {"rdfslot_", "B_PX", "B_PY", "B_PZ"})
+                           .Define("K1_E", fn_define(GetKE, P::kStageInner), {"rdfslot_", "H1_PX", "H1_PY", "H1_PZ"})
+                           .Define("K2_E", fn_define(GetKE, P::kStageInner), {"rdfslot_", "H2_PX", "H2_PY", "H2_PZ"})
+                           .Define("K3_E", fn_define(GetKE, P::kStageInner), {"rdfslot_", "H3_PX", "H3_PY", "H3_PZ"})
+                           .Define("B_E", fn_define(fn_sum, P::kStageInner), {"rdfslot_", "K1_E", "K2_E", "K3_E"})
+                           .Define("B_m", fn_define(fn_mass, P::kStage), {"rdfslot_", "B_E", "B_P2"});
    auto hMass = df_mass.Histo1D<double>({"B_mass", "", 500, 5050, 5500}, "B_m");
+   // Only booked for the JSON summary
+   ROOT::RDF::RResultPtr<ULong64_t> nEvents;
+   if (g_json)
+      nEvents = frame.Count();
 
    *hMass;
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
    auto runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
    auto runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
-   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
-   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   if (nEvents)
+      g_results.events_read = *nEvents;
+   g_results.events_selected = hMass->GetEntries();
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
 
    if (g_show)
       Show(hMass.GetPtr());
 }
 
 
-static void TreeDirect(const std::string &path) {
+/// Optimized flavour of Dataframe: the particle ID cuts are fused into a single Filter and the B mass is computed in
+/// a single Define, instead of one node per cut and per intermediate quantity.  The columns are flat, so the
+/// kinematics stay scalar; RVec operations do not apply.  Note that RDF reads all the columns of a node for every
+/// entry that reaches it, so the fused Filter reads the probabilities also for the muon candidates.
+static void DataframeOptimized(ROOT::RDataFrame &frame)
+{
    auto ts_init = std::chrono::steady_clock::now();
+   std::chrono::steady_clock::time_point ts_first;
+   std::once_flag ts_first_flag;
+
+   // One cut flow per processing slot.  The fused Filter measures its cuts as separate stages; without -f, the
+   // stages do nothing and the adapter of the Define only forwards the call.
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < frame.GetNSlots(); ++i)
+      cutFlows.emplace_back(kCutFlowStages);
+
+   auto fn_cuts = [&](unsigned int slot, int h1IsMuon, int h2IsMuon, int h3IsMuon,
+                      double h1ProbK, double h2ProbK, double h3ProbK,
+                      double h1ProbPi, double h2ProbPi, double h3ProbPi)
+   {
+      // With implicit multi-threading, the Filter runs concurrently in several slots
+      std::call_once(ts_first_flag, [&ts_first]() {
+         std::cout << "starting timer" << std::endl;
+         ts_first = std::chrono::steady_clock::now();
+         MarkPerfPhase("init");
+      });
+      CutFlow *cutFlow = cutFlows.empty() ? nullptr : &cutFlows[slot];
+      {
+         CutFlowRAII stage(cutFlow, kStageIsMuon);
+         if (!stage.Pass(!h1IsMuon && !h2IsMuon && !h3IsMuon))
+            return false;
+      }
+      constexpr double prob_k_cut = 0.5;
+      {
+         CutFlowRAII stage(cutFlow, kStageProbK);
+         if (!stage.Pass((h1ProbK > prob_k_cut) && (h2ProbK > prob_k_cut) && (h3ProbK > prob_k_cut)))
+            return false;
+      }
+      constexpr double prob_pi_cut = 0.5;
+      CutFlowRAII stage(cutFlow, kStageProbPi);
+      return stage.Pass((h1ProbPi < prob_pi_cut) && (h2ProbPi < prob_pi_cut) && (h3ProbPi < prob_pi_cut));
+   };
+   auto fn_mass = [](double h1PX, double h1PY, double h1PZ, double h2PX, double h2PY, double h2PZ,
+                     double h3PX, double h3PY, double h3PZ)
+   {
+      return kinematics::ThreeBodyMass(h1PX, h1PY, h1PZ, h2PX, h2PY, h2PZ, h3PX, h3PY, h3PZ, kKaonMassMeV);
+   };
+
+   auto df_mass = frame.Filter(fn_cuts, {"rdfslot_", "H1_isMuon", "H2_isMuon", "H3_isMuon",
+                                         "H1_ProbK", "H2_ProbK", "H3_ProbK", "H1_ProbPi", "H2_ProbPi", "H3_ProbPi"})
+                       .Define("B_m", CutFlowDefine(cutFlows, kStageKinematics, fn_mass),
+                               {"rdfslot_", "H1_PX", "H1_PY", "H1_PZ", "H2_PX", "H2_PY", "H2_PZ",
+                                "H3_PX", "H3_PY", "H3_PZ"});
+   auto hMass = df_mass.Histo1D<double>({"B_mass", "", 500, 5050, 5500}, "B_m");
+   // Only booked for the JSON summary
+   ROOT::RDF::RResultPtr<ULong64_t> nEvents;
+   if (g_json)
+      nEvents = frame.Count();
+
+   *hMass;
+   auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
+   auto runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
+   auto runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   if (nEvents)
+      g_results.events_read = *nEvents;
+   g_results.events_selected = hMass->GetEntries();
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
+
+   if (g_show)
+      Show(hMass.GetPtr());
+}
 
-   auto file = OpenOrDownload(path);
-   auto tree = file->Get<TTree>("DecayTree");
-   TTreePerfStats *ps = nullptr;
-   if (g_perf_stats)
-      ps = new TTreePerfStats("ioperf", tree);
 
+static void ProcessTreeRange(TTree *tree, const EntryRange &range, TH1D *hMass, CutFlow *cutFlow) {
    TBranch *br_h1_px = nullptr;
    TBranch *br_h1_py = nullptr;
    TBranch *br_h1_pz = nullptr;
@@ -199,11 +329,10 @@ static void TreeDirect(const std::string &path) {
    tree->SetBranchAddress("H3_ProbPi", &h3_prob_pi, &br_h3_prob_pi);
    tree->SetBranchAddress("H3_isMuon", &h3_is_muon, &br_h3_is_muon);
 
-   auto hMass = new TH1D("B_mass", "", 500, 5050, 5500);
-
-   auto nEntries = tree->GetEntries();
-   std::chrono::steady_clock::time_point ts_first = std::chrono::steady_clock::now();
-   for (decltype(nEntries) entryId = 0; entryId < nEntries; ++entryId) {
+   tree->SetCacheEntryRange(range.first, range.second);
+   TimelineLoop loop(range.first, range.second, [&] { return GetClusterStarts(tree); });
+   for (Long64_t entryId = range.first; entryId < Long64_t(range.second); ++entryId) {
+      loop.Next(entryId);
       if ((entryId % 100000) == 0) {
          printf("processed %llu k events\n", entryId / 1000);
          //printf("dummy is %lf\n", dummy); abort();
@@ -211,29 +340,43 @@ static void TreeDirect(const std::string &path) {
 
       tree->LoadTree(entryId);
 
-      br_h1_is_muon->GetEntry(entryId);
-      if (h1_is_muon) continue;
-      br_h2_is_muon->GetEntry(entryId);
-      if (h2_is_muon) continue;
-      br_h3_is_muon->GetEntry(entryId);
-      if (h3_is_muon) continue;
+      {
+         CutFlowRAII stage(cutFlow, kStageIsMuon);
+         br_h1_is_muon->GetEntry(entryId);
+         if (h1_is_muon) continue;
+         br_h2_is_muon->GetEntry(entryId);
+         if (h2_is_muon) continue;
+         br_h3_is_muon->GetEntry(entryId);
+         if (h3_is_muon) continue;
+         stage.Pass(true);
+      }
 
-      constexpr double prob_k_cut = 0.5;
-      br_h1_prob_k->GetEntry(entryId);
-      if (h1_prob_k < prob_k_cut) continue;
-      br_h2_prob_k->GetEntry(entryId);
-      if (h2_prob_k < prob_k_cut) continue;
-      br_h3_prob_k->GetEntry(entryId);
-      if (h3_prob_k < prob_k_cut) continue;
+      {
+         CutFlowRAII stage(cutFlow, kStageProbK);
+         constexpr double prob_k_cut = 0.5;
+         br_h1_prob_k->GetEntry(entryId);
+         if (h1_prob_k < prob_k_cut) continue;
+         br_h2_prob_k->GetEntry(entryId);
+         if (h2_prob_k < prob_k_cut) continue;
+         br_h3_prob_k->GetEntry(entryId);
+         if (h3_prob_k < prob_k_cut) continue;
+         stage.Pass(true);
+      }
 
-      constexpr double prob_pi_cut = 0.5;
-      br_h1_prob_pi->GetEntry(entryId);
-      if (h1_prob_pi > prob_pi_cut) continue;
-      br_h2_prob_pi->GetEntry(entryId);
-      if (h2_prob_pi > prob_pi_cut) continue;
-      br_h3_prob_pi->GetEntry(entryId);
-      if (h3_prob_pi > prob_pi_cut) continue;
+      {
+         CutFlowRAII stage(cutFlow, kStageProbPi);
+         constexpr double prob_pi_cut = 0.5;
+         br_h1_prob_pi->GetEntry(entryId);
+         if (h1_prob_pi > prob_pi_cut) continue;
+         br_h2_prob_pi->GetEntry(entryId);
+         if (h2_prob_pi > prob_pi_cut) continue;
+         br_h3_prob_pi->GetEntry(entryId);
+         if (h3_prob_pi > prob_pi_cut) continue;
+         stage.Pass(true);
+      }
 
+      CutFlowRAII stage(cutFlow, kStageKinematics);
+      stage.Pass(true);
       br_h1_px->GetEntry(entryId);
       br_h1_py->GetEntry(entryId);
       br_h1_pz->GetEntry(entryId);
@@ -244,29 +387,159 @@ static void TreeDirect(const std::string &path) {
       br_h3_py->GetEntry(entryId);
       br_h3_pz->GetEntry(entryId);
 
-      double b_px = h1_px + h2_px + h3_px;
-      double b_py = h1_py + h2_py + h3_py;
-      double b_pz = h1_pz + h2_pz + h3_pz;
-      double b_p2 = GetP2(b_px, b_py, b_pz);
-      double k1_E = GetKE(h1_px, h1_py, h1_pz);
-      double k2_E = GetKE(h2_px, h2_py, h2_pz);
-      double k3_E = GetKE(h3_px, h3_py, h3_pz);
-      double b_E = k1_E + k2_E + k3_E;
-      double b_mass = sqrt(b_E*b_E - b_p2);
+      double b_mass = kinematics::ThreeBodyMass(h1_px, h1_py, h1_pz, h2_px, h2_py, h2_pz, h3_px, h3_py, h3_pz,
+                                                kKaonMassMeV);
       hMass->Fill(b_mass);
 
       //printf("BMASS %lf\n", b_mass);
    }
+}
+
+
+/// Bulk flavour of ProcessTreeRange: all branches are fixed-size, so they are read basket by basket.  The cuts
+/// are evaluated branch-free over the window of entries for which all branches have their basket loaded.
+static void ProcessTreeBulkRange(TTree *tree, const EntryRange &range, TH1D *hMass) {
+   TreeBulkBranch<double> h1_px(tree, "H1_PX");
+   TreeBulkBranch<double> h1_py(tree, "H1_PY");
+   TreeBulkBranch<double> h1_pz(tree, "H1_PZ");
+   TreeBulkBranch<double> h1_prob_k(tree, "H1_ProbK");
+   TreeBulkBranch<double> h1_prob_pi(tree, "H1_ProbPi");
+   TreeBulkBranch<int> h1_is_muon(tree, "H1_isMuon");
+   TreeBulkBranch<double> h2_px(tree, "H2_PX");
+   TreeBulkBranch<double> h2_py(tree, "H2_PY");
+   TreeBulkBranch<double> h2_pz(tree, "H2_PZ");
+   TreeBulkBranch<double> h2_prob_k(tree, "H2_ProbK");
+   TreeBulkBranch<double> h2_prob_pi(tree, "H2_ProbPi");
+   TreeBulkBranch<int> h2_is_muon(tree, "H2_isMuon");
+   TreeBulkBranch<double> h3_px(tree, "H3_PX");
+   TreeBulkBranch<double> h3_py(tree, "H3_PY");
+   TreeBulkBranch<double> h3_pz(tree, "H3_PZ");
+   TreeBulkBranch<double> h3_prob_k(tree, "H3_ProbK");
+   TreeBulkBranch<double> h3_prob_pi(tree, "H3_ProbPi");
+   TreeBulkBranch<int> h3_is_muon(tree, "H3_isMuon");
+
+   std::vector<unsigned char> pass;
+   std::vector<double> bMass;
+
+   tree->SetCacheEntryRange(range.first, range.second);
+   Long64_t lastReport = range.first;
+   TimelineLoop loop(range.first, range.second, [&] { return GetClusterStarts(tree); });
+   for (Long64_t entryId = range.first; entryId < Long64_t(range.second); ) {
+      loop.Next(entryId);
+      if (entryId - lastReport >= 100000) {
+         printf("processed %llu k events\n", entryId / 1000);
+         lastReport = entryId;
+      }
+
+      auto windowEnd = std::min<Long64_t>({Long64_t(range.second),
+         h1_px.Load(entryId), h1_py.Load(entryId), h1_pz.Load(entryId),
+         h1_prob_k.Load(entryId), h1_prob_pi.Load(entryId), h1_is_muon.Load(entryId),
+         h2_px.Load(entryId), h2_py.Load(entryId), h2_pz.Load(entryId),
+         h2_prob_k.Load(entryId), h2_prob_pi.Load(entryId), h2_is_muon.Load(entryId),
+         h3_px.Load(entryId), h3_py.Load(entryId), h3_pz.Load(entryId),
+         h3_prob_k.Load(entryId), h3_prob_pi.Load(entryId), h3_is_muon.Load(entryId)});
+      const std::size_t n = windowEnd - entryId;
+
+      const int *isMuon1 = h1_is_muon.Get(entryId);
+      const int *isMuon2 = h2_is_muon.Get(entryId);
+      const int *isMuon3 = h3_is_muon.Get(entryId);
+      const double *probK1 = h1_prob_k.Get(entryId);
+      const double *probK2 = h2_prob_k.Get(entryId);
+      const double *probK3 = h3_prob_k.Get(entryId);
+      const double *probPi1 = h1_prob_pi.Get(entryId);
+      const double *probPi2 = h2_prob_pi.Get(entryId);
+      const double *probPi3 = h3_prob_pi.Get(entryId);
+
+      constexpr double prob_k_cut = 0.5;
+      constexpr double prob_pi_cut = 0.5;
+      pass.resize(n);
+      for (std::size_t j = 0; j < n; ++j) {
+         pass[j] = (isMuon1[j] == 0) & (isMuon2[j] == 0) & (isMuon3[j] == 0) &
+                   (probK1[j] >= prob_k_cut) & (probK2[j] >= prob_k_cut) & (probK3[j] >= prob_k_cut) &
+                   (probPi1[j] <= prob_pi_cut) & (probPi2[j] <= prob_pi_cut) & (probPi3[j] <= prob_pi_cut);
+      }
+
+      kinematics::ThreeBodyColumns kaons{{h1_px.Get(entryId), h2_px.Get(entryId), h3_px.Get(entryId)},
+                                         {h1_py.Get(entryId), h2_py.Get(entryId), h3_py.Get(entryId)},
+                                         {h1_pz.Get(entryId), h2_pz.Get(entryId), h3_pz.Get(entryId)}};
+
+      // Dense data: computing the mass for all entries and compressing afterwards is cheaper than branching
+      bMass.resize(n);
+      kinematics::ThreeBodyMassBatch(kaons, kKaonMassMeV, bMass.data(), n);
+      std::size_t nSel = 0;
+      for (std::size_t j = 0; j < n; ++j) {
+         bMass[nSel] = bMass[j];
+         nSel += pass[j];
+      }
+      hMass->FillN(nSel, bMass.data(), nullptr);
+
+      entryId = windowEnd;
+   }
+}
+
+
+static void TreeDirect(const std::string &path) {
+   auto ts_init = std::chrono::steady_clock::now();
+
+   auto file = OpenOrDownload(path);
+   auto tree = file->Get<TTree>("DecayTree");
+   TTreePerfStats *ps = nullptr;
+   if (g_perf_stats || g_hw_counters)
+      ps = new TTreePerfStats("ioperf", tree);
+
+   auto hMass = new TH1D("B_mass", "", 500, 5050, 5500);
+
+   // One file, tree, and partial histogram per thread; the first worker uses the main tree and histogram
+   auto ranges = PartitionEntries(GetClusterStarts(tree), tree->GetEntries(), g_n_threads);
+   std::vector<TFile *> files{file};
+   std::vector<TTree *> trees{tree};
+   std::vector<TTreePerfStats *> perfStats{ps};
+   std::vector<TH1D *> partials{hMass};
+   for (unsigned i = 1; i < ranges.size(); ++i) {
+      files.emplace_back(OpenOrDownload(path));
+      trees.emplace_back(files.back()->Get<TTree>("DecayTree"));
+      if (ps)
+         perfStats.emplace_back(new TTreePerfStats("ioperf", trees.back()));
+      partials.emplace_back(static_cast<TH1D *>(hMass->Clone()));
+      partials.back()->SetDirectory(nullptr);
+   }
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < ranges.size(); ++i) {
+      cutFlows.emplace_back(kCutFlowStages);
+      cutFlows.back().SetBytesCounter(GetTreeBytesCounter(files[i]));
+   }
+
+   std::chrono::steady_clock::time_point ts_first = std::chrono::steady_clock::now();
+   MarkPerfPhase("init");
+   RunInThreads(ranges.size(), [&](unsigned i) {
+      if (g_bulk)
+         ProcessTreeBulkRange(trees[i], ranges[i], partials[i]);
+      else
+         ProcessTreeRange(trees[i], ranges[i], partials[i], g_cutflow ? &cutFlows[i] : nullptr);
+   });
+   for (unsigned i = 1; i < partials.size(); ++i) {
+      hMass->Add(partials[i]);
+      delete partials[i];
+   }
 
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
    auto runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
    auto runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
 
-   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
-   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   g_results.events_read = tree->GetEntries();
+   g_results.events_selected = hMass->GetEntries();
 
-   if (g_perf_stats)
-      ps->Print();
+   if (g_perf_stats) {
+      for (auto p : perfStats)
+         p->Print();
+   }
+   if (g_perf_stats || g_hw_counters) {
+      for (auto p : perfStats)
+         AddTreePerfStats(p, &g_results);
+   }
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
    if (g_show) {
       Show(hMass);
    }
@@ -275,89 +548,366 @@ static void TreeDirect(const std::string &path) {
 }
 
 
-static void NTupleDirect(const std::string &path)
+static void ProcessNTupleRange(ROOT::Experimental::RNTupleReader &ntuple, const EntryRange &range, TH1D *hMass,
+                               CutFlow *cutFlow)
 {
-   using RNTupleReader = ROOT::Experimental::RNTupleReader;
-   using RNTupleModel = ROOT::Experimental::RNTupleModel;
+   auto viewH1IsMuon = ntuple.GetView<int>("H1_isMuon");
+   auto viewH2IsMuon = ntuple.GetView<int>("H2_isMuon");
+   auto viewH3IsMuon = ntuple.GetView<int>("H3_isMuon");
+
+   auto viewH1PX = ntuple.GetView<double>("H1_PX");
+   auto viewH1PY = ntuple.GetView<double>("H1_PY");
+   auto viewH1PZ = ntuple.GetView<double>("H1_PZ");
+   auto viewH1ProbK = ntuple.GetView<double>("H1_ProbK");
+   auto viewH1ProbPi = ntuple.GetView<double>("H1_ProbPi");
+
+   auto viewH2PX = ntuple.GetView<double>("H2_PX");
+   auto viewH2PY = ntuple.GetView<double>("H2_PY");
+   auto viewH2PZ = ntuple.GetView<double>("H2_PZ");
+   auto viewH2ProbK = ntuple.GetView<double>("H2_ProbK");
+   auto viewH2ProbPi = ntuple.GetView<double>("H2_ProbPi");
+
+   auto viewH3PX = ntuple.GetView<double>("H3_PX");
+   auto viewH3PY = ntuple.GetView<double>("H3_PY");
+   auto viewH3PZ = ntuple.GetView<double>("H3_PZ");
+   auto viewH3ProbK = ntuple.GetView<double>("H3_ProbK");
+   auto viewH3ProbPi = ntuple.GetView<double>("H3_ProbPi");
 
-   // Trigger download if needed.
-   delete OpenOrDownload(path);
+   unsigned nevents = 0;
+   TimelineLoop loop(range.first, range.second, [&] { return GetClusterStarts(ntuple.GetDescriptor()); });
+   for (auto i : ROOT::Experimental::RNTupleGlobalRange(range.first, range.second)) {
+      loop.Next(i);
+      nevents++;
+      if ((nevents % 100000) == 0) {
+         printf("processed %u k events\n", nevents / 1000);
+         //printf("dummy is %lf\n", dummy); abort();
+      }
 
-   auto ts_init = std::chrono::steady_clock::now();
+      {
+         CutFlowRAII stage(cutFlow, kStageIsMuon);
+         if (!stage.Pass(!viewH1IsMuon(i) && !viewH2IsMuon(i) && !viewH3IsMuon(i)))
+            continue;
+      }
 
-   auto model = RNTupleModel::Create();
-   auto options = GetRNTupleOptions();
-   auto ntuple = RNTupleReader::Open(std::move(model), "DecayTree", path, options);
-   if (g_perf_stats)
-      ntuple->EnableMetrics();
+      {
+         CutFlowRAII stage(cutFlow, kStageProbK);
+         constexpr double prob_k_cut = 0.5;
+         if (viewH1ProbK(i) < prob_k_cut) continue;
+         if (viewH2ProbK(i) < prob_k_cut) continue;
+         if (viewH3ProbK(i) < prob_k_cut) continue;
+         stage.Pass(true);
+      }
 
-   auto viewH1IsMuon = ntuple->GetView<int>("H1_isMuon");
-   auto viewH2IsMuon = ntuple->GetView<int>("H2_isMuon");
-   auto viewH3IsMuon = ntuple->GetView<int>("H3_isMuon");
+      {
+         CutFlowRAII stage(cutFlow, kStageProbPi);
+         constexpr double prob_pi_cut = 0.5;
+         if (viewH1ProbPi(i) > prob_pi_cut) continue;
+         if (viewH2ProbPi(i) > prob_pi_cut) continue;
+         if (viewH3ProbPi(i) > prob_pi_cut) continue;
+         stage.Pass(true);
+      }
 
-   auto viewH1PX = ntuple->GetView<double>("H1_PX");
-   auto viewH1PY = ntuple->GetView<double>("H1_PY");
-   auto viewH1PZ = ntuple->GetView<double>("H1_PZ");
-   auto viewH1ProbK = ntuple->GetView<double>("H1_ProbK");
-   auto viewH1ProbPi = ntuple->GetView<double>("H1_ProbPi");
+      CutFlowRAII stage(cutFlow, kStageKinematics);
+      stage.Pass(true);
+      double b_mass = kinematics::ThreeBodyMass(viewH1PX(i), viewH1PY(i), viewH1PZ(i),
+                                                viewH2PX(i), viewH2PY(i), viewH2PZ(i),
+                                                viewH3PX(i), viewH3PY(i), viewH3PZ(i), kKaonMassMeV);
+      hMass->Fill(b_mass);
+   }
+}
 
-   auto viewH2PX = ntuple->GetView<double>("H2_PX");
-   auto viewH2PY = ntuple->GetView<double>("H2_PY");
-   auto viewH2PZ = ntuple->GetView<double>("H2_PZ");
-   auto viewH2ProbK = ntuple->GetView<double>("H2_ProbK");
-   auto viewH2ProbPi = ntuple->GetView<double>("H2_ProbPi");
 
-   auto viewH3PX = ntuple->GetView<double>("H3_PX");
-   auto viewH3PY = ntuple->GetView<double>("H3_PY");
-   auto viewH3PZ = ntuple->GetView<double>("H3_PZ");
-   auto viewH3ProbK = ntuple->GetView<double>("H3_ProbK");
-   auto viewH3ProbPi = ntuple->GetView<double>("H3_ProbPi");
+/// Bulk flavour of ProcessNTupleRange: reads the columns cluster by cluster into contiguous arrays, evaluates
+/// the particle ID cuts as a branch-free mask, and computes the B mass in one batch for clusters with survivors.
+static void ProcessNTupleBulkRange(ROOT::Experimental::RNTupleReader &ntuple, const EntryRange &range, TH1D *hMass)
+{
+   using RClusterIndex = ROOT::Experimental::RClusterIndex;
+
+   const auto &model = ntuple.GetModel();
+   auto bulkH1IsMuon = model.CreateBulk("H1_isMuon");
+   auto bulkH2IsMuon = model.CreateBulk("H2_isMuon");
+   auto bulkH3IsMuon = model.CreateBulk("H3_isMuon");
+
+   auto bulkH1PX = model.CreateBulk("H1_PX");
+   auto bulkH1PY = model.CreateBulk("H1_PY");
+   auto bulkH1PZ = model.CreateBulk("H1_PZ");
+   auto bulkH1ProbK = model.CreateBulk("H1_ProbK");
+   auto bulkH1ProbPi = model.CreateBulk("H1_ProbPi");
+
+   auto bulkH2PX = model.CreateBulk("H2_PX");
+   auto bulkH2PY = model.CreateBulk("H2_PY");
+   auto bulkH2PZ = model.CreateBulk("H2_PZ");
+   auto bulkH2ProbK = model.CreateBulk("H2_ProbK");
+   auto bulkH2ProbPi = model.CreateBulk("H2_ProbPi");
+
+   auto bulkH3PX = model.CreateBulk("H3_PX");
+   auto bulkH3PY = model.CreateBulk("H3_PY");
+   auto bulkH3PZ = model.CreateBulk("H3_PZ");
+   auto bulkH3ProbK = model.CreateBulk("H3_ProbK");
+   auto bulkH3ProbPi = model.CreateBulk("H3_ProbPi");
+
+   // The ranges are cluster aligned, so every cluster is either fully inside or fully outside of the range
+   std::vector<std::pair<ROOT::Experimental::DescriptorId_t, std::size_t>> clusters;
+   for (const auto &cluster : ntuple.GetDescriptor().GetClusterIterable()) {
+      if (cluster.GetFirstEntryIndex() < range.first || cluster.GetFirstEntryIndex() >= range.second)
+         continue;
+      clusters.emplace_back(cluster.GetId(), cluster.GetNEntries());
+   }
 
-   auto hMass = new TH1D("B_mass", "", 500, 5050, 5500);
+   std::unique_ptr<bool[]> maskAll;
+   std::unique_ptr<unsigned char[]> pass;
+   std::unique_ptr<double[]> bMass;
+   std::size_t capacity = 0;
 
    unsigned nevents = 0;
-   std::chrono::steady_clock::time_point ts_first = std::chrono::steady_clock::now();
-   for (auto i : ntuple->GetEntryRange()) {
-      nevents++;
-      if ((nevents % 100000) == 0) {
-         printf("processed %u k events\n", nevents / 1000);
-         //printf("dummy is %lf\n", dummy); abort();
+   for (const auto &[clusterId, n] : clusters) {
+      TimelineScope chunk(TimelineCategory::kLoop,
+                          ntuple.GetDescriptor().GetClusterDescriptor(clusterId).GetFirstEntryIndex(), n);
+      if (n > capacity) {
+         capacity = n;
+         maskAll = std::make_unique<bool[]>(capacity);
+         pass = std::make_unique<unsigned char[]>(capacity);
+         bMass = std::make_unique<double[]>(capacity);
+         std::fill(maskAll.get(), maskAll.get() + capacity, true);
       }
-
-      if (viewH1IsMuon(i) || viewH2IsMuon(i) || viewH3IsMuon(i)) {
+      const RClusterIndex first(clusterId, 0);
+      // Every 100k events, like the entry loop
+      if ((nevents + n) / 100000 != nevents / 100000)
+         printf("processed %u k events\n", static_cast<unsigned>((nevents + n) / 1000));
+      nevents += n;
+
+      auto h1IsMuon = static_cast<const int *>(bulkH1IsMuon.ReadBulk(first, maskAll.get(), n));
+      auto h2IsMuon = static_cast<const int *>(bulkH2IsMuon.ReadBulk(first, maskAll.get(), n));
+      auto h3IsMuon = static_cast<const int *>(bulkH3IsMuon.ReadBulk(first, maskAll.get(), n));
+      auto h1ProbK = static_cast<const double *>(bulkH1ProbK.ReadBulk(first, maskAll.get(), n));
+      auto h2ProbK = static_cast<const double *>(bulkH2ProbK.ReadBulk(first, maskAll.get(), n));
+      auto h3ProbK = static_cast<const double *>(bulkH3ProbK.ReadBulk(first, maskAll.get(), n));
+      auto h1ProbPi = static_cast<const double *>(bulkH1ProbPi.ReadBulk(first, maskAll.get(), n));
+      auto h2ProbPi = static_cast<const double *>(bulkH2ProbPi.ReadBulk(first, maskAll.get(), n));
+      auto h3ProbPi = static_cast<const double *>(bulkH3ProbPi.ReadBulk(first, maskAll.get(), n));
+
+      // Same cuts as in ProcessNTupleRange, evaluated without branches so that the loop vectorizes
+      constexpr double prob_k_cut = 0.5;
+      constexpr double prob_pi_cut = 0.5;
+      for (std::size_t j = 0; j < n; ++j) {
+         pass[j] = (h1IsMuon[j] == 0) & (h2IsMuon[j] == 0) & (h3IsMuon[j] == 0) &
+                   (h1ProbK[j] >= prob_k_cut) & (h2ProbK[j] >= prob_k_cut) & (h3ProbK[j] >= prob_k_cut) &
+                   (h1ProbPi[j] <= prob_pi_cut) & (h2ProbPi[j] <= prob_pi_cut) & (h3ProbPi[j] <= prob_pi_cut);
+      }
+      std::size_t nSel = 0;
+      for (std::size_t j = 0; j < n; ++j)
+         nSel += pass[j];
+      if (nSel == 0)
          continue;
+
+      // Dense data: computing the mass for all entries and compressing afterwards is cheaper than branching
+      auto readMomentum = [&](ROOT::Experimental::RFieldBase::RBulk &bulk) {
+         return static_cast<const double *>(bulk.ReadBulk(first, maskAll.get(), n));
+      };
+      kinematics::ThreeBodyColumns kaons{{readMomentum(bulkH1PX), readMomentum(bulkH2PX), readMomentum(bulkH3PX)},
+                                         {readMomentum(bulkH1PY), readMomentum(bulkH2PY), readMomentum(bulkH3PY)},
+                                         {readMomentum(bulkH1PZ), readMomentum(bulkH2PZ), readMomentum(bulkH3PZ)}};
+      kinematics::ThreeBodyMassBatch(kaons, kKaonMassMeV, bMass.get(), n);
+      nSel = 0;
+      for (std::size_t j = 0; j < n; ++j) {
+         bMass[nSel] = bMass[j];
+         nSel += pass[j];
       }
+      hMass->FillN(nSel, bMass.get(), nullptr);
+   }
+}
 
-      constexpr double prob_k_cut = 0.5;
-      if (viewH1ProbK(i) < prob_k_cut) continue;
-      if (viewH2ProbK(i) < prob_k_cut) continue;
-      if (viewH3ProbK(i) < prob_k_cut) continue;
 
+/// Page span flavour of ProcessNTupleRange: iterates over the windows of entries for which all columns have their
+/// page mapped and evaluates the cuts and the B mass on the page buffers, like the bulk flavour.
+static void ProcessNTupleSpanRange(ROOT::Experimental::Internal::RPageSource &source, const EntryRange &range,
+                                   TH1D *hMass)
+{
+   NTuplePageSpans<int> pagesH1IsMuon(source, "H1_isMuon");
+   NTuplePageSpans<int> pagesH2IsMuon(source, "H2_isMuon");
+   NTuplePageSpans<int> pagesH3IsMuon(source, "H3_isMuon");
+
+   NTuplePageSpans<double> pagesH1PX(source, "H1_PX");
+   NTuplePageSpans<double> pagesH1PY(source, "H1_PY");
+   NTuplePageSpans<double> pagesH1PZ(source, "H1_PZ");
+   NTuplePageSpans<double> pagesH1ProbK(source, "H1_ProbK");
+   NTuplePageSpans<double> pagesH1ProbPi(source, "H1_ProbPi");
+
+   NTuplePageSpans<double> pagesH2PX(source, "H2_PX");
+   NTuplePageSpans<double> pagesH2PY(source, "H2_PY");
+   NTuplePageSpans<double> pagesH2PZ(source, "H2_PZ");
+   NTuplePageSpans<double> pagesH2ProbK(source, "H2_ProbK");
+   NTuplePageSpans<double> pagesH2ProbPi(source, "H2_ProbPi");
+
+   NTuplePageSpans<double> pagesH3PX(source, "H3_PX");
+   NTuplePageSpans<double> pagesH3PY(source, "H3_PY");
+   NTuplePageSpans<double> pagesH3PZ(source, "H3_PZ");
+   NTuplePageSpans<double> pagesH3ProbK(source, "H3_ProbK");
+   NTuplePageSpans<double> pagesH3ProbPi(source, "H3_ProbPi");
+
+   const NTuplePageTable *allPages[] = {&pagesH1IsMuon, &pagesH2IsMuon, &pagesH3IsMuon,
+                                        &pagesH1PX, &pagesH1PY, &pagesH1PZ, &pagesH1ProbK, &pagesH1ProbPi,
+                                        &pagesH2PX, &pagesH2PY, &pagesH2PZ, &pagesH2ProbK, &pagesH2ProbPi,
+                                        &pagesH3PX, &pagesH3PY, &pagesH3PZ, &pagesH3ProbK, &pagesH3ProbPi};
+   for (auto pages : allPages)
+      pages->WarnIfNotPlainCopy();
+
+   std::vector<unsigned char> pass;
+   std::vector<double> bMass;
+
+   std::uint64_t lastReport = range.first;
+   TimelineLoop loop(range.first, range.second,
+                     [&] { return GetClusterStarts(*source.GetSharedDescriptorGuard()); });
+   for (std::uint64_t entryId = range.first; entryId < range.second; ) {
+      loop.Next(entryId);
+      if (entryId - lastReport >= 100000) {
+         printf("processed %lu k events\n", entryId / 1000);
+         lastReport = entryId;
+      }
+
+      auto h1IsMuon = pagesH1IsMuon.Get(entryId);
+      auto h2IsMuon = pagesH2IsMuon.Get(entryId);
+      auto h3IsMuon = pagesH3IsMuon.Get(entryId);
+      auto h1ProbK = pagesH1ProbK.Get(entryId);
+      auto h2ProbK = pagesH2ProbK.Get(entryId);
+      auto h3ProbK = pagesH3ProbK.Get(entryId);
+      auto h1ProbPi = pagesH1ProbPi.Get(entryId);
+      auto h2ProbPi = pagesH2ProbPi.Get(entryId);
+      auto h3ProbPi = pagesH3ProbPi.Get(entryId);
+      auto h1PX = pagesH1PX.Get(entryId);
+      auto h1PY = pagesH1PY.Get(entryId);
+      auto h1PZ = pagesH1PZ.Get(entryId);
+      auto h2PX = pagesH2PX.Get(entryId);
+      auto h2PY = pagesH2PY.Get(entryId);
+      auto h2PZ = pagesH2PZ.Get(entryId);
+      auto h3PX = pagesH3PX.Get(entryId);
+      auto h3PY = pagesH3PY.Get(entryId);
+      auto h3PZ = pagesH3PZ.Get(entryId);
+      const std::size_t n = std::min({std::size_t(range.second - entryId),
+         h1IsMuon.size(), h2IsMuon.size(), h3IsMuon.size(),
+         h1ProbK.size(), h2ProbK.size(), h3ProbK.size(), h1ProbPi.size(), h2ProbPi.size(), h3ProbPi.size(),
+         h1PX.size(), h1PY.size(), h1PZ.size(), h2PX.size(), h2PY.size(), h2PZ.size(),
+         h3PX.size(), h3PY.size(), h3PZ.size()});
+
+      constexpr double prob_k_cut = 0.5;
       constexpr double prob_pi_cut = 0.5;
-      if (viewH1ProbPi(i) > prob_pi_cut) continue;
-      if (viewH2ProbPi(i) > prob_pi_cut) continue;
-      if (viewH3ProbPi(i) > prob_pi_cut) continue;
-
-      double b_px = viewH1PX(i) + viewH2PX(i) + viewH3PX(i);
-      double b_py = viewH1PY(i) + viewH2PY(i) + viewH3PY(i);
-      double b_pz = viewH1PZ(i) + viewH2PZ(i) + viewH3PZ(i);
-      double b_p2 = GetP2(b_px, b_py, b_pz);
-      double k1_E = GetKE(viewH1PX(i), viewH1PY(i), viewH1PZ(i));
-      double k2_E = GetKE(viewH2PX(i), viewH2PY(i), viewH2PZ(i));
-      double k3_E = GetKE(viewH3PX(i), viewH3PY(i), viewH3PZ(i));
-      double b_E = k1_E + k2_E + k3_E;
-      double b_mass = sqrt(b_E*b_E - b_p2);
-      hMass->Fill(b_mass);
+      pass.resize(n);
+      for (std::size_t j = 0; j < n; ++j) {
+         pass[j] = (h1IsMuon[j] == 0) & (h2IsMuon[j] == 0) & (h3IsMuon[j] == 0) &
+                   (h1ProbK[j] >= prob_k_cut) & (h2ProbK[j] >= prob_k_cut) & (h3ProbK[j] >= prob_k_cut) &
+                   (h1ProbPi[j] <= prob_pi_cut) & (h2ProbPi[j] <= prob_pi_cut) & (h3ProbPi[j] <= prob_pi_cut);
+      }
+
+      kinematics::ThreeBodyColumns kaons{{h1PX.data(), h2PX.data(), h3PX.data()},
+                                         {h1PY.data(), h2PY.data(), h3PY.data()},
+                                         {h1PZ.data(), h2PZ.data(), h3PZ.data()}};
+      bMass.resize(n);
+      kinematics::ThreeBodyMassBatch(kaons, kKaonMassMeV, bMass.data(), n);
+      std::size_t nSel = 0;
+      for (std::size_t j = 0; j < n; ++j) {
+         bMass[nSel] = bMass[j];
+         nSel += pass[j];
+      }
+      hMass->FillN(nSel, bMass.data(), nullptr);
+
+      entryId += n;
+   }
+}
+
+
+static void NTupleDirect(const std::string &path)
+{
+   using RNTupleReader = ROOT::Experimental::RNTupleReader;
+   using RNTupleModel = ROOT::Experimental::RNTupleModel;
+
+   // Trigger download if needed.
+   delete OpenOrDownload(path);
+
+   // With a memory budget, the options read the ntuple's footer for the average cluster size; not part of the
+   // timed initialization
+   auto options = GetRNTupleOptions("DecayTree", path);
+
+   auto ts_init = std::chrono::steady_clock::now();
+
+   std::unique_ptr<RNTupleReader> ntuple;
+   if (g_bulk) {
+      // The bulk reads need the fields in the reader's model, so use the full model from the descriptor
+      ntuple = OpenNTupleReader(nullptr, "DecayTree", path, options, g_io_engine);
+   } else {
+      auto model = RNTupleModel::Create();
+      ntuple = OpenNTupleReader(std::move(model), "DecayTree", path, options, g_io_engine);
+   }
+   // The cut flow takes the bytes read from the metrics
+   if (g_perf_stats || g_hw_counters || g_cutflow)
+      ntuple->EnableMetrics();
+
+   auto hMass = new TH1D("B_mass", "", 500, 5050, 5500);
+
+   // One reader and one partial histogram per thread; the first worker uses the main reader and histogram
+   auto ranges = PartitionEntries(GetClusterStarts(ntuple->GetDescriptor()), ntuple->GetNEntries(), g_n_threads);
+   std::vector<std::unique_ptr<RNTupleReader>> clones;
+   std::vector<RNTupleReader *> readers{ntuple.get()};
+   std::vector<TH1D *> partials{hMass};
+   for (unsigned i = 1; i < ranges.size(); ++i) {
+      if (!g_spans) {
+         clones.emplace_back(CloneNTupleReader(*ntuple, "DecayTree", path, options, g_io_engine));
+         if (g_perf_stats || g_hw_counters || g_cutflow)
+            clones.back()->EnableMetrics();
+         readers.emplace_back(clones.back().get());
+      }
+      partials.emplace_back(static_cast<TH1D *>(hMass->Clone()));
+      partials.back()->SetDirectory(nullptr);
+   }
+   // In span mode, the reader only provides the descriptor; the pages are mapped from one page source per thread
+   std::vector<std::unique_ptr<ROOT::Experimental::Internal::RPageSource>> sources;
+   for (unsigned i = 0; g_spans && i < ranges.size(); ++i) {
+      sources.emplace_back(OpenNTuplePageSource("DecayTree", path, options, g_io_engine));
+      sources.back()->Attach();
+      if (g_perf_stats || g_hw_counters)
+         sources.back()->GetMetrics().Enable();
+   }
+   std::vector<CutFlow> cutFlows;
+   for (unsigned i = 0; g_cutflow && i < ranges.size(); ++i) {
+      cutFlows.emplace_back(kCutFlowStages);
+      cutFlows.back().SetBytesCounter(GetNTupleBytesCounter(readers[i]->GetMetrics()));
+   }
+
+   std::chrono::steady_clock::time_point ts_first = std::chrono::steady_clock::now();
+   MarkPerfPhase("init");
+   RunInThreads(ranges.size(), [&](unsigned i) {
+      if (g_spans)
+         ProcessNTupleSpanRange(*sources[i], ranges[i], partials[i]);
+      else if (g_bulk)
+         ProcessNTupleBulkRange(*readers[i], ranges[i], partials[i]);
+      else
+         ProcessNTupleRange(*readers[i], ranges[i], partials[i], g_cutflow ? &cutFlows[i] : nullptr);
+   });
+   for (unsigned i = 1; i < partials.size(); ++i) {
+      hMass->Add(partials[i]);
+      delete partials[i];
    }
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("loop");
    auto runtime_init = std::chrono::duration_cast<std::chrono::microseconds>(ts_first - ts_init).count();
    auto runtime_analyze = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_first).count();
 
-   std::cout << "Runtime-Initialization: " << runtime_init << "us" << std::endl;
-   std::cout << "Runtime-Analysis: " << runtime_analyze << "us" << std::endl;
+   PrintRuntime(runtime_init, runtime_analyze, &g_results);
+   g_results.events_read = ntuple->GetNEntries();
+   g_results.events_selected = hMass->GetEntries();
 
-   if (g_perf_stats)
-      ntuple->PrintInfo(ROOT::Experimental::ENTupleInfo::kMetrics);
+   if (g_perf_stats) {
+      for (auto r : readers)
+         r->PrintInfo(ROOT::Experimental::ENTupleInfo::kMetrics);
+      for (const auto &s : sources)
+         s->GetMetrics().Print(std::cout);
+   }
+   if (g_perf_stats || g_hw_counters) {
+      for (auto r : readers)
+         AddNTupleMetrics(*r, &g_results);
+      for (const auto &s : sources)
+         AddNTupleMetrics(s->GetMetrics(), &g_results);
+   }
+   ReportCutFlows(cutFlows, g_json ? &g_results : nullptr);
    if (g_show)
       Show(hMass);
 
@@ -366,7 +916,12 @@ static void NTupleDirect(const std::string &path)
 
 
 static void Usage(const char *progname) {
-  printf("%s [-i input.root] [-r(df)] [-m(t)] [-p(erformance stats)] [-s(show)] [-x cluster bunch size]\n", progname);
+  printf("%s [-i input.root] [-r(df)] [-O (optimized RDF, implies -r)] [-m(t)] [-p(erformance stats)] [-s(show)]\n"
+         "   [-x cluster bunch size] [-j threads for the direct event loop] [-b(ulk reads)]\n"
+         "   [-z (page spans, for uncompressed ntuples)]
+         "   [-u unzip threads] [-M cluster cache memory budget in MB]\n"
+         "   [-e I/O engine: pread (default), uring, uring-direct, mmap] [-H(ardware counters)]\n"
+         "   [-f (cut flow profile)] [-T timeline.json] [--json]\n", progname);
 }
 
 
@@ -376,8 +931,10 @@ int main(int argc, char **argv) {
    std::string input_path;
    std::string input_suffix;
    bool use_rdf = false;
+   bool use_mt = false;
+   static const struct option long_options[] = {{"json", no_argument, nullptr, 'J'}, {nullptr, 0, nullptr, 0}};
    int c;
-   while ((c = getopt(argc, argv, "hvi:rpsmx:")) != -1) {
+   while ((c = getopt_long(argc, argv, "hvHi:rOpsmfx:j:bzu:M:e:T:", long_options, nullptr)) != -1) {
       switch (c) {
       case 'h':
       case 'v':
@@ -393,14 +950,55 @@ int main(int argc, char **argv) {
          g_show = true;
          break;
       case 'm':
-         ROOT::EnableImplicitMT();
+         use_mt = true;
          break;
       case 'r':
          use_rdf = true;
          break;
+      case 'O':
+         use_rdf = true;
+         g_rdf_optimized = true;
+         break;
       case 'x':
          g_cluster_bunch_size = atoi(optarg);
          break;
+      case 'u':
+         g_unzip_threads = atoi(optarg);
+         break;
+      case 'M':
+         g_memory_budget_mb = atoi(optarg);
+         break;
+      case 'e':
+         g_io_engine = GetIoEngine(optarg);
+         break;
+      case 'j': {
+         char *end;
+         long n = strtol(optarg, &end, 10);
+         if (*end != '\0' || n < 1) {
+            fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+            return 1;
+         }
+         g_n_threads = n;
+         break;
+      }
+      case 'b':
+         g_bulk = true;
+         break;
+      case 'z':
+         g_spans = true;
+         break;
+      case 'f':
+         g_cutflow = true;
+         break;
+      case 'J':
+         g_json = true;
+         break;
+      case 'H':
+         g_hw_counters = true;
+         break;
+      case 'T':
+         g_timeline_path = optarg;
+         break;
       default:
          fprintf(stderr, "Unknown option: -%c\n", c);
          Usage(argv[0]);
@@ -411,13 +1009,43 @@ int main(int argc, char **argv) {
       Usage(argv[0]);
       return 1;
    }
+   if (g_hw_counters)
+      StartPerfCounters();
+   if (!g_timeline_path.empty())
+      StartTimeline();
+   if (g_n_threads > 1)
+      ROOT::EnableThreadSafety();
+   // Without -m, the unzip threads turn on implicit multi-threading only for the direct RNTuple event loop: it would
+   // also run the RDF event loop in parallel and read the tree branches in parallel
+   if (g_unzip_threads > 0 && !use_mt && (use_rdf || GetFileFormat(GetSuffix(input_path)) != FileFormats::kNtuple)) {
+      fprintf(stderr, "Without -m, the unzip threads (-u) only apply to the direct RNTuple event loop\n");
+      return 1;
+   }
+   if (g_unzip_threads > 0)
+      ROOT::EnableImplicitMT(g_unzip_threads);
+   else if (use_mt)
+      ROOT::EnableImplicitMT();
+   g_unzip_threads_only_mt = (g_unzip_threads > 0) && !use_mt;
+   if (g_cutflow && !use_rdf && (g_bulk || g_spans)) {
+      fprintf(stderr, "The cut flow profile (-f) does not cover the bulk reads (-b) and page spans (-z)\n");
+      return 1;
+   }
 
    auto suffix = GetSuffix(input_path);
+   g_results.analysis = "lhcb";
+   g_results.input = input_path;
+   if (use_rdf)
+      g_results.method = suffix + (g_rdf_optimized ? "+rdfopt" : "+rdf");
+   else
+      g_results.method = suffix + (g_spans ? "+spans" : (g_bulk ? "+bulk" : ""));
    switch (GetFileFormat(suffix)) {
    case FileFormats::kRoot:
       if (use_rdf) {
          ROOT::RDataFrame df("DecayTree", input_path);
-         Dataframe(df);
+         if (g_rdf_optimized)
+            DataframeOptimized(df);
+         else
+            Dataframe(df);
       } else {
          TreeDirect(input_path);
       }
@@ -425,7 +1053,10 @@ int main(int argc, char **argv) {
    case FileFormats::kNtuple:
       if (use_rdf) {
          ROOT::RDataFrame df("DecayTree", input_path);
-         Dataframe(df);
+         if (g_rdf_optimized)
+            DataframeOptimized(df);
+         else
+            Dataframe(df);
       } else {
          NTupleDirect(input_path);
       }
@@ -436,8 +1067,19 @@ int main(int argc, char **argv) {
    }
 
    auto ts_end = std::chrono::steady_clock::now();
+   MarkPerfPhase("finish");
    auto runtime_main = std::chrono::duration_cast<std::chrono::microseconds>(ts_end - ts_init).count();
    std::cout << "Runtime-Main: " << runtime_main << "us" << std::endl;
+   PrintPerfCounters(g_results);
+   if (!g_timeline_path.empty())
+      WriteTimeline(g_timeline_path);
+   if (g_json) {
+      if (GetFileFormat(suffix) == FileFormats::kRoot)
+         g_results.bytes_read = TFile::GetFileBytesRead();
+      g_results.runtime_main_us = runtime_main;
+      AddPerfCounters(&g_results);
+      std::cout << GetResultsJson(g_results) << std::endl;
+   }
 
    return 0;
 }
@@ -5,25 +5,479 @@
   Accepts one or more ROOT input files containing one or more RNTuples and outputs one file with
   all the RNTuples merged with possibly changed compression algorithm and level.
 
+  With -j <threads>, the RNTupleMerger is replaced by a pipeline that reads the sealed pages cluster by
+  cluster, decompresses and recompresses them on a pool of worker threads, and writes the clusters in
+  their original order through a reorder buffer.  The sequence of pages and clusters committed to the sink
+  is the one of the merger, so the output does not depend on the number of threads; `make check-recompress`
+  compares the ntuple written with -j to the one written by the merger.
+
+  The output is written to <ntuple_file_out>.tmp, which is renamed to <ntuple_file_out> on success and removed
+  on failure.
+
+  With -p <plan>, the compression settings are chosen per column from a plan file as written by ntuple_zipplan:
+  one line per column with the column name, e.g. `jets.pt[0]`, followed by the compression settings.  Columns
+  that are not in the plan use the compression settings given on the command line.  Implies -j 1.
+
   @author Giacomo Parolini, 2024
 */
+#include <ROOT/RColumnElementBase.hxx>
 #include <ROOT/RLogger.hxx>
 #include <ROOT/RNTupleReader.hxx>
 #include <ROOT/RNTupleMerger.hxx>
+#include <ROOT/RNTupleZip.hxx>
 #include <ROOT/RPageStorageFile.hxx>
 #include <TFile.h>
 #include <TROOT.h>
 #include <ROOT/RNTupleWriteOptions.hxx>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 using namespace ROOT::Experimental;
 using namespace ROOT::Experimental::Internal;
 using namespace std::chrono;
 
+namespace {
+
+/// A column of the output ntuple; the input columns are matched to the output columns by field path, column index,
+/// and type
+struct ColumnInfo {
+  std::string fName;  ///< Qualified field name and column index, e.g. `jets.pt[0]`
+  DescriptorId_t fOutputId;
+  std::unique_ptr<RColumnElementBase> fElement;
+  int fCompSettings;
+};
+
+struct ColumnKey {
+  std::string fKey;  ///< Field path, column index, field type, and column type
+  std::string fName;
+  DescriptorId_t fPhysicalId;
+};
+
+struct PageTask {
+  std::size_t fColumn;  ///< Index into ClusterTask::fColumns
+  std::uint32_t fNElements;
+  std::uint32_t fInputSize;
+  std::unique_ptr<unsigned char[]> fInput;
+  /// Set by the worker if the page is recompressed; otherwise the input buffer is written as is
+  std::uint32_t fOutputSize = 0;
+  std::unique_ptr<unsigned char[]> fOutput;
+};
+
+struct ClusterTask {
+  std::uint64_t fSeqNo;
+  NTupleSize_t fNEntries;
+  /// Output column ids of the columns that have pages in this cluster, in output column order
+  std::vector<DescriptorId_t> fColumns;
+  std::vector<bool> fRecompress;
+  std::vector<PageTask> fPages;
+  std::size_t fNPagesLeft = 0;  ///< Protected by the pipeline lock
+};
+
+/// Byte and time counters of one pipeline stage; the time is summed over all threads working on the stage
+struct StageStats {
+  std::atomic<std::uint64_t> fBytes{0};
+  std::atomic<std::uint64_t> fNanoSecs{0};
+
+  void Add(std::uint64_t bytes, steady_clock::time_point start) {
+    fBytes += bytes;
+    fNanoSecs += duration_cast<nanoseconds>(steady_clock::now() - start).count();
+  }
+
+  void Print(const char *name) const {
+    const double mb = static_cast<double>(fBytes) / (1000. * 1000.);
+    const double s = static_cast<double>(fNanoSecs) / 1e9;
+    std::cout << "Recompress-" << name << ": " << mb << " MB in " << s << " s (" << ((s > 0) ? (mb / s) : 0)
+              << " MB/s)\n";
+  }
+};
+
+void AddColumnsFromField(const RNTupleDescriptor &desc, const RFieldDescriptor &fieldDesc, const std::string &prefix,
+                         std::vector<ColumnKey> &columns) {
+  for (const auto &field : desc.GetFieldIterable(fieldDesc)) {
+    const std::string name = prefix + field.GetFieldName() + ".";
+    for (const auto &column : desc.GetColumnIterable(field)) {
+      // The columns of projected fields are aliases of the columns of their source fields and have no pages
+      if (column.IsAliasColumn())
+        continue;
+      const auto type = static_cast<int>(column.GetModel().GetType());
+      // Not the type version: the fields of the sink carry the class versions of the dictionaries, which can be
+      // newer than the ones on disk
+      columns.emplace_back(ColumnKey{
+        name + std::to_string(column.GetIndex()) + ":" + field.GetTypeName() + ":" + std::to_string(type),
+        desc.GetQualifiedFieldName(field.GetId()) + "[" + std::to_string(column.GetIndex()) + "]",
+        column.GetPhysicalId()});
+    }
+    AddColumnsFromField(desc, field, name, columns);
+  }
+}
+
+/// Depth-first list of the physical columns
+std::vector<ColumnKey> GetColumnList(const RNTupleDescriptor &desc) {
+  std::vector<ColumnKey> columns;
+  AddColumnsFromField(desc, desc.GetFieldDescriptor(desc.GetFieldZeroId()), "", columns);
+  return columns;
+}
+
+class RecompressPipeline {
+  const int fCompSettings;
+  /// Per-column compression settings that override fCompSettings, keyed by column name
+  const std::map<std::string, int> fPlan;
+  const unsigned fNThreads;
+  /// Upper bound on the number of clusters held in memory between reading and writing
+  const std::size_t fMaxInFlight;
+
+  RPageSink &fSink;
+  std::vector<ColumnInfo> fColumns;
+  std::unordered_map<std::string, std::size_t> fColumnIndex;
+
+  std::mutex fLock;
+  std::condition_variable fCvWork;
+  std::condition_variable fCvWrite;
+  std::condition_variable fCvRead;
+  /// Pages ready for the workers
+  std::deque<std::pair<ClusterTask *, std::size_t>> fWorkQueue;
+  /// Reorder buffer: clusters whose pages are all processed, keyed by sequence number
+  std::map<std::uint64_t, std::unique_ptr<ClusterTask>> fReorderBuffer;
+  /// Clusters handed to the workers; owned here until they move to the reorder buffer
+  std::unordered_map<ClusterTask *, std::unique_ptr<ClusterTask>> fInProcessing;
+  std::size_t fNInFlight = 0;
+  std::uint64_t fNextSeqNo = 0;
+  bool fReadDone = false;
+
+  StageStats fStatsRead;
+  StageStats fStatsUnzip;
+  StageStats fStatsZip;
+  StageStats fStatsWrite;
+
+  void ProcessPage(const ClusterTask &cluster, PageTask &page) {
+    if (!cluster.fRecompress[page.fColumn])
+      return;
+    const auto &element = *fColumns[page.fColumn].fElement;
+    const auto packedSize = element.GetPackedSize(page.fNElements);
+
+    auto start = steady_clock::now();
+    auto packed = std::make_unique<unsigned char[]>(packedSize);
+    RNTupleDecompressor::Unzip(page.fInput.get(), page.fInputSize, packedSize, packed.get());
+    fStatsUnzip.Add(packedSize, start);
+
+    start = steady_clock::now();
+    page.fOutput = std::make_unique<unsigned char[]>(packedSize);
+    page.fOutputSize =
+      RNTupleCompressor::Zip(packed.get(), packedSize, fColumns[page.fColumn].fCompSettings, page.fOutput.get());
+    fStatsZip.Add(packedSize, start);
+    page.fInput.reset();
+  }
+
+  void Worker() {
+    std::unique_lock<std::mutex> guard(fLock);
+    while (true) {
+      fCvWork.wait(guard, [this] { return !fWorkQueue.empty() || fReadDone; });
+      if (fWorkQueue.empty())
+        return;
+      auto [cluster, idxPage] = fWorkQueue.front();
+      fWorkQueue.pop_front();
+      guard.unlock();
+
+      ProcessPage(*cluster, cluster->fPages[idxPage]);
+
+      guard.lock();
+      if (--cluster->fNPagesLeft == 0)
+        Complete(cluster);
+    }
+  }
+
+  /// Moves a fully processed cluster into the reorder buffer; must be called with fLock held
+  void Complete(ClusterTask *cluster) {
+    auto itr = fInProcessing.find(cluster);
+    fReorderBuffer[cluster->fSeqNo] = std::move(itr->second);
+    fInProcessing.erase(itr);
+    fCvWrite.notify_one();
+  }
+
+  void WriteCluster(ClusterTask &cluster) {
+    auto start = steady_clock::now();
+    std::uint64_t nbytes = 0;
+    std::vector<RPageStorage::SealedPageSequence_t> sealedPages(cluster.fColumns.size());
+    for (auto &page : cluster.fPages) {
+      RPageStorage::RSealedPage sealedPage;
+      sealedPage.fNElements = page.fNElements;
+      if (page.fOutput) {
+        sealedPage.fBuffer = page.fOutput.get();
+        sealedPage.fSize = page.fOutputSize;
+      } else {
+        sealedPage.fBuffer = page.fInput.get();
+        sealedPage.fSize = page.fInputSize;
+      }
+      nbytes += sealedPage.fSize;
+      sealedPages[page.fColumn].emplace_back(sealedPage);
+    }
+    std::vector<RPageStorage::RSealedPageGroup> groups;
+    for (std::size_t i = 0; i < cluster.fColumns.size(); ++i) {
+      if (sealedPages[i].empty())
+        continue;
+      groups.emplace_back(cluster.fColumns[i], sealedPages[i].cbegin(), sealedPages[i].cend());
+    }
+    fSink.CommitSealedPageV(groups);
+    fSink.CommitCluster(cluster.fNEntries);
+    fStatsWrite.Add(nbytes, start);
+  }
+
+  void Writer() {
+    std::unique_lock<std::mutex> guard(fLock);
+    while (true) {
+      fCvWrite.wait(guard, [this] {
+        return (!fReorderBuffer.empty() && fReorderBuffer.begin()->first == fNextSeqNo) ||
+               (fReadDone && fNInFlight == 0);
+      });
+      if (fReorderBuffer.empty())
+        return;
+      auto cluster = std::move(fReorderBuffer.begin()->second);
+      fReorderBuffer.erase(fReorderBuffer.begin());
+      guard.unlock();
+
+      WriteCluster(*cluster);
+      cluster.reset();
+
+      guard.lock();
+      fNextSeqNo++;
+      fNInFlight--;
+      fCvRead.notify_one();
+      fCvWrite.notify_one();
+    }
+  }
+
+  /// Reads the sealed pages of all the columns of a cluster into a new cluster task
+  std::unique_ptr<ClusterTask> ReadCluster(RPageSource &source, DescriptorId_t clusterId,
+                                           const std::vector<std::pair<std::size_t, DescriptorId_t>> &columnMap) {
+    auto cluster = std::make_unique<ClusterTask>();
+    std::vector<std::vector<RClusterDescriptor::RPageRange::RPageInfo>> pageInfos;
+    {
+      auto descriptorGuard = source.GetSharedDescriptorGuard();
+      const auto &clusterDesc = descriptorGuard->GetClusterDescriptor(clusterId);
+      cluster->fNEntries = clusterDesc.GetNEntries();
+      for (const auto &[idxColumn, inputId] : columnMap) {
+        cluster->fColumns.emplace_back(fColumns[idxColumn].fOutputId);
+        if (!clusterDesc.ContainsColumn(inputId)) {
+          cluster->fRecompress.emplace_back(false);
+          pageInfos.emplace_back();
+          continue;
+        }
+        const auto &columnRange = clusterDesc.GetColumnRange(inputId);
+        const auto compSettings = fColumns[idxColumn].fCompSettings;
+        cluster->fRecompress.emplace_back(compSettings != -1 &&
+                                          static_cast<int>(columnRange.fCompressionSettings) != compSettings);
+        pageInfos.emplace_back(clusterDesc.GetPageRange(inputId).fPageInfos);
+      }
+    }
+
+    auto start = steady_clock::now();
+    std::uint64_t nbytes = 0;
+    for (std::size_t i = 0; i < columnMap.size(); ++i) {
+      NTupleSize_t firstElement = 0;
+      for (const auto &pageInfo : pageInfos[i]) {
+        PageTask page;
+        page.fColumn = i;
+        page.fNElements = pageInfo.fNElements;
+        page.fInputSize = pageInfo.fLocator.fBytesOnStorage;
+        page.fInput = std::make_unique<unsigned char[]>(page.fInputSize);
+        RPageStorage::RSealedPage sealedPage;
+        sealedPage.fBuffer = page.fInput.get();
+        source.LoadSealedPage(columnMap[i].second, RClusterIndex(clusterId, firstElement), sealedPage);
+        nbytes += page.fInputSize;
+        firstElement += pageInfo.fNElements;
+        cluster->fPages.emplace_back(std::move(page));
+      }
+    }
+    fStatsRead.Add(nbytes, start);
+    return cluster;
+  }
+
+  /// Hands a cluster to the workers; without workers, processes it on the calling thread
+  void Submit(std::unique_ptr<ClusterTask> cluster) {
+    std::unique_lock<std::mutex> guard(fLock);
+    fCvRead.wait(guard, [this] { return fNInFlight < fMaxInFlight; });
+    cluster->fSeqNo = fNextSeqNo + fNInFlight;
+    fNInFlight++;
+    cluster->fNPagesLeft = cluster->fPages.size();
+    auto *raw = cluster.get();
+    if (raw->fPages.empty()) {
+      fReorderBuffer[raw->fSeqNo] = std::move(cluster);
+      fCvWrite.notify_one();
+      return;
+    }
+    fInProcessing[raw] = std::move(cluster);
+    for (std::size_t i = 0; i < raw->fPages.size(); ++i)
+      fWorkQueue.emplace_back(raw, i);
+    fCvWork.notify_all();
+  }
+
+public:
+  RecompressPipeline(RPageSink &sink, int compSettings, const std::map<std::string, int> &plan, unsigned nThreads)
+    : fCompSettings(compSettings), fPlan(plan), fNThreads(nThreads), fMaxInFlight(2 * nThreads + 1), fSink(sink) {}
+
+  /// Sets up the output from the model of the first input and maps the columns of every input to the output
+  /// columns; fails if an input does not have the same columns as the output
+  bool AddSource(RPageSource &source, std::vector<std::pair<std::size_t, DescriptorId_t>> &columnMap) {
+    auto descriptorGuard = source.GetSharedDescriptorGuard();
+    if (fColumns.empty()) {
+      // The model does not contain the projected fields, so the output column ids are not the positions of the
+      // input columns.  Take the output columns from the sink, in output column id order.
+      auto model = descriptorGuard->CreateModel();
+      fSink.Init(*model);
+      const auto &sinkDesc = fSink.GetDescriptor();
+      auto outputColumns = GetColumnList(sinkDesc);
+      std::sort(outputColumns.begin(), outputColumns.end(),
+                [](const ColumnKey &a, const ColumnKey &b) { return a.fPhysicalId < b.fPhysicalId; });
+      for (const auto &c : outputColumns) {
+        fColumnIndex[c.fKey] = fColumns.size();
+        const auto type = sinkDesc.GetColumnDescriptor(c.fPhysicalId).GetModel().GetType();
+        auto itrPlan = fPlan.find(c.fName);
+        const int compSettings = (itrPlan == fPlan.end()) ? fCompSettings : itrPlan->second;
+        fColumns.emplace_back(ColumnInfo{c.fName, c.fPhysicalId, RColumnElementBase::Generate(type), compSettings});
+      }
+      for (const auto &[name, compSettings] : fPlan) {
+        if (std::none_of(fColumns.begin(), fColumns.end(), [&](const ColumnInfo &c) { return c.fName == name; }))
+          std::cerr << "Warning: column " << name << " from the plan not found\n";
+      }
+    }
+    const auto columns = GetColumnList(descriptorGuard.GetRef());
+    if (columns.size() != fColumns.size()) {
+      std::cerr << "Error: input " << source.GetNTupleName() << " has a different number of columns\n";
+      return false;
+    }
+    columnMap.clear();
+    for (const auto &c : columns) {
+      auto itr = fColumnIndex.find(c.fKey);
+      if (itr == fColumnIndex.end()) {
+        std::cerr << "Error: column " << c.fName << " of input " << source.GetNTupleName()
+                  << " not found in the output\n";
+        return false;
+      }
+      columnMap.emplace_back(itr->second, c.fPhysicalId);
+    }
+    // Keep the page groups of a cluster in output column order
+    std::sort(columnMap.begin(), columnMap.end());
+    return true;
+  }
+
+  bool Run(const std::vector<RPageSource *> &sources) {
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < fNThreads; ++i)
+      workers.emplace_back(&RecompressPipeline::Worker, this);
+    std::thread writer(&RecompressPipeline::Writer, this);
+
+    bool success = true;
+    std::vector<std::pair<std::size_t, DescriptorId_t>> columnMap;
+    for (auto *source : sources) {
+      source->Attach();
+      if (!AddSource(*source, columnMap)) {
+        success = false;
+        break;
+      }
+      std::vector<DescriptorId_t> clusterIds;
+      {
+        auto descriptorGuard = source->GetSharedDescriptorGuard();
+        // Clusters in entry order, which is the order in which the merger copies them
+        for (DescriptorId_t id = descriptorGuard->FindClusterId(0, 0); id != kInvalidDescriptorId;
+             id = descriptorGuard->FindNextClusterId(id)) {
+          clusterIds.emplace_back(id);
+        }
+      }
+      for (auto clusterId : clusterIds)
+        Submit(ReadCluster(*source, clusterId, columnMap));
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(fLock);
+      fReadDone = true;
+    }
+    fCvWork.notify_all();
+    fCvWrite.notify_all();
+    for (auto &w : workers)
+      w.join();
+    writer.join();
+
+    if (success) {
+      fSink.CommitClusterGroup();
+      fSink.CommitDataset();
+    }
+    return success;
+  }
+
+  void PrintStats(double wallSecs) const {
+    fStatsRead.Print("Read");
+    fStatsUnzip.Print("Decompress");
+    fStatsZip.Print("Compress");
+    fStatsWrite.Print("Write");
+    std::cout << "Recompress-Threads: " << fNThreads << "\n";
+    std::cout << "Recompress-Total: " << static_cast<double>(fStatsRead.fBytes) / (1000. * 1000.) / wallSecs
+              << " MB/s input, " << static_cast<double>(fStatsWrite.fBytes) / (1000. * 1000.) / wallSecs
+              << " MB/s output (" << wallSecs << " s)\n";
+  }
+};
+
+/// Reads a plan file written by ntuple_zipplan; lines starting with '#' are comments
+bool ReadPlan(const char *path, std::map<std::string, int> &plan) {
+  std::ifstream f(path);
+  if (!f) {
+    std::cerr << "Error: cannot open plan " << path << "\n";
+    return false;
+  }
+  std::string line;
+  while (std::getline(f, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream iss(line);
+    std::string name;
+    int compSettings;
+    if (!(iss >> name >> compSettings)) {
+      std::cerr << "Error: invalid plan line: " << line << "\n";
+      return false;
+    }
+    plan[name] = compSettings;
+  }
+  return true;
+}
+
+} // anonymous namespace
+
 int main(int argc, char **argv) {
+  const char *progname = argv[0];
+  unsigned nThreads = 0;
+  std::map<std::string, int> plan;
+  // The compression settings can be negative, so only -j and -p are accepted as options and only in front
+  while (argc > 2 && (strcmp(argv[1], "-j") == 0 || strcmp(argv[1], "-p") == 0)) {
+    if (argv[1][1] == 'j') {
+      nThreads = std::max(1, std::atoi(argv[2]));
+    } else {
+      if (!ReadPlan(argv[2], plan))
+        return 1;
+      nThreads = std::max(1u, nThreads);
+    }
+    argv += 2;
+    argc -= 2;
+  }
+
   if (argc < 5) {
-    fprintf(stderr, "Usage: %s <compression_settings> <ntuple_file_out> <ntuple_name> <ntuple_file1.root> [ntuple_file2.root ...]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-j threads] [-p plan] <compression_settings> <ntuple_file_out> <ntuple_name> <ntuple_file1.root> [ntuple_file2.root ...]\n", progname);
     fprintf(stderr, "Common compression settings:\n\t-1: preserve;\n\t0: uncompressed\n\t505: Zstd\n\t207: LZMA\n");
+    fprintf(stderr, "With -j, pages are recompressed in parallel by the given number of worker threads\n");
+    fprintf(stderr, "With -p, per-column compression settings are taken from a plan written by ntuple_zipplan\n");
     return 1;
   }
 
@@ -60,12 +514,39 @@ int main(int argc, char **argv) {
     srcsRaw.push_back(s.get());
   }
 
-  auto dst = RPageSinkFile { ntuple_name, ntuple_file_out, RNTupleWriteOptions {} };
+  // A failed run must not leave a partial output behind
+  const std::string ntuple_file_tmp = std::string(ntuple_file_out) + ".tmp";
+  bool success = true;
+  {
+    auto dst = RPageSinkFile { ntuple_name, ntuple_file_tmp, RNTupleWriteOptions {} };
 
-  RNTupleMerger merger;
-  RNTupleMergeOptions merge_opts;
-  merge_opts.fCompressionSettings = compSettings;
-  merger.Merge(srcsRaw, dst, merge_opts);
+    if (nThreads > 0) {
+      auto start = steady_clock::now();
+      RecompressPipeline pipeline(dst, compSettings, plan, nThreads);
+      success = pipeline.Run(srcsRaw);
+      if (success)
+        pipeline.PrintStats(duration_cast<duration<double>>(steady_clock::now() - start).count());
+    } else {
+      RNTupleMerger merger;
+      RNTupleMergeOptions merge_opts;
+      merge_opts.fCompressionSettings = compSettings;
+      try {
+        merger.Merge(srcsRaw, dst, merge_opts);
+      } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        success = false;
+      }
+    }
+  }
+  // The sink is destructed, i.e. the file is closed
+  if (success && std::rename(ntuple_file_tmp.c_str(), ntuple_file_out) != 0) {
+    std::cerr << "Error: cannot rename " << ntuple_file_tmp << " to " << ntuple_file_out << "\n";
+    success = false;
+  }
+  if (!success) {
+    std::remove(ntuple_file_tmp.c_str());
+    return 1;
+  }
 
   std::cout << "Merged " << srcsRaw.size() << " ntuples.";
   if (compSettings != -1)
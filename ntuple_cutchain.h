@@ -0,0 +1,179 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+#ifndef NTUPLE_CUTCHAIN_H_
+#define NTUPLE_CUTCHAIN_H_
+
+#include <ROOT/RNTupleUtil.hxx>
+
+#include <cassert>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ntuple_pages.h"
+
+/// Cut flow and page statistics of one or several cut chains, e.g. of all the threads of an event loop
+struct NTupleCutChainReport {
+   struct RCutStats {
+      std::string fName;
+      std::uint64_t fNIn = 0;
+      std::uint64_t fNPass = 0;
+   };
+   struct RColumnStats {
+      std::string fName;
+      std::uint64_t fNPages = 0;
+      std::uint64_t fNPagesMapped = 0;
+      std::uint64_t fNBytes = 0;
+      std::uint64_t fNBytesMapped = 0;
+      std::uint64_t fNBytesUnzipped = 0;
+      std::uint64_t fNBytesUnzippedMapped = 0;
+   };
+
+   std::vector<RCutStats> fCuts;
+   std::vector<RColumnStats> fColumns;
+
+   /// The entry ranges are aligned to cluster boundaries, so the pages that an event loop maps are pages of its
+   /// range, each counted once
+   static std::uint64_t GetAvoided(std::uint64_t nTotal, std::uint64_t nMapped)
+   {
+      assert(nMapped <= nTotal);
+      return nTotal - nMapped;
+   }
+
+   std::uint64_t GetNBytesAvoided() const
+   {
+      std::uint64_t n = 0;
+      for (const auto &c : fColumns)
+         n += GetAvoided(c.fNBytes, c.fNBytesMapped);
+      return n;
+   }
+   std::uint64_t GetNBytesUnzippedAvoided() const
+   {
+      std::uint64_t n = 0;
+      for (const auto &c : fColumns)
+         n += GetAvoided(c.fNBytesUnzipped, c.fNBytesUnzippedMapped);
+      return n;
+   }
+
+   /// Adds the numbers of another report of the same cut chain, e.g. of another thread
+   void Add(const NTupleCutChainReport &other)
+   {
+      fCuts.resize(other.fCuts.size());
+      for (unsigned i = 0; i < other.fCuts.size(); ++i) {
+         fCuts[i].fName = other.fCuts[i].fName;
+         fCuts[i].fNIn += other.fCuts[i].fNIn;
+         fCuts[i].fNPass += other.fCuts[i].fNPass;
+      }
+      fColumns.resize(other.fColumns.size());
+      for (unsigned i = 0; i < other.fColumns.size(); ++i) {
+         fColumns[i].fName = other.fColumns[i].fName;
+         fColumns[i].fNPages += other.fColumns[i].fNPages;
+         fColumns[i].fNPagesMapped += other.fColumns[i].fNPagesMapped;
+         fColumns[i].fNBytes += other.fColumns[i].fNBytes;
+         fColumns[i].fNBytesMapped += other.fColumns[i].fNBytesMapped;
+         fColumns[i].fNBytesUnzipped += other.fColumns[i].fNBytesUnzipped;
+         fColumns[i].fNBytesUnzippedMapped += other.fColumns[i].fNBytesUnzippedMapped;
+      }
+   }
+
+   void Print() const
+   {
+      printf("Cut flow:\n");
+      for (const auto &c : fCuts) {
+         printf("   %-24s %12" PRIu64 " in %12" PRIu64 " pass (%6.2f%%)\n", c.fName.c_str(), c.fNIn, c.fNPass,
+                (c.fNIn == 0) ? 0.0 : 100.0 * c.fNPass / c.fNIn);
+      }
+      printf("Pages:\n");
+      printf("   %-24s %17s %14s %14s %14s\n", "column", "mapped/total", "bytes read", "bytes avoided",
+             "unzip avoided");
+      for (const auto &c : fColumns) {
+         printf("   %-24s %8" PRIu64 "/%-8" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64 "\n", c.fName.c_str(),
+                c.fNPagesMapped, c.fNPages, c.fNBytesMapped, GetAvoided(c.fNBytes, c.fNBytesMapped),
+                GetAvoided(c.fNBytesUnzipped, c.fNBytesUnzippedMapped));
+      }
+      printf("   %-24s %17s %14s %14" PRIu64 " %14" PRIu64 "\n", "total", "", "", GetNBytesAvoided(),
+             GetNBytesUnzippedAvoided());
+   }
+};
+
+/// A chain of cuts on the columns of an ntuple that are mapped through NTuplePageSpans.  Every cut is registered
+/// with the columns it reads.  The cuts are evaluated in the order of registration and a cut only runs for the
+/// entries that passed all previous cuts, so that the page of a column is only mapped, i.e. read and decompressed,
+/// once a surviving entry needs it.  Together with a page source without cluster cache, the pages of the columns of
+/// later cuts that contain no surviving entries are never read.
+///
+/// The predicates map the pages themselves through their NTuplePageSpans.  The columns registered with a cut or with
+/// AddColumn() are only used for the page statistics of the report; the chain does not load them.
+class NTupleCutChain {
+public:
+   using Predicate_t = std::function<bool(ROOT::Experimental::NTupleSize_t)>;
+   /// Name and page bookkeeping of a column that is read by a cut
+   using Column_t = std::pair<std::string, const NTuplePageTable *>;
+
+private:
+   struct RCut {
+      std::string fName;
+      Predicate_t fPredicate;
+      std::uint64_t fNIn = 0;
+      std::uint64_t fNPass = 0;
+   };
+
+   std::vector<RCut> fCuts;
+   /// The columns of all the cuts, each column once and in the order of registration
+   std::vector<Column_t> fColumns;
+
+public:
+   void AddCut(const std::string &name, const std::vector<Column_t> &columns, Predicate_t predicate)
+   {
+      fCuts.emplace_back(RCut{name, std::move(predicate)});
+      for (const auto &c : columns)
+         AddColumn(c);
+   }
+
+   /// Registers a column that is only read for the selected entries, such that it shows up in the report.  Like
+   /// the columns of the cuts, it is only used for the report.
+   void AddColumn(const Column_t &column)
+   {
+      for (const auto &c : fColumns) {
+         if (c.second == column.second)
+            return;
+      }
+      fColumns.emplace_back(column);
+   }
+
+   /// Returns true if the entry passes all cuts
+   bool Evaluate(ROOT::Experimental::NTupleSize_t entry)
+   {
+      for (auto &c : fCuts) {
+         c.fNIn++;
+         if (!c.fPredicate(entry))
+            return false;
+         c.fNPass++;
+      }
+      return true;
+   }
+
+   /// Adds the cut flow and the page statistics of the processed entry range to the report.  The range should
+   /// be aligned to cluster boundaries; all cut chains added to the same report need to have the same cuts.
+   void AddToReport(std::uint64_t firstEntry, std::uint64_t lastEntry, NTupleCutChainReport *report) const
+   {
+      NTupleCutChainReport mine;
+      for (const auto &c : fCuts)
+         mine.fCuts.emplace_back(NTupleCutChainReport::RCutStats{c.fName, c.fNIn, c.fNPass});
+      for (const auto &[name, table] : fColumns) {
+         mine.fColumns.emplace_back(NTupleCutChainReport::RColumnStats{
+            name, table->GetNPages(firstEntry, lastEntry), table->GetNPagesMapped(),
+            table->GetNBytes(firstEntry, lastEntry), table->GetNBytesMapped(),
+            table->GetNBytesUnzipped(firstEntry, lastEntry), table->GetNBytesUnzippedMapped()});
+      }
+      report->Add(mine);
+   }
+};
+
+#endif // NTUPLE_CUTCHAIN_H_
@@ -0,0 +1,228 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+#ifndef NTUPLE_PAGES_H_
+#define NTUPLE_PAGES_H_
+
+#include <ROOT/RColumn.hxx>
+#include <ROOT/RColumnElementBase.hxx>
+#include <ROOT/RNTupleDescriptor.hxx>
+#include <ROOT/RNTupleUtil.hxx>
+#include <ROOT/RPageStorage.hxx>
+#include <ROOT/RSpan.hxx>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Bookkeeping of the pages of a column: which pages have been mapped so far and how many bytes they occupy on
+/// storage and in memory, such that lazy loops can report the bytes they avoided to read.  Every page is counted
+/// once, also if it is mapped again, e.g. by a column that is read by several cuts.
+class NTuplePageTable {
+   struct RPageEntry {
+      ROOT::Experimental::NTupleSize_t fFirstIndex; ///< Global index of the first element
+      ROOT::Experimental::NTupleSize_t fNElements;
+      std::uint64_t fBytesOnStorage;
+      std::uint64_t fFirstEntry;                    ///< First entry of the page's cluster
+      bool fIsMapped = false;
+   };
+   std::string fFieldName;
+   std::vector<RPageEntry> fPages; ///< Sorted by fFirstIndex
+   /// Maps the cluster ids to the global index of the column's first element in the cluster
+   std::unordered_map<ROOT::Experimental::DescriptorId_t, ROOT::Experimental::NTupleSize_t> fClusterFirstIndex;
+   std::size_t fElementSize = 0;
+   /// Whether the page buffers are plain copies of the on-disk pages: uncompressed, and the on-disk encoding is the
+   /// in-memory layout
+   bool fIsPlainCopy = true;
+   /// The page that was mapped last as a half-open range of global element indexes
+   ROOT::Experimental::NTupleSize_t fMappedFirst = 0;
+   ROOT::Experimental::NTupleSize_t fMappedLast = 0;
+
+   std::uint64_t fNPagesMapped = 0;
+   std::uint64_t fNElementsMapped = 0;
+   std::uint64_t fNBytesMapped = 0;
+
+protected:
+   /// Builds the page list of the column from the descriptor; isMappable tells if the in-memory layout of the column
+   /// elements is the on-disk encoding
+   void Init(const ROOT::Experimental::RNTupleDescriptor &desc, const std::string &fieldName,
+             ROOT::Experimental::DescriptorId_t columnId, std::size_t elementSize, bool isMappable)
+   {
+      fFieldName = fieldName;
+      fElementSize = elementSize;
+      fIsPlainCopy = isMappable;
+      for (const auto &cluster : desc.GetClusterIterable()) {
+         if (!cluster.ContainsColumn(columnId))
+            continue;
+         const auto &columnRange = cluster.GetColumnRange(columnId);
+         if (columnRange.fCompressionSettings != 0)
+            fIsPlainCopy = false;
+         fClusterFirstIndex[cluster.GetId()] = columnRange.fFirstElementIndex;
+         auto firstIndex = columnRange.fFirstElementIndex;
+         for (const auto &pageInfo : cluster.GetPageRange(columnId).fPageInfos) {
+            fPages.emplace_back(RPageEntry{firstIndex, pageInfo.fNElements, pageInfo.fLocator.fBytesOnStorage,
+                                           cluster.GetFirstEntryIndex()});
+            firstIndex += pageInfo.fNElements;
+         }
+      }
+      std::sort(fPages.begin(), fPages.end(),
+                [](const RPageEntry &a, const RPageEntry &b) { return a.fFirstIndex < b.fFirstIndex; });
+   }
+
+   /// Records the mapping of the page that contains the given element
+   void Track(ROOT::Experimental::NTupleSize_t globalIndex)
+   {
+      if (globalIndex >= fMappedFirst && globalIndex < fMappedLast)
+         return;
+      auto itr = std::upper_bound(fPages.begin(), fPages.end(), globalIndex,
+                                  [](ROOT::Experimental::NTupleSize_t idx, const RPageEntry &p) {
+                                     return idx < p.fFirstIndex;
+                                  });
+      if (itr == fPages.begin())
+         return;
+      --itr;
+      fMappedFirst = itr->fFirstIndex;
+      fMappedLast = itr->fFirstIndex + itr->fNElements;
+      if (itr->fIsMapped)
+         return;
+      itr->fIsMapped = true;
+      fNPagesMapped++;
+      fNElementsMapped += itr->fNElements;
+      fNBytesMapped += itr->fBytesOnStorage;
+   }
+
+   void Track(const ROOT::Experimental::RClusterIndex &clusterIndex)
+   {
+      Track(fClusterFirstIndex.at(clusterIndex.GetClusterId()) + clusterIndex.GetIndex());
+   }
+
+public:
+   bool IsPlainCopy() const { return fIsPlainCopy; }
+   /// For the loops that are meant to work on plain copies of the on-disk pages (-z): warns once per process if
+   /// the pages of a column are decompressed or unpacked
+   void WarnIfNotPlainCopy() const
+   {
+      static std::atomic<bool> gWarned{false};
+      if (fIsPlainCopy || gWarned.exchange(true))
+         return;
+      std::cerr << "Warning: the pages of " << fFieldName << " are compressed or need to be unpacked, so the page "
+                << "spans are not plain copies of the on-disk pages; use an uncompressed input" << std::endl;
+   }
+
+   std::uint64_t GetNPagesMapped() const { return fNPagesMapped; }
+   std::uint64_t GetNBytesMapped() const { return fNBytesMapped; }
+   std::uint64_t GetNBytesUnzippedMapped() const { return fNElementsMapped * fElementSize; }
+
+   /// Pages and bytes of the clusters whose entries are all in the range [firstEntry, lastEntry).  Ranges along
+   /// cluster boundaries, such as the ones of PartitionEntries(), cover their clusters completely.
+   std::uint64_t GetNPages(std::uint64_t firstEntry, std::uint64_t lastEntry) const
+   {
+      return std::count_if(fPages.begin(), fPages.end(), [&](const RPageEntry &p) {
+         return p.fFirstEntry >= firstEntry && p.fFirstEntry < lastEntry;
+      });
+   }
+   std::uint64_t GetNBytes(std::uint64_t firstEntry, std::uint64_t lastEntry) const
+   {
+      std::uint64_t nBytes = 0;
+      for (const auto &p : fPages) {
+         if (p.fFirstEntry >= firstEntry && p.fFirstEntry < lastEntry)
+            nBytes += p.fBytesOnStorage;
+      }
+      return nBytes;
+   }
+   std::uint64_t GetNBytesUnzipped(std::uint64_t firstEntry, std::uint64_t lastEntry) const
+   {
+      std::uint64_t nElements = 0;
+      for (const auto &p : fPages) {
+         if (p.fFirstEntry >= firstEntry && p.fFirstEntry < lastEntry)
+            nElements += p.fNElements;
+      }
+      return nElements * fElementSize;
+   }
+};
+
+/// Reads the principal column of a field of fundamental type page by page.  The values are exposed as a
+/// span over the buffer of the page in the page source's page pool, so that a loop can iterate over entire pages
+/// instead of fetching the values entry by entry through a view.  The page buffers hold the in-memory
+/// representation; for uncompressed columns whose on-disk encoding is the in-memory layout (e.g. not split, not
+/// bit-packed, and on a little-endian host), the page source fills them with a plain copy of the on-disk page.
+/// Other columns are accepted, but their pages are decompressed and unpacked; see IsPlainCopy().  The field can also
+/// be a collection, whose principal column holds the item offsets, or a sub-field of a collection record, given by
+/// its qualified name.
+template <typename T>
+class NTuplePageSpans : public NTuplePageTable {
+   std::unique_ptr<ROOT::Experimental::Internal::RColumn> fColumn;
+
+   static ROOT::Experimental::DescriptorId_t
+   FindColumnId(const ROOT::Experimental::RNTupleDescriptor &desc, const std::string &fieldName)
+   {
+      using ROOT::Experimental::kInvalidDescriptorId;
+
+      const auto fieldId = desc.FindFieldId(fieldName);
+      const auto columnId =
+         (fieldId == kInvalidDescriptorId) ? kInvalidDescriptorId : desc.FindPhysicalColumnId(fieldId, 0, 0);
+      if (columnId == kInvalidDescriptorId) {
+         std::cerr << "Field " << fieldName << " has no column to map" << std::endl;
+         abort();
+      }
+      return columnId;
+   }
+
+public:
+   /// The page source must be attached and outlive the object
+   NTuplePageSpans(ROOT::Experimental::Internal::RPageSource &source, const std::string &fieldName)
+   {
+      ROOT::Experimental::DescriptorId_t fieldId;
+      {
+         auto desc = source.GetSharedDescriptorGuard();
+         const auto columnId = FindColumnId(*desc, fieldName);
+         fieldId = desc->GetColumnDescriptor(columnId).GetFieldId();
+         const auto type = desc->GetColumnDescriptor(columnId).GetType();
+         Init(*desc, fieldName, columnId, sizeof(T),
+              ROOT::Experimental::Internal::RColumnElementBase::Generate<T>(type)->IsMappable());
+         fColumn = ROOT::Experimental::Internal::RColumn::Create<T>(type, 0, 0);
+      }
+      fColumn->ConnectPageSource(fieldId, source);
+   }
+
+   /// The values from entry to the end of the page that contains entry.  The span is valid until the next call
+   /// that maps a different page.
+   std::span<const T> Get(ROOT::Experimental::NTupleSize_t entry)
+   {
+      ROOT::Experimental::NTupleSize_t nItems;
+      Track(entry);
+      const T *values = fColumn->MapV<T>(entry, nItems);
+      return std::span<const T>(values, nItems);
+   }
+
+   /// Like Get() but for the cluster-local index, e.g. of the items of a collection
+   std::span<const T> Get(const ROOT::Experimental::RClusterIndex &clusterIndex)
+   {
+      ROOT::Experimental::NTupleSize_t nItems;
+      Track(clusterIndex);
+      const T *values = fColumn->MapV<T>(clusterIndex, nItems);
+      return std::span<const T>(values, nItems);
+   }
+
+   /// For the offset column of a collection field (T = ClusterSize_t): the cluster-local index of the first item of
+   /// the entry's collection and the number of items
+   ROOT::Experimental::RClusterIndex GetCollectionInfo(ROOT::Experimental::NTupleSize_t entry,
+                                                       ROOT::Experimental::NTupleSize_t *nItems)
+   {
+      Track(entry);
+      ROOT::Experimental::RClusterIndex collectionStart;
+      ROOT::Experimental::ClusterSize_t collectionSize;
+      fColumn->GetCollectionInfo(entry, &collectionStart, &collectionSize);
+      *nItems = collectionSize;
+      return collectionStart;
+   }
+};
+
+#endif // NTUPLE_PAGES_H_
@@ -0,0 +1,315 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+/*
+  ntuple_zipplan
+
+  Trial-compresses a sample of the pages of every column with a set of codecs and levels and emits a per-column
+  compression plan.  The plan picks for every column the compression setting that minimizes the estimated time to
+  read and decompress the column, given the bandwidth of the storage medium: a slow medium favors strong
+  compression, a fast medium favors cheap decompression.
+
+  The plan file can be applied with `ntuple_change_compression -p <plan>`.  For columns wider than one byte, the
+  tool also estimates whether the split (byte-transposed) or the unsplit encoding compresses better.  The encoding
+  recommendation is informational; changing it requires rewriting the data with a different column representation.
+*/
+
+#include <ROOT/RColumnElementBase.hxx>
+#include <ROOT/RNTupleDescriptor.hxx>
+#include <ROOT/RNTupleReadOptions.hxx>
+#include <ROOT/RNTupleZip.hxx>
+#include <ROOT/RPageStorage.hxx>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+using DescriptorId_t = ROOT::Experimental::DescriptorId_t;
+using EColumnType = ROOT::Experimental::EColumnType;
+using NTupleSize_t = ROOT::Experimental::NTupleSize_t;
+using RClusterIndex = ROOT::Experimental::RClusterIndex;
+using RColumnElementBase = ROOT::Experimental::Internal::RColumnElementBase;
+using RFieldDescriptor = ROOT::Experimental::RFieldDescriptor;
+using RNTupleCompressor = ROOT::Experimental::Internal::RNTupleCompressor;
+using RNTupleDecompressor = ROOT::Experimental::Internal::RNTupleDecompressor;
+using RNTupleDescriptor = ROOT::Experimental::RNTupleDescriptor;
+using RNTupleReadOptions = ROOT::Experimental::RNTupleReadOptions;
+using RPageSource = ROOT::Experimental::Internal::RPageSource;
+using RPageStorage = ROOT::Experimental::Internal::RPageStorage;
+
+/// Candidate compression settings; 0 (uncompressed) wins on media that are fast compared to decompression
+static const int kCandidateSettings[] = {0, 101, 106, 207, 404, 501, 503, 505, 507, 509};
+static constexpr int kNumCandidates = sizeof(kCandidateSettings) / sizeof(kCandidateSettings[0]);
+/// Decompression of every sample is repeated and the fastest run is taken
+static constexpr int kNumRepetitions = 3;
+
+/// A page of a column, addressed such that it can be loaded with RPageSource::LoadSealedPage()
+struct PageRef {
+   DescriptorId_t fClusterId;
+   NTupleSize_t fFirstElement;  ///< Index of the first element in the cluster
+   std::uint32_t fNElements;
+   std::uint32_t fBytesOnStorage;
+};
+
+struct ColumnPlan {
+   std::string fName;  ///< Qualified field name and column index, e.g. `jets.pt[0]`
+   DescriptorId_t fPhysicalId;
+   EColumnType fType;
+   std::uint64_t fBytesOnStorage = 0;
+   std::uint64_t fBytesInMemory = 0;
+   std::vector<PageRef> fPages;
+
+   // Trial results summed over the sampled pages
+   std::uint64_t fSampleBytes = 0;
+   std::uint64_t fZipBytes[kNumCandidates] = {};
+   double fUnzipSecs[kNumCandidates] = {};
+   /// Compressed sample size with the alternative encoding (split <-> unsplit) for the chosen setting
+   std::uint64_t fZipBytesAlt = 0;
+
+   int fChoice = -1;
+   double fCost = 0.0;
+};
+
+/// Columns with a "Split" type store their elements byte-transposed
+static bool IsSplitType(EColumnType type)
+{
+   return RColumnElementBase::GetTypeName(type).rfind("Split", 0) == 0;
+}
+
+/// Switches the encoding of n elements of width elementSize between split (byte-transposed) and unsplit
+static void TransposeBytes(const unsigned char *src, unsigned char *dst, std::size_t n, std::size_t elementSize,
+                           bool toSplit)
+{
+   for (std::size_t i = 0; i < n; ++i) {
+      for (std::size_t b = 0; b < elementSize; ++b) {
+         if (toSplit)
+            dst[b * n + i] = src[i * elementSize + b];
+         else
+            dst[i * elementSize + b] = src[b * n + i];
+      }
+   }
+}
+
+static void AddColumnsFromField(std::vector<ColumnPlan> &columns, const RNTupleDescriptor &desc,
+                                const RFieldDescriptor &fieldDesc)
+{
+   for (const auto &f : desc.GetFieldIterable(fieldDesc)) {
+      for (const auto &c : desc.GetColumnIterable(f)) {
+         if (c.IsAliasColumn())
+            continue;
+         ColumnPlan plan;
+         plan.fName = desc.GetQualifiedFieldName(f.GetId()) + "[" + std::to_string(c.GetIndex()) + "]";
+         plan.fPhysicalId = c.GetPhysicalId();
+         plan.fType = c.GetModel().GetType();
+         columns.emplace_back(plan);
+      }
+      AddColumnsFromField(columns, desc, f);
+   }
+}
+
+/// Collects the columns and their page lists from the descriptor
+static std::vector<ColumnPlan> CollectColumns(RPageSource &source)
+{
+   auto desc = source.GetSharedDescriptorGuard();
+   std::vector<ColumnPlan> columns;
+   AddColumnsFromField(columns, desc.GetRef(), desc->GetFieldDescriptor(desc->GetFieldZeroId()));
+
+   for (auto &col : columns) {
+      auto element = RColumnElementBase::Generate(col.fType);
+      for (const auto &cluster : desc->GetClusterIterable()) {
+         if (!cluster.ContainsColumn(col.fPhysicalId))
+            continue;
+         NTupleSize_t firstElement = 0;
+         for (const auto &pi : cluster.GetPageRange(col.fPhysicalId).fPageInfos) {
+            col.fPages.push_back(PageRef{cluster.GetId(), firstElement, pi.fNElements, pi.fLocator.fBytesOnStorage});
+            col.fBytesOnStorage += pi.fLocator.fBytesOnStorage;
+            col.fBytesInMemory += element->GetPackedSize(pi.fNElements);
+            firstElement += pi.fNElements;
+         }
+      }
+   }
+   return columns;
+}
+
+/// Reads a page and decompresses it into its packed, on-disk element representation
+static std::unique_ptr<unsigned char[]>
+LoadPackedPage(RPageSource &source, const ColumnPlan &col, const PageRef &page, std::size_t packedSize)
+{
+   auto sealedBuf = std::make_unique<unsigned char[]>(page.fBytesOnStorage);
+   RPageStorage::RSealedPage sealedPage;
+   sealedPage.fBuffer = sealedBuf.get();
+   source.LoadSealedPage(col.fPhysicalId, RClusterIndex(page.fClusterId, page.fFirstElement), sealedPage);
+   auto packed = std::make_unique<unsigned char[]>(packedSize);
+   RNTupleDecompressor::Unzip(sealedBuf.get(), page.fBytesOnStorage, packedSize, packed.get());
+   return packed;
+}
+
+/// Decompresses up to nSamples pages, spread evenly over the column, and trial-compresses them with every candidate
+static void TrialColumn(RPageSource &source, ColumnPlan &col, unsigned nSamples)
+{
+   if (col.fPages.empty())
+      return;
+   auto element = RColumnElementBase::Generate(col.fType);
+   nSamples = std::min<std::size_t>(nSamples, col.fPages.size());
+
+   for (unsigned s = 0; s < nSamples; ++s) {
+      const auto &page = col.fPages[s * col.fPages.size() / nSamples];
+      const auto packedSize = element->GetPackedSize(page.fNElements);
+      auto packed = LoadPackedPage(source, col, page, packedSize);
+      col.fSampleBytes += packedSize;
+
+      auto zipped = std::make_unique<unsigned char[]>(packedSize);
+      auto unzipped = std::make_unique<unsigned char[]>(packedSize);
+      for (int i = 0; i < kNumCandidates; ++i) {
+         auto szZip = RNTupleCompressor::Zip(packed.get(), packedSize, kCandidateSettings[i], zipped.get());
+         col.fZipBytes[i] += szZip;
+         double best = std::numeric_limits<double>::max();
+         for (int r = 0; r < kNumRepetitions; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            RNTupleDecompressor::Unzip(zipped.get(), szZip, packedSize, unzipped.get());
+            best = std::min(best,
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+         }
+         col.fUnzipSecs[i] += best;
+      }
+   }
+}
+
+/// Picks the setting with the smallest estimated read plus decompression time per column and re-tries the
+/// chosen setting with the alternative encoding
+static void ChooseSetting(RPageSource &source, ColumnPlan &col, double bandwidthMBs, unsigned nSamples)
+{
+   if (col.fSampleBytes == 0)
+      return;
+   for (int i = 0; i < kNumCandidates; ++i) {
+      double cost = double(col.fZipBytes[i]) / (bandwidthMBs * 1000. * 1000.) + col.fUnzipSecs[i];
+      if (col.fChoice < 0 || cost < col.fCost) {
+         col.fChoice = i;
+         col.fCost = cost;
+      }
+   }
+
+   auto element = RColumnElementBase::Generate(col.fType);
+   const auto elementSize = element->GetPackedSize(1);
+   if (elementSize <= 1 || element->GetPackedSize(8) != 8 * elementSize)
+      return;
+   const bool isSplit = IsSplitType(col.fType);
+   nSamples = std::min<std::size_t>(nSamples, col.fPages.size());
+   for (unsigned s = 0; s < nSamples; ++s) {
+      const auto &page = col.fPages[s * col.fPages.size() / nSamples];
+      const auto packedSize = element->GetPackedSize(page.fNElements);
+      auto packed = LoadPackedPage(source, col, page, packedSize);
+      auto transposed = std::make_unique<unsigned char[]>(packedSize);
+      TransposeBytes(packed.get(), transposed.get(), page.fNElements, elementSize, !isSplit);
+      auto zipped = std::make_unique<unsigned char[]>(packedSize);
+      col.fZipBytesAlt +=
+         RNTupleCompressor::Zip(transposed.get(), packedSize, kCandidateSettings[col.fChoice], zipped.get());
+   }
+}
+
+[[noreturn]]
+static void Usage(char *argv0)
+{
+   printf("Usage: %s [-n sample pages per column] [-B read bandwidth in MB/s] [-o plan file] file-name ntuple-name\n\n",
+          argv0);
+   printf("Options:\n");
+   printf("  -n pages\tNumber of pages per column used for the trial compression (defaults to 8)\n");
+   printf("  -B MB/s\tBandwidth of the storage medium the plan is made for (defaults to 300)\n");
+   printf("  -o path\tWrite the plan to the given file (defaults to `zipplan.txt`)\n");
+   exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned nSamples = 8;
+   double bandwidthMBs = 300.0;
+   std::string outputPath = "zipplan.txt";
+
+   int c;
+   while ((c = getopt(argc, argv, "hn:B:o:")) != -1) {
+      switch (c) {
+      case 'n':
+         nSamples = std::max(1, atoi(optarg));
+         break;
+      case 'B':
+         bandwidthMBs = atof(optarg);
+         break;
+      case 'o':
+         outputPath = optarg;
+         break;
+      case 'h':
+      default:
+         Usage(argv[0]);
+      }
+   }
+   if ((argc - optind) != 2 || bandwidthMBs <= 0)
+      Usage(argv[0]);
+
+   auto source = RPageSource::Create(argv[optind + 1], argv[optind], RNTupleReadOptions());
+   source->Attach();
+
+   auto columns = CollectColumns(*source);
+   std::uint64_t sumOnStorage = 0;
+   std::uint64_t sumPlanned = 0;
+   // Per column type: number of columns for which each candidate is chosen
+   std::map<std::string, std::vector<unsigned>> choicesByType;
+   for (auto &col : columns) {
+      TrialColumn(*source, col, nSamples);
+      ChooseSetting(*source, col, bandwidthMBs, nSamples);
+      if (col.fChoice < 0)
+         continue;
+      sumOnStorage += col.fBytesOnStorage;
+      sumPlanned += col.fBytesInMemory * (double(col.fZipBytes[col.fChoice]) / col.fSampleBytes);
+      auto &choices = choicesByType[RColumnElementBase::GetTypeName(col.fType)];
+      choices.resize(kNumCandidates);
+      choices[col.fChoice]++;
+   }
+
+   FILE *plan = fopen(outputPath.c_str(), "w");
+   if (!plan) {
+      fprintf(stderr, "cannot open %s\n", outputPath.c_str());
+      return 1;
+   }
+   fprintf(plan, "# compression plan for %s in %s, read bandwidth %.0f MB/s\n", argv[optind + 1], argv[optind],
+           bandwidthMBs);
+   fprintf(plan, "# column compression encoding type ratio unzip-MB/s\n");
+   for (const auto &col : columns) {
+      if (col.fChoice < 0)
+         continue;
+      const bool isSplit = IsSplitType(col.fType);
+      const bool altIsBetter = col.fZipBytesAlt > 0 && col.fZipBytesAlt < col.fZipBytes[col.fChoice];
+      const char *encoding = (isSplit != altIsBetter) ? "split" : "unsplit";
+      const double ratio = double(col.fZipBytes[col.fChoice]) / col.fSampleBytes;
+      const double unzipMBs =
+         (col.fUnzipSecs[col.fChoice] > 0) ? (col.fSampleBytes / col.fUnzipSecs[col.fChoice] / 1000. / 1000.) : 0.;
+      fprintf(plan, "%s %d %s %s %.3f %.0f\n", col.fName.c_str(), kCandidateSettings[col.fChoice], encoding,
+              RColumnElementBase::GetTypeName(col.fType).c_str(), ratio, unzipMBs);
+   }
+   fclose(plan);
+
+   printf("%-16s", "column type");
+   for (int i = 0; i < kNumCandidates; ++i)
+      printf(" %5d", kCandidateSettings[i]);
+   printf("\n");
+   for (const auto &[typeName, choices] : choicesByType) {
+      printf("%-16s", typeName.c_str());
+      for (auto n : choices)
+         printf(" %5u", n);
+      printf("\n");
+   }
+   printf("\nOn storage: %lu MB, planned: %lu MB\n", sumOnStorage / 1000 / 1000, sumPlanned / 1000 / 1000);
+   printf("Plan written to %s\n", outputPath.c_str());
+
+   return 0;
+}
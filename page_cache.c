@@ -0,0 +1,154 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+// Evicts individual files from the page cache and reports their page cache
+// residency.  Unlike clear_page_cache, it needs no privileges and leaves the
+// cached data of other files alone.  Optionally pre-warms the leading fraction
+// of the files, e.g. to reproduce partially cached benchmark runs.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BUF_SIZE (4 * 1024 * 1024)
+
+void Usage(char *progname) {
+  printf("Usage: %s [-e(vict)] [-w <fraction to pre-warm>] [-q(uiet)] <file>...\n"
+         "Reports the page cache residency of the files before and after eviction and pre-warming.\n"
+         "With both -e and -w, the files are evicted first.\n", progname);
+}
+
+// Returns the number of resident pages of the file or -1 on error
+int64_t GetResidentPages(int fd, uint64_t size, uint64_t *npages) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  *npages = (size + page_size - 1) / page_size;
+  if (size == 0)
+    return 0;
+
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  unsigned char *vec = malloc(*npages);
+  if (vec == NULL || mincore(map, size, vec) != 0) {
+    free(vec);
+    munmap(map, size);
+    return -1;
+  }
+  int64_t nresident = 0;
+  for (uint64_t i = 0; i < *npages; ++i)
+    nresident += vec[i] & 1;
+  free(vec);
+  munmap(map, size);
+  return nresident;
+}
+
+void PrintResidency(const char *path, const char *when, int fd, uint64_t size) {
+  uint64_t npages;
+  int64_t nresident = GetResidentPages(fd, size, &npages);
+  if (nresident < 0) {
+    fprintf(stderr, "cannot determine residency of %s\n", path);
+    return;
+  }
+  printf("%s [%s]: %ld/%lu pages resident (%.1f%%)\n", path, when, nresident, npages,
+         (npages == 0) ? 0.0 : 100.0 * nresident / npages);
+}
+
+// Reads the first nbytes of the file into the page cache.  Read-ahead is
+// disabled such that no pages beyond nbytes are cached.
+int Warm(int fd, uint64_t nbytes) {
+  char *buf = malloc(BUF_SIZE);
+  if (buf == NULL)
+    return -1;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+  uint64_t offset = 0;
+  while (offset < nbytes) {
+    size_t len = (nbytes - offset < BUF_SIZE) ? nbytes - offset : BUF_SIZE;
+    ssize_t n = pread(fd, buf, len, offset);
+    if (n <= 0) {
+      free(buf);
+      return (n == 0) ? 0 : -1;
+    }
+    offset += n;
+  }
+  free(buf);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int evict = 0;
+  double warm_fraction = -1.0;
+  int quiet = 0;
+  int c;
+  while ((c = getopt(argc, argv, "hvew:q")) != -1) {
+    switch (c) {
+      case 'h':
+      case 'v':
+        Usage(argv[0]);
+        return 0;
+      case 'e':
+        evict = 1;
+        break;
+      case 'w':
+        warm_fraction = atof(optarg);
+        if (warm_fraction < 0.0 || warm_fraction > 1.0) {
+          fprintf(stderr, "fraction to pre-warm must be between 0 and 1\n");
+          return 1;
+        }
+        break;
+      case 'q':
+        quiet = 1;
+        break;
+      default:
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  int retval = 0;
+  for (int i = optind; i < argc; ++i) {
+    const char *path = argv[i];
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+      fprintf(stderr, "cannot open %s\n", path);
+      if (fd >= 0)
+        close(fd);
+      retval = 1;
+      continue;
+    }
+
+    if (!quiet)
+      PrintResidency(path, "before", fd, info.st_size);
+    if (evict) {
+      // Dirty pages are not evicted by POSIX_FADV_DONTNEED
+      fdatasync(fd);
+      int err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      if (err != 0) {
+        fprintf(stderr, "cannot evict %s (%s)\n", path, strerror(err));
+        retval = 1;
+      }
+    }
+    if (warm_fraction >= 0.0) {
+      uint64_t nbytes = warm_fraction * info.st_size;
+      if (Warm(fd, nbytes) != 0) {
+        fprintf(stderr, "cannot read %s\n", path);
+        retval = 1;
+      }
+    }
+    if (!quiet && (evict || warm_fraction >= 0.0))
+      PrintResidency(path, "after", fd, info.st_size);
+    close(fd);
+  }
+  return retval;
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+
+# Usage: run_emulate.sh
+# Same latency sweep as run_http.sh but with the remote storage emulated by
+# fuse_forward on top of the local files in DATA_ROOT; no network or root
+# privileges required.  Set EMUL_BANDWIDTH (MB/s) and EMUL_JITTER
+# (e.g. normal:5) to add a bandwidth cap and jitter.
+
+if [ x$DATA_ROOT != "x" ]; then
+  SELECT_DATA_ROOT="DATA_ROOT=$DATA_ROOT"
+fi
+
+for sample in lhcb cms h1X10; do
+  for latency in 0 10 50 100; do
+    for format in ntuple root; do
+      make $SELECT_DATA_ROOT EMUL_BANDWIDTH=$EMUL_BANDWIDTH EMUL_JITTER=$EMUL_JITTER \
+        result_read_emul.${sample}+${latency}ms~zstd.${format}.txt
+    done
+  done
+done
@@ -0,0 +1,23 @@
+#!/bin/sh
+
+# Usage: run_engines.sh [ssd|hdd]
+# Compares the default pread I/O engine with io_uring, with and without O_DIRECT,
+# and with reading from a memory mapping of the file.
+# DATA_ROOT should point to a directory on the respective medium.
+
+MEDIUM=${1:-ssd}
+
+if [ x$DATA_ROOT != "x" ]; then
+  SELECT_DATA_ROOT="DATA_ROOT=$DATA_ROOT"
+fi
+
+if [ "$(./check-uring)" != "uring OK" ]; then
+  echo "io_uring not available"
+  exit 1
+fi
+
+for sample in lhcb cms h1X10; do
+  for engine in pread uring uring-direct mmap; do
+    make $SELECT_DATA_ROOT result_read_${MEDIUM}.${sample}+E${engine}~zstd.ntuple.txt
+  done
+done
@@ -0,0 +1,23 @@
+#!/bin/sh
+
+# Usage: run_prefetch.sh [ssd|hdd|http]
+# Sweeps cluster bunch size (prefetch depth), unzip threads, and cluster cache memory budget.
+# For ssd and hdd, DATA_ROOT should point to a directory on the respective medium.
+
+MEDIUM=${1:-ssd}
+
+if [ x$DATA_ROOT != "x" ]; then
+  SELECT_DATA_ROOT="DATA_ROOT=$DATA_ROOT"
+fi
+
+for sample in lhcb cms h1X10; do
+  for bunch in 0 1 2 4 8 16 32; do
+    make $SELECT_DATA_ROOT result_read_${MEDIUM}.${sample}+X${bunch}~zstd.ntuple.txt
+  done
+  for threads in 0 1 2 4 8 16; do
+    make $SELECT_DATA_ROOT result_read_${MEDIUM}.${sample}+U${threads}~zstd.ntuple.txt
+  done
+  for budget in 64 128 256 512 1024; do
+    make $SELECT_DATA_ROOT result_read_${MEDIUM}.${sample}+M${budget}~zstd.ntuple.txt
+  done
+done
@@ -0,0 +1,192 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+#include "timeline.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// Beyond this, records are dropped and counted rather than growing the buffer
+// of a thread without bounds (40MB per thread)
+const size_t kMaxRecordsPerThread = 1 << 20;
+
+struct TimelineBuffer {
+  uint32_t thread_id;
+  std::string thread_name;
+  std::vector<TimelineRecord> records;
+  uint64_t n_dropped = 0;
+};
+
+std::atomic<bool> g_timeline_enabled{false};
+std::chrono::steady_clock::time_point g_timeline_start;
+// Protects the list of buffers; the buffers themselves are only written by
+// their threads.  The buffers outlive their threads.
+std::mutex g_timeline_lock;
+std::vector<std::unique_ptr<TimelineBuffer>> g_timeline_buffers;
+thread_local TimelineBuffer *t_timeline_buffer = nullptr;
+
+TimelineBuffer *GetTimelineBuffer() {
+  if (t_timeline_buffer)
+    return t_timeline_buffer;
+
+  auto buffer = std::make_unique<TimelineBuffer>();
+  buffer->thread_id = syscall(SYS_gettid);
+  char name[16];
+  if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0)
+    buffer->thread_name = name;
+  buffer->records.reserve(4096);
+  t_timeline_buffer = buffer.get();
+  std::lock_guard<std::mutex> guard(g_timeline_lock);
+  g_timeline_buffers.emplace_back(std::move(buffer));
+  return t_timeline_buffer;
+}
+
+const char *GetCategoryName(TimelineCategory category) {
+  switch (category) {
+    case TimelineCategory::kRead: return "read";
+    case TimelineCategory::kUnzip: return "unzip";
+    case TimelineCategory::kLoop: return "event loop";
+  }
+  return "unknown";
+}
+
+// Thread names are set by the threading libraries but may contain anything
+std::string EscapeJson(const std::string &str) {
+  std::string result;
+  for (char c : str) {
+    if (c == '"' || c == '\\')
+      result.push_back('\\');
+    if (static_cast<unsigned char>(c) >= 0x20)
+      result.push_back(c);
+  }
+  return result;
+}
+
+}  // anonymous namespace
+
+
+void StartTimeline() {
+  g_timeline_start = std::chrono::steady_clock::now();
+  g_timeline_enabled = true;
+}
+
+
+bool IsTimelineEnabled() {
+  return g_timeline_enabled.load(std::memory_order_relaxed);
+}
+
+
+uint64_t GetTimelineNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - g_timeline_start).count();
+}
+
+
+void AddTimelineRecord(TimelineCategory category, uint64_t begin_ns,
+                       uint64_t end_ns, uint64_t arg0, uint64_t arg1)
+{
+  if (!IsTimelineEnabled())
+    return;
+  TimelineBuffer *buffer = GetTimelineBuffer();
+  if (buffer->records.size() >= kMaxRecordsPerThread) {
+    buffer->n_dropped++;
+    return;
+  }
+  buffer->records.emplace_back(
+    TimelineRecord{begin_ns, end_ns, arg0, arg1, buffer->thread_id, category});
+}
+
+
+void TimelineLoop::Start(uint64_t first) {
+  auto next = std::upper_bound(fClusterStarts.begin(), fClusterStarts.end(), first);
+  fChunkFirst = first;
+  fChunkEnd = (next == fClusterStarts.end()) ? fLast : std::min(*next, fLast);
+  fBeginNs = GetTimelineNs();
+}
+
+
+void TimelineLoop::Advance(uint64_t entry) {
+  // The new chunk starts with the cluster of entry
+  auto next = std::upper_bound(fClusterStarts.begin(), fClusterStarts.end(), entry);
+  const uint64_t cluster_first =
+    (next == fClusterStarts.begin()) ? fChunkEnd : std::max(*std::prev(next), fChunkEnd);
+  const uint64_t now_ns = GetTimelineNs();
+  AddTimelineRecord(TimelineCategory::kLoop, fBeginNs, now_ns, fChunkFirst, cluster_first - fChunkFirst);
+  fChunkFirst = cluster_first;
+  fChunkEnd = (next == fClusterStarts.end()) ? fLast : std::min(*next, fLast);
+  fBeginNs = now_ns;
+}
+
+
+TimelineLoop::~TimelineLoop() {
+  if (fChunkEnd != UINT64_MAX) {
+    AddTimelineRecord(TimelineCategory::kLoop, fBeginNs, GetTimelineNs(), fChunkFirst,
+                      fLast - fChunkFirst);
+  }
+}
+
+
+bool WriteTimeline(const std::string &path) {
+  FILE *f = fopen(path.c_str(), "w");
+  if (f == nullptr) {
+    fprintf(stderr, "cannot write timeline to %s\n", path.c_str());
+    return false;
+  }
+
+  const int pid = getpid();
+  uint64_t n_records = 0;
+  uint64_t n_dropped = 0;
+  std::lock_guard<std::mutex> guard(g_timeline_lock);
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"benchmark\"}}", pid);
+  for (const auto &b : g_timeline_buffers) {
+    if (!b->thread_name.empty()) {
+      fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+              pid, b->thread_id, EscapeJson(b->thread_name).c_str());
+    }
+    for (const auto &r : b->records) {
+      // Complete events ("X") with microsecond time stamps
+      fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+              "\"ts\":%.3f,\"dur\":%.3f",
+              GetCategoryName(r.fCategory), GetCategoryName(r.fCategory), pid, r.fThreadId,
+              r.fBeginNs / 1000.0, (r.fEndNs - r.fBeginNs) / 1000.0);
+      switch (r.fCategory) {
+        case TimelineCategory::kRead:
+          fprintf(f, ",\"args\":{\"bytes\":%" PRIu64 ",\"requests\":%" PRIu64 "}}", r.fArg0, r.fArg1);
+          break;
+        case TimelineCategory::kLoop:
+          fprintf(f, ",\"args\":{\"first_entry\":%" PRIu64 ",\"entries\":%" PRIu64 "}}", r.fArg0, r.fArg1);
+          break;
+        default:
+          fprintf(f, "}");
+      }
+    }
+    n_records += b->records.size();
+    n_dropped += b->n_dropped;
+  }
+  fprintf(f, "\n]}\n");
+  const bool is_ok = (fclose(f) == 0);
+  if (!is_ok) {
+    fprintf(stderr, "cannot write timeline to %s\n", path.c_str());
+    return false;
+  }
+
+  printf("Timeline: %" PRIu64 " events of %zu threads written to %s\n",
+         n_records, g_timeline_buffers.size(), path.c_str());
+  if (n_dropped > 0)
+    fprintf(stderr, "Warning: %" PRIu64 " timeline events dropped\n", n_dropped);
+  return true;
+}
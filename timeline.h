@@ -0,0 +1,111 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Timeline of the cluster reads, the page decompression tasks, and the event
+// loop chunks (clusters) of a benchmark run, with the thread that executed them.  Meant
+// to show whether the background reads of the cluster cache overlap with the
+// decompression and the event loop, or whether the pipeline has bubbles.  The
+// timeline is exported in the Chrome trace event format (JSON), which can be
+// loaded into Perfetto (ui.perfetto.dev) or chrome://tracing.
+//
+// Every thread records into its own buffer, without locks.  Recording is
+// disabled unless StartTimeline() has been called before the threads start.
+
+enum class TimelineCategory : uint8_t {
+  kRead,   // vector read of the page source, i.e. a cluster bunch; args: bytes, requests
+  kUnzip,  // page decompression task; no args
+  kLoop,   // event loop chunk; args: first entry, number of entries
+};
+
+struct TimelineRecord {
+  uint64_t fBeginNs;  ///< Relative to StartTimeline()
+  uint64_t fEndNs;
+  uint64_t fArg0;
+  uint64_t fArg1;
+  uint32_t fThreadId;
+  TimelineCategory fCategory;
+};
+
+void StartTimeline();
+bool IsTimelineEnabled();
+// Nanoseconds since StartTimeline()
+uint64_t GetTimelineNs();
+void AddTimelineRecord(TimelineCategory category, uint64_t begin_ns,
+                       uint64_t end_ns, uint64_t arg0, uint64_t arg1);
+// Writes the records of all threads as a Chrome trace JSON file.  Must be
+// called after the recording threads have finished.  On failure, prints the
+// reason to stderr and returns false.
+bool WriteTimeline(const std::string &path);
+
+// Records the time from construction to destruction, if the timeline is enabled
+class TimelineScope {
+  TimelineCategory fCategory;
+  uint64_t fArg0;
+  uint64_t fArg1;
+  bool fIsEnabled;
+  uint64_t fBeginNs = 0;
+
+public:
+  TimelineScope(TimelineCategory category, uint64_t arg0 = 0, uint64_t arg1 = 0)
+    : fCategory(category), fArg0(arg0), fArg1(arg1),
+      fIsEnabled(IsTimelineEnabled())
+  {
+    if (fIsEnabled)
+      fBeginNs = GetTimelineNs();
+  }
+  TimelineScope(const TimelineScope &) = delete;
+  TimelineScope &operator=(const TimelineScope &) = delete;
+  ~TimelineScope() {
+    if (fIsEnabled)
+      AddTimelineRecord(fCategory, fBeginNs, GetTimelineNs(), fArg0, fArg1);
+  }
+};
+
+// Records the event loop over the entry range [first, last) of a thread as one
+// kLoop event per cluster, such that the timeline shows the progress of the
+// loop next to the cluster reads.  Next() is called with ascending entry
+// numbers, e.g. for every entry or for every window of a bulk loop; clusters
+// that are skipped are part of the event of the next entry.  The cluster
+// starts are only computed if the timeline is enabled.  If the timeline is
+// disabled, Next() is a single comparison.
+class TimelineLoop {
+  std::vector<uint64_t> fClusterStarts;
+  uint64_t fLast;
+  uint64_t fChunkFirst = 0;
+  // Entry that ends the current chunk; never reached if the timeline is disabled
+  uint64_t fChunkEnd = UINT64_MAX;
+  uint64_t fBeginNs = 0;
+
+  void Start(uint64_t first);
+  void Advance(uint64_t entry);
+
+public:
+  template <typename FnClusterStarts>
+  TimelineLoop(uint64_t first, uint64_t last, FnClusterStarts fn_cluster_starts)
+    : fLast(last)
+  {
+    if (IsTimelineEnabled()) {
+      fClusterStarts = fn_cluster_starts();
+      Start(first);
+    }
+  }
+  TimelineLoop(const TimelineLoop &) = delete;
+  TimelineLoop &operator=(const TimelineLoop &) = delete;
+  ~TimelineLoop();
+
+  void Next(uint64_t entry) {
+    if (entry >= fChunkEnd)
+      Advance(entry);
+  }
+};
+
+#endif  // TIMELINE_H_
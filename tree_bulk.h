@@ -0,0 +1,98 @@
+/**
+ * Copyright CERN; jblomer@cern.ch
+ */
+
+#ifndef TREE_BULK_H_
+#define TREE_BULK_H_
+
+#include <TBranch.h>
+#include <TBufferFile.h>
+#include <TMath.h>
+#include <TTree.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+
+namespace tree_bulk_detail {
+
+inline std::uint8_t ByteSwap(std::uint8_t v) { return v; }
+inline std::uint16_t ByteSwap(std::uint16_t v) { return __builtin_bswap16(v); }
+inline std::uint32_t ByteSwap(std::uint32_t v) { return __builtin_bswap32(v); }
+inline std::uint64_t ByteSwap(std::uint64_t v) { return __builtin_bswap64(v); }
+
+template <std::size_t N> struct UIntOfSize {};
+template <> struct UIntOfSize<1> { typedef std::uint8_t type; };
+template <> struct UIntOfSize<2> { typedef std::uint16_t type; };
+template <> struct UIntOfSize<4> { typedef std::uint32_t type; };
+template <> struct UIntOfSize<8> { typedef std::uint64_t type; };
+
+} // namespace tree_bulk_detail
+
+/// Converts n big-endian values, as stored in TTree baskets, into native values.  Written as a flat loop over
+/// fixed-size integers so that the compiler turns it into vector shuffles.
+template <typename T>
+void BulkFromBigEndian(const char *src, T *dst, std::size_t n)
+{
+   static_assert(std::is_trivially_copyable<T>::value, "only fixed-size types are supported");
+   typedef typename tree_bulk_detail::UIntOfSize<sizeof(T)>::type U;
+   for (std::size_t i = 0; i < n; ++i) {
+      U v;
+      memcpy(&v, src + i * sizeof(T), sizeof(T));
+      v = tree_bulk_detail::ByteSwap(v);
+      memcpy(dst + i, &v, sizeof(T));
+   }
+}
+
+
+/// Reads a fixed-size, top-level branch basket by basket through TBranch::GetBulkRead() instead of entry by
+/// entry through GetEntry().  The values of the currently loaded basket are kept in native byte order.
+template <typename T>
+class TreeBulkBranch {
+   TBranch *fBranch;
+   TBufferFile fBuffer;
+   std::vector<T> fValues;
+   /// Entry range [fFirst, fEnd) of the currently loaded basket
+   Long64_t fFirst = 0;
+   Long64_t fEnd = 0;
+
+public:
+   TreeBulkBranch(TTree *tree, const char *name)
+      : fBranch(tree->GetBranch(name)), fBuffer(TBuffer::kWrite, 32 * 1024)
+   {
+      if (!fBranch || !fBranch->SupportsBulkRead()) {
+         std::cerr << "Branch " << name << " cannot be read in bulk" << std::endl;
+         abort();
+      }
+      // The cache does not learn about branches that are never read through GetEntry()
+      tree->AddBranchToCache(fBranch);
+   }
+
+   /// Makes sure that the basket containing entry is loaded.  Returns the first entry past the basket.
+   Long64_t Load(Long64_t entry)
+   {
+      if (entry >= fFirst && entry < fEnd)
+         return fEnd;
+
+      auto basketEntries = fBranch->GetBasketEntry();
+      auto idxBasket = TMath::BinarySearch(fBranch->GetWriteBasket() + 1, basketEntries, entry);
+      fFirst = basketEntries[idxBasket];
+      auto nEntries = fBranch->GetBulkRead().GetEntriesSerialized(fFirst, fBuffer);
+      if (nEntries <= 0) {
+         std::cerr << "Bulk read of branch " << fBranch->GetName() << " failed at entry " << fFirst << std::endl;
+         abort();
+      }
+      fEnd = fFirst + nEntries;
+      fValues.resize(nEntries);
+      BulkFromBigEndian(fBuffer.GetCurrent(), fValues.data(), nEntries);
+      return fEnd;
+   }
+
+   /// Pointer to the native value of entry; valid until the next basket is loaded
+   const T *Get(Long64_t entry) const { return fValues.data() + (entry - fFirst); }
+};
+
+#endif // TREE_BULK_H_
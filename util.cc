@@ -6,14 +6,27 @@
 
 #include "util.h"
 
+#include <ROOT/RNTupleDescriptor.hxx>
+#include <ROOT/RNTupleMetrics.hxx>
+#include <ROOT/RNTupleReader.hxx>
+#include <ROOT/RPageStorage.hxx>
 #include <TFile.h>
+#include <TROOT.h>
+#include <TTree.h>
+#include <TTreePerfStats.h>
 
 #include <inttypes.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <thread>
 
 static void SplitPath(
   const std::string &path,
@@ -203,3 +216,500 @@ TFile *OpenOrDownload(const std::string &path) {
   // Download should have succeeded, try again!
   return TFile::Open(path.c_str());
 }
+
+
+std::vector<uint64_t> GetClusterStarts(
+  const ROOT::Experimental::RNTupleDescriptor &desc)
+{
+  std::vector<uint64_t> result;
+  for (const auto &cluster : desc.GetClusterIterable())
+    result.push_back(cluster.GetFirstEntryIndex());
+  // The cluster iterable is in cluster id order, which needs not be the entry order
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+
+std::vector<uint64_t> GetClusterStarts(TTree *tree) {
+  std::vector<uint64_t> result;
+  const Long64_t n_entries = tree->GetEntries();
+  auto iter = tree->GetClusterIterator(0);
+  Long64_t start;
+  while ((start = iter()) < n_entries)
+    result.push_back(start);
+  return result;
+}
+
+
+/**
+ * Splits [0, n_entries) into at most n_chunks ranges of roughly equal number
+ * of entries.  Ranges start and end on cluster boundaries so that no cluster
+ * is read by more than one worker.
+ */
+std::vector<EntryRange> PartitionEntries(
+  const std::vector<uint64_t> &cluster_starts,
+  const uint64_t n_entries,
+  const unsigned n_chunks)
+{
+  std::vector<EntryRange> result;
+  if (n_entries == 0)
+    return result;
+  if (n_chunks <= 1 || cluster_starts.size() <= 1) {
+    result.push_back(EntryRange(0, n_entries));
+    return result;
+  }
+
+  uint64_t first = 0;
+  for (unsigned i = 1; i < cluster_starts.size(); ++i) {
+    const uint64_t boundary = cluster_starts[i];
+    if (boundary <= first || boundary >= n_entries)
+      continue;
+    // Cut once the range reaches its share of the remaining entries
+    const unsigned chunks_left = n_chunks - result.size();
+    if (chunks_left <= 1)
+      break;
+    const uint64_t target = (n_entries - first) / chunks_left;
+    if (boundary - first >= target) {
+      result.push_back(EntryRange(first, boundary));
+      first = boundary;
+    }
+  }
+  result.push_back(EntryRange(first, n_entries));
+  return result;
+}
+
+
+/**
+ * Calls fn(0) ... fn(n_threads - 1), each on its own thread, and waits for
+ * all of them.  A single task runs on the calling thread.
+ */
+void RunInThreads(
+  const unsigned n_threads,
+  const std::function<void(unsigned)> &fn)
+{
+  if (n_threads == 1) {
+    fn(0);
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < n_threads; ++i)
+    threads.emplace_back(fn, i);
+  for (auto &t : threads)
+    t.join();
+}
+
+
+/**
+ * Average size of the clusters on storage, in bytes.  Only reads the
+ * ntuple's header and footer.
+ */
+uint64_t GetAverageClusterSize(
+  const std::string &ntuple_name,
+  const std::string &path)
+{
+  auto source =
+    ROOT::Experimental::Internal::RPageSource::Create(ntuple_name, path);
+  source->Attach();
+  auto desc = source->GetSharedDescriptorGuard();
+
+  uint64_t n_bytes = 0;
+  uint64_t n_clusters = 0;
+  for (const auto &cluster : desc->GetClusterIterable()) {
+    for (auto column_id : cluster.GetColumnIds()) {
+      const auto &page_range = cluster.GetPageRange(column_id);
+      for (const auto &page_info : page_range.fPageInfos)
+        n_bytes += page_info.fLocator.fBytesOnStorage;
+    }
+    n_clusters++;
+  }
+  return (n_clusters == 0) ? 0 : n_bytes / n_clusters;
+}
+
+
+/**
+ * The cluster pool keeps the bunch being processed and prefetches the next
+ * one, so roughly two bunches of clusters are in memory.  Reduces the bunch
+ * size until that fits the budget, but never below a single cluster.
+ */
+int CapClusterBunchSize(
+  const int cluster_bunch_size,
+  const uint64_t avg_cluster_size,
+  const unsigned memory_budget_mb)
+{
+  if (cluster_bunch_size < 1 || memory_budget_mb == 0 || avg_cluster_size == 0)
+    return cluster_bunch_size;
+  const uint64_t budget = uint64_t(memory_budget_mb) * 1024 * 1024;
+  const uint64_t max_bunch_size =
+    std::max(uint64_t(1), budget / (2 * avg_cluster_size));
+  return std::min(uint64_t(cluster_bunch_size), max_bunch_size);
+}
+
+
+void PrintPrefetchSettings(
+  const int cluster_bunch_size,
+  const bool use_unzip_mt,
+  const unsigned memory_budget_mb,
+  const bool unzip_threads_only_mt)
+{
+  unsigned n_unzip_threads = 0;
+  if (use_unzip_mt && ROOT::IsImplicitMTEnabled())
+    n_unzip_threads = ROOT::GetThreadPoolSize();
+  std::cout << "Prefetch-ClusterBunchSize: " << std::max(0, cluster_bunch_size)
+            << std::endl;
+  std::cout << "Prefetch-UnzipThreads: " << n_unzip_threads << std::endl;
+  std::cout << "Prefetch-MemoryBudget: " << memory_budget_mb << "MB"
+            << std::endl;
+  const char *implicit_mt = "off";
+  if (ROOT::IsImplicitMTEnabled())
+    implicit_mt = unzip_threads_only_mt ? "on (by -u)" : "on";
+  std::cout << "Prefetch-ImplicitMT: " << implicit_mt << std::endl;
+}
+
+
+void PrintRuntime(
+  const int64_t runtime_init_us,
+  const int64_t runtime_analysis_us,
+  AnalysisResults *results)
+{
+  std::cout << "Runtime-Initialization: " << runtime_init_us << "us" << std::endl;
+  std::cout << "Runtime-Analysis: " << runtime_analysis_us << "us" << std::endl;
+  results->runtime_init_us = runtime_init_us;
+  results->runtime_analysis_us = runtime_analysis_us;
+}
+
+
+static void AddMetric(
+  const std::string &name,
+  const double value,
+  AnalysisResults *results)
+{
+  for (auto &m : results->metrics) {
+    if (m.first == name) {
+      m.second += value;
+      return;
+    }
+  }
+  results->metrics.emplace_back(name, value);
+}
+
+
+/**
+ * The metrics do not provide access to the list of counters, so the counters
+ * are taken from the printout, which has one
+ * "<qualified name>|<description>|<unit>|<value>" line per counter.  The
+ * payload and overhead bytes read from storage sum up to the bytes read.
+ */
+void AddNTupleMetrics(
+  const ROOT::Experimental::RNTupleReader &reader,
+  AnalysisResults *results)
+{
+  AddNTupleMetrics(reader.GetMetrics(), results);
+}
+
+
+void AddNTupleMetrics(
+  const ROOT::Experimental::Detail::RNTupleMetrics &metrics,
+  AnalysisResults *results)
+{
+  std::ostringstream printout;
+  metrics.Print(printout);
+  std::istringstream lines(printout.str());
+  std::string line;
+  while (std::getline(lines, line)) {
+    auto fields = SplitString(line, '|');
+    if (fields.size() != 4)
+      continue;
+    char *end;
+    double value = strtod(fields[3].c_str(), &end);
+    if (fields[3].empty() || *end != '\0')
+      continue;
+    AddMetric(fields[0], value, results);
+
+    const std::string &name = fields[0];
+    for (const std::string suffix : {".szReadPayload", ".szReadOverhead"}) {
+      if (name.length() > suffix.length() &&
+          name.compare(name.length() - suffix.length(), suffix.length(), suffix) == 0)
+      {
+        results->bytes_read = std::max(int64_t(0), results->bytes_read) + int64_t(value);
+      }
+    }
+  }
+}
+
+
+void AddTreePerfStats(TTreePerfStats *perf_stats, AnalysisResults *results) {
+  AddMetric("TTreePerfStats.ReadCalls", perf_stats->GetReadCalls(), results);
+  AddMetric("TTreePerfStats.BytesRead", perf_stats->GetBytesRead(), results);
+  AddMetric("TTreePerfStats.BytesReadExtra", perf_stats->GetBytesReadExtra(), results);
+  AddMetric("TTreePerfStats.DiskTime", perf_stats->GetDiskTime(), results);
+  AddMetric("TTreePerfStats.UnzipTime", perf_stats->GetUnzipTime(), results);
+  AddMetric("TTreePerfStats.CpuTime", perf_stats->GetCpuTime(), results);
+  AddMetric("TTreePerfStats.RealTime", perf_stats->GetRealTime(), results);
+}
+
+
+static std::string QuoteJson(const std::string &str) {
+  std::string result = "\"";
+  for (char c : str) {
+    switch (c) {
+      case '"': result += "\\\""; break;
+      case '\\': result += "\\\\"; break;
+      case '\n': result += "\\n"; break;
+      case '\t': result += "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          result += buf;
+        } else {
+          result += c;
+        }
+    }
+  }
+  return result + "\"";
+}
+
+
+static std::string FormatJsonInt(const int64_t value) {
+  return (value < 0) ? "null" : std::to_string(value);
+}
+
+
+std::string GetResultsJson(const AnalysisResults &results) {
+  std::ostringstream json;
+  json << "{\"analysis\": " << QuoteJson(results.analysis)
+       << ", \"input\": " << QuoteJson(results.input)
+       << ", \"method\": " << QuoteJson(results.method)
+       << ", \"root_version\": " << QuoteJson(gROOT->GetVersion())
+       << ", \"runtime_init_us\": " << FormatJsonInt(results.runtime_init_us)
+       << ", \"runtime_analysis_us\": " << FormatJsonInt(results.runtime_analysis_us)
+       << ", \"runtime_main_us\": " << FormatJsonInt(results.runtime_main_us)
+       << ", \"events_read\": " << FormatJsonInt(results.events_read)
+       << ", \"events_selected\": " << FormatJsonInt(results.events_selected)
+       << ", \"bytes_read\": " << FormatJsonInt(results.bytes_read)
+       << ", \"metrics\": {";
+  json.precision(17);
+  for (unsigned i = 0; i < results.metrics.size(); ++i) {
+    json << ((i == 0) ? "" : ", ") << QuoteJson(results.metrics[i].first)
+         << ": " << results.metrics[i].second;
+  }
+  json << "}}";
+  return json.str();
+}
+
+
+namespace {
+
+struct PerfCounter {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+constexpr uint64_t HwCache(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+const PerfCounter kPerfCounters[] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"stalled-cycles-frontend", PERF_TYPE_HARDWARE,
+   PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+  {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {"L1d-load-misses", PERF_TYPE_HW_CACHE, HwCache(PERF_COUNT_HW_CACHE_L1D)},
+  {"LLC-load-misses", PERF_TYPE_HW_CACHE, HwCache(PERF_COUNT_HW_CACHE_LL)},
+  {"dTLB-load-misses", PERF_TYPE_HW_CACHE, HwCache(PERF_COUNT_HW_CACHE_DTLB)},
+};
+constexpr unsigned kNumPerfCounters =
+  sizeof(kPerfCounters) / sizeof(kPerfCounters[0]);
+
+// Raw read-out of a counter: value, time enabled, time running
+struct PerfReading {
+  uint64_t values[3] = {0, 0, 0};
+};
+
+struct PerfPhase {
+  std::string name;
+  // Negative if the counter is not available
+  double values[kNumPerfCounters];
+};
+
+bool g_perf_started = false;
+int g_perf_fds[kNumPerfCounters];
+PerfReading g_perf_last[kNumPerfCounters];
+std::vector<PerfPhase> g_perf_phases;
+
+}  // anonymous namespace
+
+
+static PerfReading ReadPerfCounter(int fd) {
+  PerfReading reading;
+  if ((fd < 0) ||
+      (read(fd, reading.values, sizeof(reading.values)) !=
+       sizeof(reading.values)))
+  {
+    reading.values[1] = reading.values[2] = 0;
+  }
+  return reading;
+}
+
+
+/**
+ * Counts the user-space events of the calling process and of the threads it
+ * creates from now on.  The counts of inherited threads are only added to the
+ * process' counters when the threads exit; the threads of the implicit
+ * multi-threading pool, e.g. for parallel decompression, live until the end of
+ * the process and are thus not included.
+ */
+void StartPerfCounters() {
+  for (unsigned i = 0; i < kNumPerfCounters; ++i) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = kPerfCounters[i].type;
+    attr.config = kPerfCounters[i].config;
+    attr.inherit = 1;
+    // Allows for counting with the default perf_event_paranoid setting
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    g_perf_fds[i] =
+      syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (g_perf_fds[i] < 0) {
+      std::cerr << "Warning: perf counter " << kPerfCounters[i].name
+                << " not available" << std::endl;
+    }
+  }
+  for (unsigned i = 0; i < kNumPerfCounters; ++i)
+    g_perf_last[i] = ReadPerfCounter(g_perf_fds[i]);
+  g_perf_started = true;
+}
+
+
+/**
+ * The difference to the previous reading, scaled up by the fraction of time
+ * the counter was actually running if the PMU multiplexed the counters.
+ */
+void MarkPerfPhase(const std::string &phase) {
+  if (!g_perf_started)
+    return;
+  PerfPhase result;
+  result.name = phase;
+  for (unsigned i = 0; i < kNumPerfCounters; ++i) {
+    PerfReading now = ReadPerfCounter(g_perf_fds[i]);
+    const uint64_t delta = now.values[0] - g_perf_last[i].values[0];
+    const uint64_t enabled = now.values[1] - g_perf_last[i].values[1];
+    const uint64_t running = now.values[2] - g_perf_last[i].values[2];
+    if (g_perf_fds[i] < 0)
+      result.values[i] = -1.0;
+    else if (running == 0)
+      result.values[i] = (delta == 0) ? 0.0 : -1.0;
+    else
+      result.values[i] = double(delta) * enabled / running;
+    g_perf_last[i] = now;
+  }
+  // Phases of the same name, e.g. the event loops over several samples, add up
+  for (auto &p : g_perf_phases) {
+    if (p.name != phase)
+      continue;
+    for (unsigned i = 0; i < kNumPerfCounters; ++i) {
+      p.values[i] = (p.values[i] < 0.0 || result.values[i] < 0.0)
+                    ? -1.0 : p.values[i] + result.values[i];
+    }
+    return;
+  }
+  g_perf_phases.emplace_back(result);
+}
+
+
+static double SumMetrics(
+  const AnalysisResults &results,
+  const std::string &suffix)
+{
+  double sum = 0.0;
+  for (const auto &m : results.metrics) {
+    const std::string &name = m.first;
+    if (name.length() >= suffix.length() &&
+        name.compare(name.length() - suffix.length(), suffix.length(), suffix) == 0)
+    {
+      sum += m.second;
+    }
+  }
+  return sum;
+}
+
+
+void PrintPerfCounters(const AnalysisResults &results) {
+  if (!g_perf_started)
+    return;
+
+  printf("Hardware counters (user space):\n");
+  printf("   %-24s", "counter");
+  for (const auto &p : g_perf_phases)
+    printf(" %16s", p.name.c_str());
+  printf("\n");
+  for (unsigned i = 0; i < kNumPerfCounters; ++i) {
+    printf("   %-24s", kPerfCounters[i].name);
+    for (const auto &p : g_perf_phases) {
+      if (p.values[i] < 0.0)
+        printf(" %16s", "n/a");
+      else
+        printf(" %16.0f", p.values[i]);
+    }
+    printf("\n");
+  }
+  // Derived ratios; the counter indexes follow kPerfCounters
+  printf("   %-24s", "IPC");
+  for (const auto &p : g_perf_phases) {
+    if (p.values[1] < 0.0 || p.values[0] <= 0.0)
+      printf(" %16s", "n/a");
+    else
+      printf(" %16.2f", p.values[1] / p.values[0]);
+  }
+  printf("\n");
+  printf("   %-24s", "frontend stall share");
+  for (const auto &p : g_perf_phases) {
+    if (p.values[2] < 0.0 || p.values[0] <= 0.0)
+      printf(" %16s", "n/a");
+    else
+      printf(" %15.1f%%", 100.0 * p.values[2] / p.values[0]);
+  }
+  printf("\n");
+
+  // The I/O timers are in ns for RNTuple and in s for TTreePerfStats.  With
+  // the cluster cache or implicit multi-threading, reading and decompression
+  // partly run in the background and overlap with the event loop.
+  if (results.runtime_analysis_us <= 0)
+    return;
+  const double loop_ms = results.runtime_analysis_us / 1000.0;
+  const double read_ms = SumMetrics(results, ".timeWallRead") / 1e6 +
+                         SumMetrics(results, "TTreePerfStats.DiskTime") * 1e3;
+  const double unzip_ms = SumMetrics(results, ".timeWallUnzip") / 1e6 +
+                          SumMetrics(results, "TTreePerfStats.UnzipTime") * 1e3;
+  if (read_ms == 0.0 && unzip_ms == 0.0)
+    return;
+  printf("Event loop time split (from the I/O metrics):\n");
+  printf("   %-28s %12.1f ms\n", "event loop", loop_ms);
+  printf("   %-28s %12.1f ms (%5.1f%%)\n", "read", read_ms,
+         100.0 * read_ms / loop_ms);
+  printf("   %-28s %12.1f ms (%5.1f%%)\n", "decompression", unzip_ms,
+         100.0 * unzip_ms / loop_ms);
+  const double rest_ms = std::max(0.0, loop_ms - read_ms - unzip_ms);
+  printf("   %-28s %12.1f ms (%5.1f%%)\n", "deserialization, user code",
+         rest_ms, 100.0 * rest_ms / loop_ms);
+}
+
+
+void AddPerfCounters(AnalysisResults *results) {
+  for (const auto &p : g_perf_phases) {
+    for (unsigned i = 0; i < kNumPerfCounters; ++i) {
+      if (p.values[i] >= 0.0) {
+        AddMetric(std::string("PerfCounters.") + p.name + "." +
+                  kPerfCounters[i].name, p.values[i], results);
+      }
+    }
+  }
+}
@@ -7,10 +7,23 @@
 
 #include <stdint.h>
 
+#include <functional>
 #include <string>
+#include <utility>
 #include <vector>
 
 class TFile;
+class TTree;
+class TTreePerfStats;
+namespace ROOT {
+namespace Experimental {
+class RNTupleDescriptor;
+class RNTupleReader;
+namespace Detail {
+class RNTupleMetrics;
+}
+}
+}
 
 enum class FileFormats
   { kRoot, kH5Row, kH5Column, kAvroDeflated, kAvroInflated,
@@ -42,4 +55,75 @@ int GetCompressionSettings(std::string shorthand);
 
 TFile *OpenOrDownload(const std::string &path);
 
+// Half-open [first, last) range of entry numbers
+typedef std::pair<uint64_t, uint64_t> EntryRange;
+
+std::vector<uint64_t> GetClusterStarts(
+  const ROOT::Experimental::RNTupleDescriptor &desc);
+std::vector<uint64_t> GetClusterStarts(TTree *tree);
+std::vector<EntryRange> PartitionEntries(
+  const std::vector<uint64_t> &cluster_starts,
+  const uint64_t n_entries,
+  const unsigned n_chunks);
+void RunInThreads(
+  const unsigned n_threads,
+  const std::function<void(unsigned)> &fn);
+
+uint64_t GetAverageClusterSize(
+  const std::string &ntuple_name,
+  const std::string &path);
+int CapClusterBunchSize(
+  const int cluster_bunch_size,
+  const uint64_t avg_cluster_size,
+  const unsigned memory_budget_mb);
+void PrintPrefetchSettings(
+  const int cluster_bunch_size,
+  const bool use_unzip_mt,
+  const unsigned memory_budget_mb,
+  const bool unzip_threads_only_mt);
+
+// Summary of an analysis run, printed as a single-line JSON object with --json.
+// Negative values are unknown and printed as null.
+struct AnalysisResults {
+  std::string analysis;
+  std::string input;
+  std::string method;
+  int64_t runtime_init_us = -1;
+  int64_t runtime_analysis_us = -1;
+  int64_t runtime_main_us = -1;
+  int64_t events_read = -1;
+  int64_t events_selected = -1;
+  int64_t bytes_read = -1;
+  // RNTuple metrics counters or TTreePerfStats numbers, summed over all
+  // readers or trees
+  std::vector<std::pair<std::string, double>> metrics;
+};
+
+// Prints the Runtime-Initialization and Runtime-Analysis lines and records
+// the values in results
+void PrintRuntime(
+  const int64_t runtime_init_us,
+  const int64_t runtime_analysis_us,
+  AnalysisResults *results);
+void AddNTupleMetrics(
+  const ROOT::Experimental::RNTupleReader &reader,
+  AnalysisResults *results);
+// For page sources that are used without a reader
+void AddNTupleMetrics(
+  const ROOT::Experimental::Detail::RNTupleMetrics &metrics,
+  AnalysisResults *results);
+void AddTreePerfStats(TTreePerfStats *perf_stats, AnalysisResults *results);
+std::string GetResultsJson(const AnalysisResults &results);
+
+// Hardware performance counters of the process (perf_event_open), split into
+// consecutive phases.  StartPerfCounters() opens the counters and starts the
+// first phase, MarkPerfPhase() ends the current phase and starts the next one.
+// Without StartPerfCounters(), the other functions do nothing.
+void StartPerfCounters();
+void MarkPerfPhase(const std::string &phase);
+// Prints the counters per phase and, based on the I/O timers in the results'
+// metrics, the split of the event loop into reading, decompression, and the rest
+void PrintPerfCounters(const AnalysisResults &results);
+void AddPerfCounters(AnalysisResults *results);
+
 #endif  // UTIL_H_